@@ -0,0 +1,38 @@
+# Writes the SPIR-V binaries INPUTS (a ;-list) into OUTPUT as `constexpr uint32_t` arrays and a registry mapping the
+# names in NAMES (same order) to them. Run with `cmake -P`, see `add_shaders` in CMakeLists.txt.
+# The header is only rewritten when its content changes so main.cpp isn't rebuilt needlessly.
+
+string(REPLACE "|" ";" INPUTS "${INPUTS}")
+string(REPLACE "|" ";" NAMES "${NAMES}")
+list(LENGTH INPUTS INPUT_COUNT)
+
+set(CONTENT "// Generated by cmake/EmbedShaders.cmake, do not edit.\n#pragma once\n\n")
+set(REGISTRY)
+math(EXPR LAST_INDEX "${INPUT_COUNT} - 1")
+foreach(INDEX RANGE ${LAST_INDEX})
+    list(GET INPUTS ${INDEX} INPUT)
+    list(GET NAMES ${INDEX} NAME)
+    string(MAKE_C_IDENTIFIER "EmbeddedShader_${NAME}" SYMBOL)
+
+    file(READ "${INPUT}" HEX HEX)
+    string(LENGTH "${HEX}" HEX_LENGTH)
+    math(EXPR REMAINDER "${HEX_LENGTH} % 8")
+    if(HEX_LENGTH EQUAL 0 OR NOT REMAINDER EQUAL 0)
+        message(FATAL_ERROR "${INPUT} is not a SPIR-V binary")
+    endif()
+    # SPIR-V words are little endian
+    string(REGEX REPLACE "(..)(..)(..)(..)" "0x\\4\\3\\2\\1," WORDS "${HEX}")
+    string(REGEX REPLACE "(0x........,0x........,0x........,0x........,0x........,0x........,0x........,0x........,)" "\\1\n    " WORDS "${WORDS}")
+    string(STRIP "${WORDS}" WORDS)
+
+    string(APPEND CONTENT "inline constexpr uint32_t ${SYMBOL}[] = {\n    ${WORDS}\n};\n")
+    string(APPEND REGISTRY "    EmbeddedShader{ \"${NAME}\", ${SYMBOL}, sizeof(${SYMBOL}) },\n")
+endforeach()
+string(APPEND CONTENT "\ninline constexpr std::array<EmbeddedShader, ${INPUT_COUNT}> EmbeddedShaderRegistry{\n${REGISTRY}};\n")
+
+if(EXISTS "${OUTPUT}")
+    file(READ "${OUTPUT}" PREVIOUS)
+endif()
+if(NOT PREVIOUS STREQUAL CONTENT)
+    file(WRITE "${OUTPUT}" "${CONTENT}")
+endif()
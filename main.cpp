@@ -20,6 +20,27 @@
 #include <queue>
 #include <assert.h>
 #include <fstream>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <cstring>
+#include <memory_resource>
+#include <deque>
+#include <typeinfo>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <filesystem>
+#include <thread>
+#include <condition_variable>
+#include <future>
+#include <atomic>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #define VK_USE_PLATFORM_WIN32_KHR
 #include <vulkan/vulkan.h>
 #define GLFW_INCLUDE_VULKAN
@@ -163,6 +184,14 @@ public:
             if (bool hasExtensions = std::all_of(extensions.begin(), extensions.end(), checkExtensions) & std::all_of(ValidationExtensions.begin(), ValidationExtensions.end(), checkExtensions); !hasExtensions) {
                 throw std::runtime_error("Unsupported extension in arguments");
             }
+
+            // the instance is 1.0, the `*2` physical device queries and the device extensions relying on them need it
+            m_physicalDeviceProperties2 = std::any_of(availableExtensions.begin(), availableExtensions.end(), [](const VkExtensionProperties& extension) {
+                return strcmp(extension.extensionName, VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME) == 0;
+            });
+            if (m_physicalDeviceProperties2 && std::none_of(extensions.begin(), extensions.end(), [](const char* extension) { return strcmp(extension, VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME) == 0; })) {
+                extensions.push_back(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+            }
         }
 
         VkInstanceCreateInfo createInfo = {};
@@ -173,11 +202,10 @@ public:
             createInfo.ppEnabledLayerNames = ValidationLayers.data();
 
             extensions.insert(extensions.end(), ValidationExtensions.begin(), ValidationExtensions.end());
-            createInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
-            createInfo.ppEnabledExtensionNames = extensions.data();
-
             createInfo.pNext = &debugCreateInfo;
         }
+        createInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
+        createInfo.ppEnabledExtensionNames = extensions.data();
 
         if (VkResult result = vkCreateInstance(&createInfo, nullptr, &m_instance); result != VK_SUCCESS) {
             throw std::runtime_error("failed to create instance!");
@@ -216,32 +244,1291 @@ public:
         return m_instance;
     }
 
-    bool IsEnableValidationLayers() const {
-        return m_enableValidationLayers;
+    bool IsEnableValidationLayers() const {
+        return m_enableValidationLayers;
+    }
+    // VK_KHR_get_physical_device_properties2 is enabled, its `*2KHR` queries may be used
+    bool HasPhysicalDeviceProperties2() const {
+        return m_physicalDeviceProperties2;
+    }
+
+protected:
+    static VKAPI_ATTR VkBool32 VKAPI_CALL debugCallback(VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity, VkDebugUtilsMessageTypeFlagsEXT messageType, const VkDebugUtilsMessengerCallbackDataEXT* pCallbackData, void* pUserData) {
+        std::cerr << "[ValidationLayer] " << pCallbackData->pMessage << std::endl;
+        return VK_FALSE;
+    }
+protected:
+    VkInstance m_instance = VK_NULL_HANDLE;
+    VkDebugUtilsMessengerEXT m_debugMessenger = VK_NULL_HANDLE;
+#ifdef NDEBUG
+    static constexpr bool EnableValidationLayers = false;
+#else
+    static constexpr bool EnableValidationLayers = true;
+#endif
+    bool m_enableValidationLayers = false;
+    bool m_physicalDeviceProperties2 = false;
+
+public:
+    constexpr static std::array<const char*, 1> ValidationLayers = {
+        "VK_LAYER_KHRONOS_validation"
+    };
+    constexpr static std::array<const char*, 1> ValidationExtensions = {
+        VK_EXT_DEBUG_UTILS_EXTENSION_NAME
+    };
+};
+
+// FNV-1a, for content hashes and corruption checks, not cryptographic.
+inline uint64_t HashBytes(const void* data, size_t size, uint64_t seed = 14695981039346656037ull) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; ++i) {
+        seed = (seed ^ bytes[i]) * 1099511628211ull;
+    }
+    return seed;
+}
+
+/**
+ * Bump allocator for short-lived scratch containers (`std::pmr::vector` etc.), nothing is freed until the outermost
+ * `Scope` ends. Allocations that don't fit the buffer fall back to the heap, the buffer then grows to the peak usage
+ * so the next frame/build runs without touching the heap.
+ * Not thread safe, use one arena per thread (see `ThreadLocal()`).
+ */
+class ScratchArena : public std::pmr::memory_resource {
+public:
+    // Rewind the arena to where it was when the scope began. Containers allocated inside must die with the scope.
+    class Scope {
+    public:
+        explicit Scope(ScratchArena& arena) : m_arena{ arena }, m_offset{ arena.m_offset }, m_used{ arena.m_used }, m_overflowCount{ arena.m_overflows.size() } {
+            ++m_arena.m_depth;
+        }
+        ~Scope() {
+            m_arena.rewind(m_offset, m_used, m_overflowCount);
+            if (--m_arena.m_depth == 0) {
+                m_arena.grow();
+            }
+        }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    protected:
+        ScratchArena& m_arena;
+        size_t m_offset, m_used, m_overflowCount;
+    };
+
+    explicit ScratchArena(size_t capacity = 64 * 1024) : m_buffer{ new std::byte[capacity] }, m_capacity{ capacity } {
+
+    }
+    ~ScratchArena() {
+        rewind(0, 0, 0);
+    }
+    ScratchArena(const ScratchArena&) = delete;
+    ScratchArena& operator=(const ScratchArena&) = delete;
+
+    static ScratchArena& ThreadLocal() {
+        thread_local ScratchArena arena;
+        return arena;
+    }
+
+    inline size_t GetCapacity() const noexcept {
+        return m_capacity;
+    }
+    inline size_t GetPeakBytes() const noexcept {
+        return m_peak;
+    }
+    // Number of allocations that missed the buffer and went to the heap.
+    inline size_t GetOverflowCount() const noexcept {
+        return m_overflowCount;
+    }
+protected:
+    struct Overflow {
+        void *pointer;
+        size_t bytes, alignment;
+    };
+    std::unique_ptr<std::byte[]> m_buffer;
+    size_t m_capacity;
+    size_t m_offset = 0;
+    size_t m_used = 0, m_peak = 0; // include heap fallbacks
+    size_t m_overflowCount = 0;
+    std::vector<Overflow> m_overflows;
+    uint32_t m_depth = 0;
+
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        const uintptr_t base = reinterpret_cast<uintptr_t>(m_buffer.get());
+        const size_t offset = static_cast<size_t>(((base + m_offset + alignment - 1) & ~(uintptr_t)(alignment - 1)) - base);
+        if (offset + bytes <= m_capacity) {
+            m_used += offset - m_offset + bytes;
+            m_peak = std::max(m_peak, m_used);
+            m_offset = offset + bytes;
+            return m_buffer.get() + offset;
+        }
+
+        void *pointer = std::pmr::new_delete_resource()->allocate(bytes, alignment);
+        m_overflows.push_back(Overflow{ pointer, bytes, alignment });
+        ++m_overflowCount;
+        m_used += bytes + alignment;
+        m_peak = std::max(m_peak, m_used);
+        return pointer;
+    }
+    void do_deallocate(void*, size_t, size_t) override {
+        // released all at once by the scope
+    }
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+    void rewind(size_t offset, size_t used, size_t overflowCount) {
+        while (m_overflows.size() > overflowCount) {
+            const Overflow& overflow = m_overflows.back();
+            std::pmr::new_delete_resource()->deallocate(overflow.pointer, overflow.bytes, overflow.alignment);
+            m_overflows.pop_back();
+        }
+        m_offset = offset;
+        m_used = used;
+    }
+    void grow() {
+        if (m_peak <= m_capacity) return;
+        while (m_capacity < m_peak) m_capacity *= 2;
+        m_buffer.reset(new std::byte[m_capacity]);
+    }
+};
+
+/**
+ * Fixed set of worker threads for fork-join jobs. `ParallelFor(count, task)` runs `task(index, worker)` for every index
+ * and returns when all of them are done, the calling thread joins in as worker 0. If tasks throw, the exception of the
+ * lowest index is rethrown once every task finished, so a failing job fails the same way on every run.
+ * Jobs are issued from one thread at a time and tasks must not start jobs themselves.
+ */
+class WorkerPool {
+public:
+    typedef std::function<void(size_t index, size_t worker)> Task;
+
+    explicit WorkerPool(size_t workerCount = std::max(std::thread::hardware_concurrency(), 1u)) {
+        for (size_t worker = 1; worker < workerCount; ++worker) {
+            m_threads.emplace_back([this, worker]() { workerLoop(worker); });
+        }
+    }
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock{ m_mutex };
+            m_stop = true;
+        }
+        m_wake.notify_all();
+        for (std::thread& thread : m_threads) {
+            thread.join();
+        }
+    }
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    inline size_t GetWorkerCount() const noexcept {
+        return m_threads.size() + 1;
+    }
+
+    void ParallelFor(size_t count, const Task& task) {
+        if (count == 0) return;
+        std::vector<std::exception_ptr> errors(count);
+        {
+            std::lock_guard<std::mutex> lock{ m_mutex };
+            m_task = &task;
+            m_errors = &errors;
+            m_count = count;
+            m_next = 0;
+            m_pending = count;
+            ++m_generation;
+        }
+        m_wake.notify_all();
+        runTasks(0);
+        {
+            std::unique_lock<std::mutex> lock{ m_mutex };
+            m_done.wait(lock, [this]() { return m_pending == 0; });
+            m_task = nullptr;
+            m_errors = nullptr;
+        }
+
+        for (std::exception_ptr& error : errors) {
+            if (error) std::rethrow_exception(error);
+        }
+    }
+protected:
+    void workerLoop(size_t worker) {
+        uint64_t generation = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock{ m_mutex };
+                m_wake.wait(lock, [this, generation]() { return m_stop || m_generation != generation; });
+                if (m_stop) return;
+                generation = m_generation;
+            }
+            runTasks(worker);
+        }
+    }
+    void runTasks(size_t worker) {
+        while (true) {
+            const Task* task;
+            std::vector<std::exception_ptr>* errors;
+            size_t index;
+            {
+                std::lock_guard<std::mutex> lock{ m_mutex };
+                if (m_task == nullptr || m_next >= m_count) return;
+                task = m_task;
+                errors = m_errors;
+                index = m_next++;
+            }
+
+            try {
+                (*task)(index, worker);
+            } catch (...) {
+                (*errors)[index] = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> lock{ m_mutex };
+            if (--m_pending == 0) {
+                m_done.notify_all();
+            }
+        }
+    }
+protected:
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex; // guards everything below
+    std::condition_variable m_wake, m_done;
+    bool m_stop = false;
+
+    const Task* m_task = nullptr; // borrow, valid during `ParallelFor()`
+    std::vector<std::exception_ptr>* m_errors = nullptr; // borrow, valid during `ParallelFor()`
+    size_t m_count = 0, m_next = 0, m_pending = 0;
+    uint64_t m_generation = 0;
+};
+
+/**
+ * One background thread running tasks in two priorities. Idle tasks only run while no urgent task is queued, urgent tasks
+ * pushed meanwhile overtake them. Tasks must not throw.
+ */
+class BackgroundQueue {
+public:
+    typedef std::function<void()> Task;
+    enum class Priority {
+        Urgent,
+        Idle
+    };
+
+    BackgroundQueue() : m_thread{ [this]() { workerLoop(); } } { }
+    // Queued tasks are dropped, the running one finishes.
+    ~BackgroundQueue() {
+        {
+            std::lock_guard<std::mutex> lock{ m_mutex };
+            m_stop = true;
+            m_urgent.clear();
+            m_idle.clear();
+        }
+        m_wake.notify_all();
+        m_thread.join();
+    }
+    BackgroundQueue(const BackgroundQueue&) = delete;
+    BackgroundQueue& operator=(const BackgroundQueue&) = delete;
+
+    void Push(Priority priority, Task task) {
+        {
+            std::lock_guard<std::mutex> lock{ m_mutex };
+            (priority == Priority::Urgent ? m_urgent : m_idle).push_back(std::move(task));
+        }
+        m_wake.notify_all();
+    }
+    // Drop the queued tasks and wait for the running one.
+    void Clear() {
+        std::unique_lock<std::mutex> lock{ m_mutex };
+        m_urgent.clear();
+        m_idle.clear();
+        m_done.wait(lock, [this]() { return !m_running; });
+    }
+    void WaitIdle() {
+        std::unique_lock<std::mutex> lock{ m_mutex };
+        m_done.wait(lock, [this]() { return !m_running && m_urgent.empty() && m_idle.empty(); });
+    }
+    size_t GetPendingCount(Priority priority) const {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        return priority == Priority::Urgent ? m_urgent.size() : m_idle.size();
+    }
+protected:
+    void workerLoop() {
+        std::unique_lock<std::mutex> lock{ m_mutex };
+        while (true) {
+            m_wake.wait(lock, [this]() { return m_stop || !m_urgent.empty() || !m_idle.empty(); });
+            if (m_stop) return;
+            std::deque<Task>& queue = m_urgent.empty() ? m_idle : m_urgent;
+            Task task = std::move(queue.front());
+            queue.pop_front();
+            m_running = true;
+
+            lock.unlock();
+            task();
+            lock.lock();
+
+            m_running = false;
+            m_done.notify_all();
+        }
+    }
+protected:
+    mutable std::mutex m_mutex; // guards everything below
+    std::condition_variable m_wake, m_done;
+    std::deque<Task> m_urgent, m_idle;
+    bool m_running = false;
+    bool m_stop = false;
+    std::thread m_thread; // last, starts after everything above is initialized
+};
+
+class IVulkanRelocatable;
+
+/**
+ * Sub-allocate device memory from big `VkDeviceMemory` blocks instead of one allocation per resource.
+ * Blocks are grouped into pools by memory type and resource kind, linear resources (buffers) and optimal resources (images)
+ * never share a block so `bufferImageGranularity` can be ignored. Each block is managed as a buddy system, allocations
+ * are rounded up to a power of two and freed ranges are merged back with their buddies.
+ * Allocations larger than a block get a dedicated `VkDeviceMemory`.
+ * Usage is tracked per heap and per category (e.g. "color image"), `DumpJson()` writes a snapshot on demand and
+ * `EndFrame()` appends one every N frames when enabled by `SetDumpInterval()`. Heap budgets come from `VK_EXT_memory_budget`
+ * when the device supports it.
+ */
+class VulkanMemoryAllocator {
+public:
+    enum class ResourceKind {
+        Linear,
+        Optimal
+    };
+    struct Block {
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        VkDeviceSize size = 0;
+        bool dedicated = false;
+
+        // buddy system, `freeLists[order]` holds offsets of free ranges with size `MinAllocationSize << order`
+        uint32_t maxOrder = 0;
+        std::vector< std::set<VkDeviceSize> > freeLists;
+        VkDeviceSize used = 0;
+        size_t allocationCount = 0;
+
+        void *mapped = nullptr;
+        uint32_t mapCount = 0;
+    };
+    struct Allocation {
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        VkDeviceSize offset = 0;
+        VkDeviceSize size = 0;
+        uint32_t memoryTypeIndex = 0;
+
+        inline const Block* GetBlock() const noexcept {
+            return block;
+        }
+    protected:
+        friend VulkanMemoryAllocator;
+        Block *block = nullptr; // borrow, owned by the pool
+        const char *category = nullptr; // string literal
+        ResourceKind kind = ResourceKind::Linear;
+        uint32_t order = 0;
+    };
+    struct Statistics {
+        uint64_t allocateCount = 0, freeCount = 0;
+        double totalAllocateMicroseconds = 0.0, maxAllocateMicroseconds = 0.0;
+        double totalFreeMicroseconds = 0.0, maxFreeMicroseconds = 0.0;
+        size_t deviceMemoryCount = 0;
+        VkDeviceSize blockBytes = 0, usedBytes = 0, peakUsedBytes = 0;
+    };
+    struct HeapStatistics {
+        VkDeviceSize size = 0;
+        VkMemoryHeapFlags flags = 0;
+        size_t blockCount = 0, allocationCount = 0;
+        VkDeviceSize blockBytes = 0, usedBytes = 0, peakUsedBytes = 0;
+        VkDeviceSize freeBytes = 0, largestFreeBlock = 0;
+        // 1 - largestFreeBlock / freeBytes, 0 means all free space of the heap is in one range
+        double fragmentation = 0.0;
+        // from `VK_EXT_memory_budget`, include memory of other processes, 0 if unsupported
+        VkDeviceSize budget = 0, usage = 0;
+    };
+    struct CategoryStatistics {
+        size_t allocationCount = 0;
+        VkDeviceSize usedBytes = 0, peakUsedBytes = 0;
+    };
+
+    static constexpr VkDeviceSize MinAllocationSize = 256;
+    static constexpr VkDeviceSize DefaultBlockSize = 64ull * 1024 * 1024;
+    static constexpr size_t KeepEmptyBlocks = 1;
+
+    // `getMemoryProperties2` is used to query heap budgets, pass nullptr if `VK_EXT_memory_budget` is not enabled.
+    VulkanMemoryAllocator(VkPhysicalDevice physicalDevice, VkDevice device, PFN_vkGetPhysicalDeviceMemoryProperties2KHR getMemoryProperties2 = nullptr) : m_physicalDevice{ physicalDevice }, m_device{ device }, m_getMemoryProperties2{ getMemoryProperties2 } {
+        vkGetPhysicalDeviceMemoryProperties(physicalDevice, &m_memoryProperties);
+
+        VkPhysicalDeviceProperties deviceProperties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
+        m_maxMemoryAllocationCount = deviceProperties.limits.maxMemoryAllocationCount;
+        m_nonCoherentAtomSize = std::max<VkDeviceSize>(deviceProperties.limits.nonCoherentAtomSize, 1);
+    }
+    ~VulkanMemoryAllocator() {
+        size_t leaked = 0;
+        for (auto& [key, pool] : m_pools) {
+            for (std::unique_ptr<Block>& block : pool) {
+                leaked += block->allocationCount;
+                destroyBlock(*block);
+            }
+        }
+        if (leaked != 0) {
+            std::cerr << "[VulkanMemoryAllocator][Warning] " << leaked << " allocations are not freed before destroying allocator." << std::endl;
+            for (const auto& [category, stats] : m_categories) {
+                if (stats.allocationCount == 0) continue;
+                std::cerr << "[VulkanMemoryAllocator][Warning] Leaked " << stats.allocationCount << " " << category << " allocations, " << stats.usedBytes << " bytes." << std::endl;
+            }
+        }
+    }
+    VulkanMemoryAllocator(const VulkanMemoryAllocator&) = delete;
+    VulkanMemoryAllocator& operator=(const VulkanMemoryAllocator&) = delete;
+
+    // `category` must be a string literal, it groups allocations in statistics.
+    Allocation Allocate(const VkMemoryRequirements& requirements, uint32_t memoryTypeIndex, ResourceKind kind, const char* category = "uncategorized") {
+        const auto start = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock{ m_mutex };
+
+        Allocation allocation;
+        allocation.memoryTypeIndex = memoryTypeIndex;
+        allocation.kind = kind;
+        allocation.category = category;
+        allocation.size = requirements.size;
+
+        std::vector< std::unique_ptr<Block> >& pool = m_pools[{ memoryTypeIndex, kind }];
+        const VkDeviceSize blockSize = getBlockSize(memoryTypeIndex);
+        // buddies are aligned to their own size inside a block, and the block itself satisfies any alignment
+        const VkDeviceSize required = std::max(requirements.size, requirements.alignment);
+        // lazily allocated memory is committed for the whole allocation as soon as any image in it needs backing, a
+        // shared block would commit it for every image suballocated from it
+        const bool lazy = (m_memoryProperties.memoryTypes[memoryTypeIndex].propertyFlags & VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT) != 0;
+
+        if (required > blockSize || lazy) {
+            Block& block = *pool.emplace_back(createBlock(required, memoryTypeIndex, true));
+            block.used = required;
+            block.allocationCount = 1;
+            allocation.memory = block.memory;
+            allocation.block = &block;
+        } else {
+            allocation.order = orderOf(required);
+            bool found = false;
+            for (std::unique_ptr<Block>& block : pool) {
+                if (!block->dedicated && tryAllocate(*block, allocation.order, allocation.offset)) {
+                    allocation.block = block.get();
+                    found = true;
+                    break;
+                }
+            }
+            if (!found) {
+                Block& block = *pool.emplace_back(createBlock(blockSize, memoryTypeIndex, false));
+                if (!tryAllocate(block, allocation.order, allocation.offset)) {
+                    throw std::logic_error("should not reach here");
+                }
+                allocation.block = &block;
+            }
+            allocation.memory = allocation.block->memory;
+            allocation.block->used += MinAllocationSize << allocation.order;
+            ++allocation.block->allocationCount;
+        }
+
+        onUsedChanged(allocation, allocation.block->dedicated ? allocation.block->size : (MinAllocationSize << allocation.order), true);
+        ++m_stats.allocateCount;
+        const double elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        m_stats.totalAllocateMicroseconds += elapsed;
+        m_stats.maxAllocateMicroseconds = std::max(m_stats.maxAllocateMicroseconds, elapsed);
+        return allocation;
+    }
+
+    void Free(const Allocation& allocation) {
+        if (allocation.block == nullptr) return;
+
+        const auto start = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock{ m_mutex };
+
+        Block& block = *allocation.block;
+        const VkDeviceSize released = block.dedicated ? block.size : (MinAllocationSize << allocation.order);
+        if (!block.dedicated) {
+            release(block, allocation.offset, allocation.order);
+        }
+        block.used -= released;
+        --block.allocationCount;
+        onUsedChanged(allocation, released, false);
+
+        if (block.allocationCount == 0) {
+            // keep a few empty blocks around so that the next allocation (e.g. after swapchain resize) doesn't hit the driver
+            std::vector< std::unique_ptr<Block> >& pool = m_pools.at({ allocation.memoryTypeIndex, allocation.kind });
+            const size_t emptyBlocks = std::count_if(pool.begin(), pool.end(), [](const std::unique_ptr<Block>& b) { return !b->dedicated && b->allocationCount == 0; });
+            if (block.dedicated || emptyBlocks > KeepEmptyBlocks) {
+                destroyBlock(block);
+                pool.erase(std::find_if(pool.begin(), pool.end(), [&block](const std::unique_ptr<Block>& b) { return b.get() == &block; }));
+            }
+        }
+
+        ++m_stats.freeCount;
+        const double elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        m_stats.totalFreeMicroseconds += elapsed;
+        m_stats.maxFreeMicroseconds = std::max(m_stats.maxFreeMicroseconds, elapsed);
+    }
+
+    // Allocate a new home for `from` during defragmentation: only in another block of the same pool which is already
+    // fuller than the one of `from`, so resources flow from sparse blocks to dense ones and never back. Never creates a block.
+    std::optional<Allocation> AllocateForMove(const Allocation& from, const VkMemoryRequirements& requirements) {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        if (from.block == nullptr || from.block->dedicated) return std::nullopt;
+
+        const VkDeviceSize required = std::max(requirements.size, requirements.alignment);
+        std::vector< std::unique_ptr<Block> >& pool = m_pools.at({ from.memoryTypeIndex, from.kind });
+        std::vector<Block*> candidates;
+        for (std::unique_ptr<Block>& block : pool) {
+            if (block.get() != from.block && !block->dedicated && block->used > from.block->used && required <= block->size) {
+                candidates.push_back(block.get());
+            }
+        }
+        std::sort(candidates.begin(), candidates.end(), [](const Block* a, const Block* b) { return a->used > b->used; });
+
+        Allocation allocation;
+        allocation.memoryTypeIndex = from.memoryTypeIndex;
+        allocation.kind = from.kind;
+        allocation.category = from.category;
+        allocation.size = requirements.size;
+        allocation.order = orderOf(required);
+        for (Block* block : candidates) {
+            if (!tryAllocate(*block, allocation.order, allocation.offset)) continue;
+
+            allocation.block = block;
+            allocation.memory = block->memory;
+            block->used += MinAllocationSize << allocation.order;
+            ++block->allocationCount;
+            onUsedChanged(allocation, MinAllocationSize << allocation.order, true);
+            ++m_stats.allocateCount;
+            return allocation;
+        }
+        return std::nullopt;
+    }
+    // Blocks worth emptying: used less than `maxUsage` of their size, in pools that have other blocks to move into.
+    // Sorted from the sparsest one.
+    std::vector<const Block*> QuerySparseBlocks(double maxUsage) const {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        std::vector<const Block*> result;
+        for (const auto& [key, pool] : m_pools) {
+            if (std::count_if(pool.begin(), pool.end(), [](const std::unique_ptr<Block>& b) { return !b->dedicated && b->allocationCount != 0; }) < 2) continue;
+            for (const std::unique_ptr<Block>& block : pool) {
+                if (!block->dedicated && block->allocationCount != 0 && block->used < maxUsage * block->size) {
+                    result.push_back(block.get());
+                }
+            }
+        }
+        std::sort(result.begin(), result.end(), [](const Block* a, const Block* b) { return static_cast<double>(a->used) / a->size < static_cast<double>(b->used) / b->size; });
+        return result;
+    }
+
+    // Resources that can be moved by the defragmenter register themselves here.
+    void RegisterRelocatable(IVulkanRelocatable* relocatable) {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        m_relocatables.insert(relocatable);
+    }
+    void UnregisterRelocatable(IVulkanRelocatable* relocatable) {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        m_relocatables.erase(relocatable);
+    }
+    std::vector<IVulkanRelocatable*> GetRelocatables() const {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        return std::vector<IVulkanRelocatable*>(m_relocatables.begin(), m_relocatables.end());
+    }
+
+    // Blocks are mapped as a whole and reference counted, since a `VkDeviceMemory` can be mapped only once.
+    void* Map(const Allocation& allocation) {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        Block& block = *allocation.block;
+        if (block.mapCount == 0) {
+            if (VkResult result = vkMapMemory(m_device, block.memory, 0, VK_WHOLE_SIZE, 0, &block.mapped); result != VK_SUCCESS) {
+                throw std::runtime_error("failed to map memory!");
+            }
+        }
+        ++block.mapCount;
+        return static_cast<char*>(block.mapped) + allocation.offset;
+    }
+    void Unmap(const Allocation& allocation) {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        Block& block = *allocation.block;
+        if (block.mapCount == 0) {
+            throw std::logic_error("unmap a memory that is not mapped");
+        }
+        if (--block.mapCount == 0) {
+            vkUnmapMemory(m_device, block.memory);
+            block.mapped = nullptr;
+        }
+    }
+
+    // Make host writes visible to the device / device writes visible to the host, only needed for non-coherent memory.
+    // `offset` is relative to the allocation, the range is expanded to `nonCoherentAtomSize`.
+    void Flush(const Allocation& allocation, VkDeviceSize offset, VkDeviceSize size) {
+        VkMappedMemoryRange range = getMappedRange(allocation, offset, size);
+        if (VkResult result = vkFlushMappedMemoryRanges(m_device, 1, &range); result != VK_SUCCESS) {
+            throw std::runtime_error("failed to flush mapped memory!");
+        }
+    }
+    void Invalidate(const Allocation& allocation, VkDeviceSize offset, VkDeviceSize size) {
+        VkMappedMemoryRange range = getMappedRange(allocation, offset, size);
+        if (VkResult result = vkInvalidateMappedMemoryRanges(m_device, 1, &range); result != VK_SUCCESS) {
+            throw std::runtime_error("failed to invalidate mapped memory!");
+        }
+    }
+    inline VkMemoryPropertyFlags GetMemoryTypeFlags(uint32_t memoryTypeIndex) const noexcept {
+        return m_memoryProperties.memoryTypes[memoryTypeIndex].propertyFlags;
+    }
+
+    Statistics GetStatistics() const {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        return m_stats;
+    }
+    std::vector<HeapStatistics> GetHeapStatistics() const {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        std::vector<HeapStatistics> heaps(m_memoryProperties.memoryHeapCount);
+        for (uint32_t i = 0; i < m_memoryProperties.memoryHeapCount; ++i) {
+            heaps[i].size = m_memoryProperties.memoryHeaps[i].size;
+            heaps[i].flags = m_memoryProperties.memoryHeaps[i].flags;
+            heaps[i].usedBytes = m_heapUsedBytes[i];
+            heaps[i].peakUsedBytes = m_heapPeakUsedBytes[i];
+        }
+        for (const auto& [key, pool] : m_pools) {
+            HeapStatistics& heap = heaps[m_memoryProperties.memoryTypes[key.first].heapIndex];
+            for (const std::unique_ptr<Block>& block : pool) {
+                ++heap.blockCount;
+                heap.allocationCount += block->allocationCount;
+                heap.blockBytes += block->size;
+                if (block->dedicated) continue;
+
+                heap.freeBytes += block->size - block->used;
+                for (uint32_t order = block->maxOrder + 1; order-- > 0; ) {
+                    if (block->freeLists[order].empty()) continue;
+                    heap.largestFreeBlock = std::max(heap.largestFreeBlock, MinAllocationSize << order);
+                    break;
+                }
+            }
+        }
+        for (HeapStatistics& heap : heaps) {
+            heap.fragmentation = heap.freeBytes == 0 ? 0.0 : 1.0 - static_cast<double>(heap.largestFreeBlock) / heap.freeBytes;
+        }
+
+        if (m_getMemoryProperties2 != nullptr) {
+            VkPhysicalDeviceMemoryBudgetPropertiesEXT budget{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT, nullptr };
+            VkPhysicalDeviceMemoryProperties2 properties{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2, &budget };
+            m_getMemoryProperties2(m_physicalDevice, &properties);
+            for (uint32_t i = 0; i < m_memoryProperties.memoryHeapCount; ++i) {
+                heaps[i].budget = budget.heapBudget[i];
+                heaps[i].usage = budget.heapUsage[i];
+            }
+        }
+        return heaps;
+    }
+    std::map<std::string, CategoryStatistics> GetCategoryStatistics() const {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        return m_categories;
+    }
+    inline bool IsBudgetSupported() const noexcept {
+        return m_getMemoryProperties2 != nullptr;
+    }
+
+    // Watermarks record the peak usage between `BeginWatermark()` and `EndWatermark()`, e.g. around a swapchain resize.
+    // They can be nested.
+    void BeginWatermark() {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        m_watermarks.push_back(m_stats.usedBytes);
+    }
+    VkDeviceSize EndWatermark() {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        if (m_watermarks.empty()) {
+            throw std::logic_error("EndWatermark() without BeginWatermark()");
+        }
+        const VkDeviceSize peak = m_watermarks.back();
+        m_watermarks.pop_back();
+        return peak;
+    }
+
+    void DumpJson(std::ostream& out, const char* event = "snapshot") const {
+        const Statistics stats = GetStatistics();
+        const std::vector<HeapStatistics> heaps = GetHeapStatistics();
+        const std::map<std::string, CategoryStatistics> categories = GetCategoryStatistics();
+
+        out << "{\"event\":\"" << event << "\",\"frame\":" << m_frameIndex
+            << ",\"deviceMemoryCount\":" << stats.deviceMemoryCount << ",\"allocateCount\":" << stats.allocateCount << ",\"freeCount\":" << stats.freeCount
+            << ",\"blockBytes\":" << stats.blockBytes << ",\"usedBytes\":" << stats.usedBytes << ",\"peakUsedBytes\":" << stats.peakUsedBytes
+            << ",\"heaps\":[";
+        for (size_t i = 0; i < heaps.size(); ++i) {
+            const HeapStatistics& heap = heaps[i];
+            out << (i == 0 ? "" : ",") << "{\"index\":" << i << ",\"deviceLocal\":" << ((heap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) ? "true" : "false")
+                << ",\"size\":" << heap.size << ",\"budget\":" << heap.budget << ",\"usage\":" << heap.usage
+                << ",\"blockCount\":" << heap.blockCount << ",\"allocationCount\":" << heap.allocationCount
+                << ",\"blockBytes\":" << heap.blockBytes << ",\"usedBytes\":" << heap.usedBytes << ",\"peakUsedBytes\":" << heap.peakUsedBytes
+                << ",\"largestFreeBlock\":" << heap.largestFreeBlock << ",\"fragmentation\":" << heap.fragmentation << "}";
+        }
+        out << "],\"categories\":{";
+        bool first = true;
+        for (const auto& [category, category_stats] : categories) {
+            out << (first ? "" : ",") << "\"" << category << "\":{\"allocationCount\":" << category_stats.allocationCount
+                << ",\"usedBytes\":" << category_stats.usedBytes << ",\"peakUsedBytes\":" << category_stats.peakUsedBytes << "}";
+            first = false;
+        }
+        out << "}}";
+    }
+    void DumpJson(const std::string& path, const char* event = "snapshot") const {
+        std::ofstream file{ path };
+        if (!file.is_open()) {
+            throw std::runtime_error("failed to open file: " + path);
+        }
+        DumpJson(file, event);
+        file << std::endl;
+    }
+    // Append a snapshot to `path` (one json object per line) every `frames` frames, 0 disables it.
+    void SetDumpInterval(uint32_t frames, const std::string& path = "memory_stats.jsonl") {
+        m_dumpInterval = frames;
+        m_dumpPath = path;
+    }
+    void EndFrame() {
+        ++m_frameIndex;
+        if (m_dumpInterval == 0 || m_frameIndex % m_dumpInterval != 0) return;
+
+        std::ofstream file{ m_dumpPath, std::ios::app };
+        if (!file.is_open()) {
+            std::cerr << "[VulkanMemoryAllocator][Warning] Failed to open " << m_dumpPath << ", periodic dump disabled." << std::endl;
+            m_dumpInterval = 0;
+            return;
+        }
+        DumpJson(file, "frame");
+        file << std::endl;
+    }
+
+    void PrintStatistics() const {
+        Statistics stats = GetStatistics();
+        std::cout << "[VulkanMemoryAllocator] " << stats.deviceMemoryCount << " device memories, " << stats.usedBytes << "/" << stats.blockBytes << " bytes used, peak " << stats.peakUsedBytes << " bytes." << std::endl;
+        std::cout << "[VulkanMemoryAllocator] Allocate: " << stats.allocateCount << " calls, avg " << (stats.allocateCount ? stats.totalAllocateMicroseconds / stats.allocateCount : 0.0) << "us, max " << stats.maxAllocateMicroseconds << "us." << std::endl;
+        std::cout << "[VulkanMemoryAllocator] Free: " << stats.freeCount << " calls, avg " << (stats.freeCount ? stats.totalFreeMicroseconds / stats.freeCount : 0.0) << "us, max " << stats.maxFreeMicroseconds << "us." << std::endl;
+        const std::vector<HeapStatistics> heaps = GetHeapStatistics();
+        for (size_t i = 0; i < heaps.size(); ++i) {
+            std::cout << "[VulkanMemoryAllocator] Heap " << i << ": " << heaps[i].allocationCount << " allocations, " << heaps[i].usedBytes << "/" << heaps[i].blockBytes << " bytes used, peak " << heaps[i].peakUsedBytes << " bytes, largest free " << heaps[i].largestFreeBlock << " bytes, fragmentation " << heaps[i].fragmentation;
+            if (IsBudgetSupported()) {
+                std::cout << ", budget " << heaps[i].usage << "/" << heaps[i].budget << " bytes";
+            }
+            std::cout << "." << std::endl;
+        }
+    }
+
+protected:
+    VkPhysicalDevice m_physicalDevice;
+    VkDevice m_device;
+    PFN_vkGetPhysicalDeviceMemoryProperties2KHR m_getMemoryProperties2 = nullptr;
+    VkPhysicalDeviceMemoryProperties m_memoryProperties;
+    uint32_t m_maxMemoryAllocationCount = std::numeric_limits<uint32_t>::max();
+    VkDeviceSize m_nonCoherentAtomSize = 1;
+
+    mutable std::mutex m_mutex;
+    std::map< std::pair<uint32_t, ResourceKind>, std::vector< std::unique_ptr<Block> > > m_pools;
+    Statistics m_stats;
+    std::array<VkDeviceSize, VK_MAX_MEMORY_HEAPS> m_heapUsedBytes{}, m_heapPeakUsedBytes{};
+    std::map<std::string, CategoryStatistics> m_categories;
+    std::vector<VkDeviceSize> m_watermarks; // peak usage of each open watermark
+    std::set<IVulkanRelocatable*> m_relocatables; // borrow
+
+    uint64_t m_frameIndex = 0;
+    uint32_t m_dumpInterval = 0;
+    std::string m_dumpPath;
+
+protected:
+    VkMappedMemoryRange getMappedRange(const Allocation& allocation, VkDeviceSize offset, VkDeviceSize size) const {
+        if (size == VK_WHOLE_SIZE) {
+            size = allocation.size - offset;
+        }
+        VkMappedMemoryRange range{ VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE, nullptr, allocation.memory };
+        range.offset = (allocation.offset + offset) / m_nonCoherentAtomSize * m_nonCoherentAtomSize;
+        const VkDeviceSize end = (allocation.offset + offset + size + m_nonCoherentAtomSize - 1) / m_nonCoherentAtomSize * m_nonCoherentAtomSize;
+        // rounding up may pass the end of the `VkDeviceMemory`, which is only valid as VK_WHOLE_SIZE
+        range.size = end >= allocation.block->size ? VK_WHOLE_SIZE : end - range.offset;
+        return range;
+    }
+    void onUsedChanged(const Allocation& allocation, VkDeviceSize bytes, bool allocated) {
+        const uint32_t heapIndex = m_memoryProperties.memoryTypes[allocation.memoryTypeIndex].heapIndex;
+        CategoryStatistics& category = m_categories[allocation.category];
+        if (allocated) {
+            m_stats.usedBytes += bytes;
+            m_heapUsedBytes[heapIndex] += bytes;
+            category.usedBytes += bytes;
+            ++category.allocationCount;
+        } else {
+            m_stats.usedBytes -= bytes;
+            m_heapUsedBytes[heapIndex] -= bytes;
+            category.usedBytes -= bytes;
+            --category.allocationCount;
+        }
+        m_stats.peakUsedBytes = std::max(m_stats.peakUsedBytes, m_stats.usedBytes);
+        m_heapPeakUsedBytes[heapIndex] = std::max(m_heapPeakUsedBytes[heapIndex], m_heapUsedBytes[heapIndex]);
+        category.peakUsedBytes = std::max(category.peakUsedBytes, category.usedBytes);
+        for (VkDeviceSize& watermark : m_watermarks) {
+            watermark = std::max(watermark, m_stats.usedBytes);
+        }
+    }
+
+    static uint32_t orderOf(VkDeviceSize size) {
+        uint32_t order = 0;
+        while ((MinAllocationSize << order) < size) ++order;
+        return order;
+    }
+    VkDeviceSize getBlockSize(uint32_t memoryTypeIndex) const {
+        // small heaps (e.g. 256MB BAR) shouldn't be eaten by a few blocks
+        const VkDeviceSize heapSize = m_memoryProperties.memoryHeaps[m_memoryProperties.memoryTypes[memoryTypeIndex].heapIndex].size;
+        VkDeviceSize blockSize = DefaultBlockSize;
+        while (blockSize > MinAllocationSize && blockSize > heapSize / 8) blockSize >>= 1;
+        return blockSize;
+    }
+    std::unique_ptr<Block> createBlock(VkDeviceSize size, uint32_t memoryTypeIndex, bool dedicated) {
+        if (m_stats.deviceMemoryCount >= m_maxMemoryAllocationCount) {
+            throw std::runtime_error("failed to allocate memory! exceed maxMemoryAllocationCount.");
+        }
+
+        std::unique_ptr<Block> block = std::make_unique<Block>();
+        block->size = size;
+        block->dedicated = dedicated;
+        if (!dedicated) {
+            block->maxOrder = orderOf(size);
+            block->freeLists.resize(block->maxOrder + 1);
+            block->freeLists[block->maxOrder].insert(0);
+        }
+
+        if (m_getMemoryProperties2 != nullptr) {
+            // going over budget doesn't fail immediately but the driver may start paging or fail later allocations
+            const uint32_t heapIndex = m_memoryProperties.memoryTypes[memoryTypeIndex].heapIndex;
+            VkPhysicalDeviceMemoryBudgetPropertiesEXT budget{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT, nullptr };
+            VkPhysicalDeviceMemoryProperties2 properties{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2, &budget };
+            m_getMemoryProperties2(m_physicalDevice, &properties);
+            if (budget.heapUsage[heapIndex] + size > budget.heapBudget[heapIndex]) {
+                std::cerr << "[VulkanMemoryAllocator][Warning] Allocating " << size << " bytes exceeds the budget of heap " << heapIndex << ": " << budget.heapUsage[heapIndex] << "/" << budget.heapBudget[heapIndex] << " bytes used." << std::endl;
+            }
+        }
+
+        VkMemoryAllocateInfo memAllocInfo{ VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, nullptr };
+        memAllocInfo.allocationSize = size;
+        memAllocInfo.memoryTypeIndex = memoryTypeIndex;
+        if (VkResult result = vkAllocateMemory(m_device, &memAllocInfo, nullptr, &block->memory); result != VK_SUCCESS) {
+            throw std::runtime_error("failed to allocate memory!");
+        }
+
+        ++m_stats.deviceMemoryCount;
+        m_stats.blockBytes += size;
+        return block;
+    }
+    void destroyBlock(Block& block) {
+        if (block.mapCount != 0) {
+            vkUnmapMemory(m_device, block.memory);
+        }
+        vkFreeMemory(m_device, block.memory, nullptr);
+        --m_stats.deviceMemoryCount;
+        m_stats.blockBytes -= block.size;
+    }
+    static bool tryAllocate(Block& block, uint32_t order, VkDeviceSize& offset) {
+        if (order > block.maxOrder) return false;
+
+        uint32_t current = order;
+        while (current <= block.maxOrder && block.freeLists[current].empty()) ++current;
+        if (current > block.maxOrder) return false;
+
+        offset = *block.freeLists[current].begin();
+        block.freeLists[current].erase(block.freeLists[current].begin());
+        // split until reaching the required order, the upper halves become free buddies
+        while (current > order) {
+            --current;
+            block.freeLists[current].insert(offset + (MinAllocationSize << current));
+        }
+        return true;
+    }
+    static void release(Block& block, VkDeviceSize offset, uint32_t order) {
+        while (order < block.maxOrder) {
+            const VkDeviceSize buddy = offset ^ (MinAllocationSize << order);
+            auto found = block.freeLists[order].find(buddy);
+            if (found == block.freeLists[order].end()) break;
+
+            block.freeLists[order].erase(found);
+            offset = std::min(offset, buddy);
+            ++order;
+        }
+        block.freeLists[order].insert(offset);
+    }
+};
+
+/**
+ * One `VkPipelineCache` shared by all pipeline creation, persisted to disk between runs.
+ * The blob is prefixed with our own header recording the device (vendor, device id, driver version, `pipelineCacheUUID`)
+ * it was written for, a blob from another gpu or driver is discarded instead of handed to the driver. The file is
+ * written to a temporary file first and renamed over the old one, so a crash never leaves a truncated cache behind.
+ */
+class VulkanPipelineCache {
+public:
+    struct Statistics {
+        bool warm = false; // a valid blob was loaded at startup
+        uint64_t pipelineCount = 0;
+        double totalBuildMicroseconds = 0.0, maxBuildMicroseconds = 0.0;
+        double previousColdBuildMicroseconds = 0.0; // stored in the file by the last cold run, 0 if unknown
+    };
+
+    VulkanPipelineCache(VkDevice device, const VkPhysicalDeviceProperties& properties, std::filesystem::path path) : 
+        m_device{ device }, m_properties{ properties }, m_path{ std::move(path) }
+    {
+        std::vector<char> blob = load();
+        m_stats.warm = !blob.empty();
+
+        VkPipelineCacheCreateInfo createInfo{ VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO, nullptr, 0 };
+        createInfo.initialDataSize = blob.size();
+        createInfo.pInitialData = blob.empty() ? nullptr : blob.data();
+        if (VkResult result = vkCreatePipelineCache(m_device, &createInfo, nullptr, &m_cache); result != VK_SUCCESS) {
+            // the driver may still reject data it wrote itself, start over with an empty cache
+            createInfo.initialDataSize = 0;
+            createInfo.pInitialData = nullptr;
+            m_stats.warm = false;
+            if (vkCreatePipelineCache(m_device, &createInfo, nullptr, &m_cache) != VK_SUCCESS) {
+                throw std::runtime_error("failed to create pipeline cache!");
+            }
+        }
+        m_savedHash = blob.empty() ? 0 : HashBytes(blob.data(), blob.size());
+        std::cout << "[VulkanPipelineCache] " << (m_stats.warm ? "Loaded " + std::to_string(blob.size()) + " bytes from " : "Starting cold, no valid cache at ") << m_path.string() << std::endl;
+    }
+    ~VulkanPipelineCache() {
+        try {
+            Save();
+        } catch (const std::exception& e) {
+            std::cout << "[VulkanPipelineCache] Failed to save: " << e.what() << std::endl;
+        }
+        PrintStatistics();
+        vkDestroyPipelineCache(m_device, m_cache, nullptr);
+    }
+    VulkanPipelineCache(const VulkanPipelineCache&) = delete;
+    VulkanPipelineCache& operator=(const VulkanPipelineCache&) = delete;
+
+    inline VkPipelineCache Get() const noexcept {
+        return m_cache;
+    }
+
+    // Caches seeded with the current content, for threads which compile independently and `Merge()` afterwards.
+    std::vector<VkPipelineCache> CreateWorkerCaches(size_t count) {
+        size_t size = 0;
+        std::vector<char> blob;
+        if (vkGetPipelineCacheData(m_device, m_cache, &size, nullptr) == VK_SUCCESS && size != 0) {
+            blob.resize(size);
+            if (vkGetPipelineCacheData(m_device, m_cache, &size, blob.data()) != VK_SUCCESS) {
+                blob.clear();
+            }
+            blob.resize(std::min(size, blob.size()));
+        }
+
+        std::vector<VkPipelineCache> caches;
+        VkPipelineCacheCreateInfo createInfo{ VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO, nullptr, 0 };
+        createInfo.initialDataSize = blob.size();
+        createInfo.pInitialData = blob.empty() ? nullptr : blob.data();
+        for (size_t i = 0; i < count; ++i) {
+            VkPipelineCache cache;
+            if (vkCreatePipelineCache(m_device, &createInfo, nullptr, &cache) != VK_SUCCESS) {
+                Merge(caches);
+                throw std::runtime_error("failed to create worker pipeline cache!");
+            }
+            caches.push_back(cache);
+        }
+        return caches;
+    }
+    // Merge caches from `CreateWorkerCaches()` into this one and destroy them, thread safe.
+    void Merge(std::vector<VkPipelineCache>& caches) {
+        if (caches.empty()) return;
+        {
+            std::lock_guard<std::mutex> lock{ m_mergeMutex };
+            if (vkMergePipelineCaches(m_device, m_cache, static_cast<uint32_t>(caches.size()), caches.data()) != VK_SUCCESS) {
+                std::cout << "[VulkanPipelineCache] Failed to merge " << caches.size() << " worker caches." << std::endl;
+            }
+        }
+        for (VkPipelineCache cache : caches) {
+            vkDestroyPipelineCache(m_device, cache, nullptr);
+        }
+        caches.clear();
+    }
+
+    // Time of a single `vkCreate*Pipelines` call, thread safe.
+    void RecordBuild(double microseconds) {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        ++m_stats.pipelineCount;
+        m_stats.totalBuildMicroseconds += microseconds;
+        m_stats.maxBuildMicroseconds = std::max(m_stats.maxBuildMicroseconds, microseconds);
+    }
+    Statistics GetStatistics() const {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        return m_stats;
+    }
+    void PrintStatistics() const {
+        const Statistics stats = GetStatistics();
+        std::cout << "[VulkanPipelineCache] " << (stats.warm ? "Warm" : "Cold") << " build of " << stats.pipelineCount << " pipelines took " << stats.totalBuildMicroseconds / 1000.0 << " ms (max " << stats.maxBuildMicroseconds / 1000.0 << " ms)";
+        if (stats.warm && stats.previousColdBuildMicroseconds > 0.0) {
+            std::cout << ", cold build took " << stats.previousColdBuildMicroseconds / 1000.0 << " ms";
+        }
+        std::cout << "." << std::endl;
+    }
+
+    // Write the cache back if its content changed since it was loaded or saved.
+    void Save() {
+        size_t size = 0;
+        if (vkGetPipelineCacheData(m_device, m_cache, &size, nullptr) != VK_SUCCESS) {
+            throw std::runtime_error("failed to get pipeline cache size!");
+        }
+        std::vector<char> blob(size);
+        if (size != 0 && vkGetPipelineCacheData(m_device, m_cache, &size, blob.data()) != VK_SUCCESS) {
+            throw std::runtime_error("failed to get pipeline cache data!");
+        }
+        blob.resize(size);
+        const uint64_t hash = blob.empty() ? 0 : HashBytes(blob.data(), blob.size());
+        if (hash == m_savedHash) return;
+
+        FileHeader header = makeHeader();
+        header.dataSize = size;
+        header.dataHash = hash;
+        {
+            std::lock_guard<std::mutex> lock{ m_mutex };
+            header.coldBuildMicroseconds = m_stats.warm ? m_stats.previousColdBuildMicroseconds : m_stats.totalBuildMicroseconds;
+        }
+
+        std::filesystem::path temporary = m_path;
+        temporary += ".tmp";
+        {
+            std::ofstream file{ temporary, std::ios::binary | std::ios::trunc };
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            file.write(blob.data(), blob.size());
+            if (!file) {
+                throw std::runtime_error("failed to write " + temporary.string());
+            }
+        }
+        std::filesystem::rename(temporary, m_path);
+        m_savedHash = hash;
+        std::cout << "[VulkanPipelineCache] Saved " << size << " bytes to " << m_path.string() << std::endl;
+    }
+protected:
+    static constexpr uint32_t FileMagic = 0x48435056; // "VPCH"
+    static constexpr uint32_t FileVersion = 1;
+    struct FileHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t vendorID;
+        uint32_t deviceID;
+        uint32_t driverVersion;
+        uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+        uint64_t dataSize;
+        uint64_t dataHash;
+        double coldBuildMicroseconds;
+    };
+
+    FileHeader makeHeader() const {
+        FileHeader header{};
+        header.magic = FileMagic;
+        header.version = FileVersion;
+        header.vendorID = m_properties.vendorID;
+        header.deviceID = m_properties.deviceID;
+        header.driverVersion = m_properties.driverVersion;
+        std::memcpy(header.pipelineCacheUUID, m_properties.pipelineCacheUUID, VK_UUID_SIZE);
+        return header;
+    }
+    // Empty if there is no file or it doesn't match this device and driver.
+    std::vector<char> load() {
+        std::ifstream file{ m_path, std::ios::binary };
+        if (!file) return {};
+        std::error_code error;
+        const uintmax_t fileSize = std::filesystem::file_size(m_path, error);
+        if (error) return {};
+
+        FileHeader header;
+        const FileHeader expected = makeHeader();
+        if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != expected.magic || header.version != expected.version) {
+            std::cout << "[VulkanPipelineCache] Ignoring " << m_path.string() << ", not a pipeline cache file." << std::endl;
+            return {};
+        }
+        if (header.vendorID != expected.vendorID || header.deviceID != expected.deviceID || header.driverVersion != expected.driverVersion
+            || std::memcmp(header.pipelineCacheUUID, expected.pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+            std::cout << "[VulkanPipelineCache] Ignoring " << m_path.string() << ", written for another device or driver." << std::endl;
+            return {};
+        }
+
+        // the size is checked against the file before trusting it with an allocation
+        if (fileSize < sizeof(header) || header.dataSize != fileSize - sizeof(header)) {
+            std::cout << "[VulkanPipelineCache] Ignoring " << m_path.string() << ", data size doesn't match the file." << std::endl;
+            return {};
+        }
+        std::vector<char> blob(static_cast<size_t>(header.dataSize));
+        if (!file.read(blob.data(), blob.size()) || HashBytes(blob.data(), blob.size()) != header.dataHash) {
+            std::cout << "[VulkanPipelineCache] Ignoring " << m_path.string() << ", data is corrupted." << std::endl;
+            return {};
+        }
+
+        // the driver's own header must agree as well
+        VkPipelineCacheHeaderVersionOne driverHeader;
+        if (blob.size() < sizeof(driverHeader)) return {};
+        std::memcpy(&driverHeader, blob.data(), sizeof(driverHeader));
+        if (driverHeader.headerVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE || driverHeader.vendorID != expected.vendorID || driverHeader.deviceID != expected.deviceID
+            || std::memcmp(driverHeader.pipelineCacheUUID, expected.pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+            std::cout << "[VulkanPipelineCache] Ignoring " << m_path.string() << ", driver header mismatch." << std::endl;
+            return {};
+        }
+
+        m_stats.previousColdBuildMicroseconds = header.coldBuildMicroseconds;
+        return blob;
+    }
+protected:
+    VkDevice m_device; // borrow
+    VkPhysicalDeviceProperties m_properties;
+    std::filesystem::path m_path;
+
+    VkPipelineCache m_cache = VK_NULL_HANDLE;
+    uint64_t m_savedHash = 0; // of the content in the file, 0 if none
+
+    mutable std::mutex m_mutex; // guards `m_stats`
+    std::mutex m_mergeMutex; // `m_cache` is externally synchronized as a merge destination
+    Statistics m_stats;
+};
+
+/**
+ * Hash-consed descriptor set layouts and pipeline layouts: identical descriptions share one Vulkan object, which is
+ * destroyed when the last reference goes away. Since identical set layouts are the same handle, pipeline layouts built
+ * from the same sets are compatible and descriptor sets can be bound across pipelines.
+ * Thread safe, pipelines are built in parallel.
+ */
+class VulkanLayoutCache {
+public:
+    // Owns the handle for the shared pointers, non-dispatchable handles are no pointers on 32-bit platforms.
+    template <typename Handle>
+    struct Layout {
+        Handle handle;
+    };
+    typedef std::shared_ptr< const Layout<VkDescriptorSetLayout> > DescriptorSetLayout;
+    typedef std::shared_ptr< const Layout<VkPipelineLayout> > PipelineLayout;
+    struct Statistics {
+        uint64_t hitCount = 0, missCount = 0;
+        size_t descriptorSetLayoutCount = 0, pipelineLayoutCount = 0; // alive
+    };
+
+    explicit VulkanLayoutCache(VkDevice device) : m_state{ std::make_shared<State>() } {
+        m_state->device = device;
+    }
+    ~VulkanLayoutCache() {
+        std::lock_guard<std::mutex> lock{ m_state->mutex };
+        if (!m_state->descriptorSetLayouts.empty() || !m_state->pipelineLayouts.empty()) {
+            std::cout << "[VulkanLayoutCache] " << m_state->descriptorSetLayouts.size() << " descriptor set layouts and " << m_state->pipelineLayouts.size() << " pipeline layouts are still referenced at destruction." << std::endl;
+        }
+        // references outliving the device must not touch it anymore
+        m_state->device = VK_NULL_HANDLE;
+    }
+    VulkanLayoutCache(const VulkanLayoutCache&) = delete;
+    VulkanLayoutCache& operator=(const VulkanLayoutCache&) = delete;
+
+    // Bindings are canonicalized by binding number, their order doesn't matter.
+    DescriptorSetLayout GetDescriptorSetLayout(const VkDescriptorSetLayoutBinding* bindings, size_t count) {
+        std::vector<VkDescriptorSetLayoutBinding> sorted(bindings, bindings + count);
+        std::sort(sorted.begin(), sorted.end(), [](const VkDescriptorSetLayoutBinding& a, const VkDescriptorSetLayoutBinding& b) { return a.binding < b.binding; });
+        Key key;
+        for (const VkDescriptorSetLayoutBinding& binding : sorted) {
+            key.insert(key.end(), { binding.binding, static_cast<uint64_t>(binding.descriptorType), binding.descriptorCount, binding.stageFlags, reinterpret_cast<uintptr_t>(binding.pImmutableSamplers) });
+        }
+
+        std::lock_guard<std::mutex> lock{ m_state->mutex };
+        if (auto found = m_state->descriptorSetLayouts.find(key); found != m_state->descriptorSetLayouts.end()) {
+            if (DescriptorSetLayout layout = found->second.lock(); layout != nullptr) {
+                ++m_state->stats.hitCount;
+                return layout;
+            }
+        }
+
+        VkDescriptorSetLayoutCreateInfo layoutInfo{ VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO, nullptr, 0 };
+        layoutInfo.bindingCount = static_cast<uint32_t>(sorted.size());
+        layoutInfo.pBindings = sorted.data();
+        VkDescriptorSetLayout handle;
+        if (VkResult result = vkCreateDescriptorSetLayout(m_state->device, &layoutInfo, nullptr, &handle); result != VK_SUCCESS) {
+            throw std::runtime_error("Failed to create descriptor set layout!");
+        }
+        ++m_state->stats.missCount;
+
+        DescriptorSetLayout layout{ new Layout<VkDescriptorSetLayout>{ handle }, [state = m_state, key](const Layout<VkDescriptorSetLayout>* layout) {
+            std::lock_guard<std::mutex> lock{ state->mutex };
+            if (state->device != VK_NULL_HANDLE) {
+                vkDestroyDescriptorSetLayout(state->device, layout->handle, nullptr);
+            }
+            delete layout;
+            state->erase(state->descriptorSetLayouts, key);
+        } };
+        m_state->descriptorSetLayouts[key] = layout;
+        return layout;
+    }
+    // The pipeline layout keeps its set layouts alive. Push constant ranges are canonicalized by offset and stages.
+    PipelineLayout GetPipelineLayout(const std::vector<DescriptorSetLayout>& setLayouts, const std::vector<VkPushConstantRange>& pushConstants) {
+        std::vector<VkPushConstantRange> sortedRanges = pushConstants;
+        std::sort(sortedRanges.begin(), sortedRanges.end(), [](const VkPushConstantRange& a, const VkPushConstantRange& b) {
+            return std::tie(a.offset, a.size, a.stageFlags) < std::tie(b.offset, b.size, b.stageFlags);
+        });
+        Key key;
+        std::vector<VkDescriptorSetLayout> handles;
+        for (const DescriptorSetLayout& setLayout : setLayouts) {
+            handles.push_back(setLayout->handle);
+            key.push_back(reinterpret_cast<uintptr_t>(setLayout.get())); // identical sets share the object
+        }
+        key.push_back(~0ull); // separates sets from ranges
+        for (const VkPushConstantRange& range : sortedRanges) {
+            key.insert(key.end(), { range.stageFlags, range.offset, range.size });
+        }
+
+        std::lock_guard<std::mutex> lock{ m_state->mutex };
+        if (auto found = m_state->pipelineLayouts.find(key); found != m_state->pipelineLayouts.end()) {
+            if (PipelineLayout layout = found->second.lock(); layout != nullptr) {
+                ++m_state->stats.hitCount;
+                return layout;
+            }
+        }
+
+        VkPipelineLayoutCreateInfo pipelineLayoutInfo{ VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO, nullptr, 0 };
+        pipelineLayoutInfo.pushConstantRangeCount = static_cast<uint32_t>(sortedRanges.size());
+        pipelineLayoutInfo.pPushConstantRanges = sortedRanges.data();
+        pipelineLayoutInfo.setLayoutCount = static_cast<uint32_t>(handles.size());
+        pipelineLayoutInfo.pSetLayouts = handles.data();
+        VkPipelineLayout handle;
+        if (vkCreatePipelineLayout(m_state->device, &pipelineLayoutInfo, nullptr, &handle) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create pipeline layout!");
+        }
+        ++m_state->stats.missCount;
+
+        PipelineLayout layout{ new Layout<VkPipelineLayout>{ handle }, [state = m_state, key, setLayouts](const Layout<VkPipelineLayout>* layout) {
+            std::lock_guard<std::mutex> lock{ state->mutex };
+            if (state->device != VK_NULL_HANDLE) {
+                vkDestroyPipelineLayout(state->device, layout->handle, nullptr);
+            }
+            delete layout;
+            state->erase(state->pipelineLayouts, key);
+        } };
+        m_state->pipelineLayouts[key] = layout;
+        return layout;
     }
 
-protected:
-    static VKAPI_ATTR VkBool32 VKAPI_CALL debugCallback(VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity, VkDebugUtilsMessageTypeFlagsEXT messageType, const VkDebugUtilsMessengerCallbackDataEXT* pCallbackData, void* pUserData) {
-        std::cerr << "[ValidationLayer] " << pCallbackData->pMessage << std::endl;
-        return VK_FALSE;
+    Statistics GetStatistics() const {
+        std::lock_guard<std::mutex> lock{ m_state->mutex };
+        Statistics stats = m_state->stats;
+        stats.descriptorSetLayoutCount = m_state->descriptorSetLayouts.size();
+        stats.pipelineLayoutCount = m_state->pipelineLayouts.size();
+        return stats;
     }
 protected:
-    VkInstance m_instance = VK_NULL_HANDLE;
-    VkDebugUtilsMessengerEXT m_debugMessenger = VK_NULL_HANDLE;
-#ifdef NDEBUG
-    static constexpr bool EnableValidationLayers = false;
-#else
-    static constexpr bool EnableValidationLayers = true;
-#endif
-    bool m_enableValidationLayers = false;
-
-public:
-    constexpr static std::array<const char*, 1> ValidationLayers = {
-        "VK_LAYER_KHRONOS_validation"
+    typedef std::vector<uint64_t> Key;
+    struct KeyHash {
+        size_t operator()(const Key& key) const {
+            return static_cast<size_t>(HashBytes(key.data(), key.size() * sizeof(uint64_t)));
+        }
     };
-    constexpr static std::array<const char*, 1> ValidationExtensions = {
-        VK_EXT_DEBUG_UTILS_EXTENSION_NAME
+    // shared with the deleters of handed out layouts, which may outlive the cache
+    struct State {
+        std::mutex mutex;
+        VkDevice device = VK_NULL_HANDLE; // borrow
+        std::unordered_map< Key, std::weak_ptr< const Layout<VkDescriptorSetLayout> >, KeyHash > descriptorSetLayouts;
+        std::unordered_map< Key, std::weak_ptr< const Layout<VkPipelineLayout> >, KeyHash > pipelineLayouts;
+        Statistics stats;
+
+        // a new layout with the same key may have replaced the expired entry already
+        template <typename Map>
+        void erase(Map& map, const Key& key) {
+            if (auto found = map.find(key); found != map.end() && found->second.expired()) {
+                map.erase(found);
+            }
+        }
     };
+    std::shared_ptr<State> m_state;
 };
 
 /**
@@ -299,6 +1586,9 @@ public:
         }
     }
     ~VulkanDevice() {
+        m_layoutCache.reset();
+        m_pipelineCache.reset();
+        m_allocator.reset();
         if (m_logicalDevice!= nullptr) {
             vkDestroyDevice(m_logicalDevice, nullptr);
         }
@@ -315,6 +1605,13 @@ public:
     Queue GetComputeQueue() {
         return Queue{ m_computeQueue, m_queueIndices[QueueType::Compute] };
     }
+    // Fall back to the graphics queue (which always supports transfer) if no transfer queue was requested.
+    Queue GetTransferQueue() {
+        if (m_transferQueue == VK_NULL_HANDLE) {
+            return GetGraphicsQueue();
+        }
+        return Queue{ m_transferQueue, m_queueIndices[QueueType::Transfer] };
+    }
     // VkQueue GetGraphicQueue() { return m_graphicQueue; }
     // VkQueue GetComputeQueue() { return m_computeQueue; }
     // VkQueue GetTransferQueue() { return m_transferQueue; }
@@ -322,10 +1619,31 @@ public:
     VkDevice Get() const { return m_logicalDevice; }
     VkPhysicalDevice GetPhysicalDevice() { return m_physicalDevice; }
     const VulkanSurface* GetSurface() const { return m_surface; }
+
+    // Commands of VK_EXT_extended_dynamic_state(2), null when the device doesn't support them.
+    struct DynamicStateSupport {
+        bool extendedDynamicState = false; // cull mode, front face, topology (within its class), depth test/write/compare
+        bool extendedDynamicState2 = false; // depth bias enable, primitive restart enable
+        PFN_vkCmdSetCullModeEXT cmdSetCullMode = nullptr;
+        PFN_vkCmdSetFrontFaceEXT cmdSetFrontFace = nullptr;
+        PFN_vkCmdSetPrimitiveTopologyEXT cmdSetPrimitiveTopology = nullptr;
+        PFN_vkCmdSetDepthTestEnableEXT cmdSetDepthTestEnable = nullptr;
+        PFN_vkCmdSetDepthWriteEnableEXT cmdSetDepthWriteEnable = nullptr;
+        PFN_vkCmdSetDepthCompareOpEXT cmdSetDepthCompareOp = nullptr;
+        PFN_vkCmdSetDepthBiasEnableEXT cmdSetDepthBiasEnable = nullptr;
+        PFN_vkCmdSetPrimitiveRestartEnableEXT cmdSetPrimitiveRestartEnable = nullptr;
+    };
+    const DynamicStateSupport& GetDynamicStateSupport() const { return m_dynamicState; }
+    // VK_EXT_graphics_pipeline_library with fast linking
+    bool IsGraphicsPipelineLibrarySupported() const { return m_graphicsPipelineLibrary; }
     uint32_t GetQueueIndex(QueueType type) const {
         return m_queueIndices.at(type);
     }
-    
+    VulkanMemoryAllocator& GetAllocator() { return *m_allocator; }
+    VulkanPipelineCache& GetPipelineCache() { return *m_pipelineCache; }
+    VulkanLayoutCache& GetLayoutCache() { return *m_layoutCache; }
+    const VkPhysicalDeviceProperties& GetProperties() const { return m_properties; }
+
 protected:
     static PreferMap parsePrefer(std::string prefer) {
         static const std::map<std::string, VkPhysicalDeviceType> DeviceTypeStr2Type{
@@ -429,6 +1747,13 @@ protected:
                     }
                     break;
                 case QueueType::Transfer:
+                    // prefer a dedicated transfer family (usually backed by a DMA engine) so uploads overlap rendering
+                    if (auto found = std::find_if(queueFamilies.begin(), queueFamilies.end(), [](VkQueueFamilyProperties& qfp) {
+                        return (qfp.queueFlags & (VK_QUEUE_TRANSFER_BIT | VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)) == VK_QUEUE_TRANSFER_BIT;
+                    }); found!= queueFamilies.end())   {
+                        ret.queueIndices[QueueType::Transfer] = std::distance(queueFamilies.begin(), found);
+                        return true;
+                    }
                     if (auto found = std::find_if(queueFamilies.begin(), queueFamilies.end(), [](VkQueueFamilyProperties& qfp) {
                         return ((qfp.queueFlags & VK_QUEUE_TRANSFER_BIT)!= 0);
                     }); found!= queueFamilies.end())   {
@@ -544,6 +1869,97 @@ protected:
             return vkName;
         });
 
+        // optional extensions, enabled when available without being requested
+        uint32_t availableExtensionCount = 0;
+        vkEnumerateDeviceExtensionProperties(m_physicalDevice, nullptr, &availableExtensionCount, nullptr);
+        std::vector<VkExtensionProperties> availableExtensions(availableExtensionCount);
+        vkEnumerateDeviceExtensionProperties(m_physicalDevice, nullptr, &availableExtensionCount, availableExtensions.data());
+        const auto isExtensionAvailable = [&availableExtensions](const char* name) {
+            return std::any_of(availableExtensions.begin(), availableExtensions.end(), [name](const VkExtensionProperties& ext) { return strcmp(ext.extensionName, name) == 0; });
+        };
+
+        // memory budget also needs `vkGetPhysicalDeviceMemoryProperties2KHR` of VK_KHR_get_physical_device_properties2,
+        // the instance is 1.0. Without it the allocator works without budgets
+        PFN_vkGetPhysicalDeviceMemoryProperties2KHR getMemoryProperties2 = nullptr;
+        if (m_instance.HasPhysicalDeviceProperties2()) {
+            getMemoryProperties2 = m_instance.GetProcAddr<PFN_vkGetPhysicalDeviceMemoryProperties2KHR, false>("vkGetPhysicalDeviceMemoryProperties2KHR");
+        }
+        if (getMemoryProperties2 != nullptr && isExtensionAvailable(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME)) {
+            deviceExtensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+            deviceExtensionsString += VK_EXT_MEMORY_BUDGET_EXTENSION_NAME;
+            deviceExtensionsString += ", ";
+        } else {
+            getMemoryProperties2 = nullptr;
+        }
+
+        // extended dynamic state and pipeline libraries, features are queried with `vkGetPhysicalDeviceFeatures2` and
+        // the enabled ones are chained into the create info
+        VkPhysicalDeviceExtendedDynamicStateFeaturesEXT extendedDynamicStateFeatures{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_FEATURES_EXT, nullptr, VK_FALSE };
+        VkPhysicalDeviceExtendedDynamicState2FeaturesEXT extendedDynamicState2Features{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_2_FEATURES_EXT, nullptr, VK_FALSE };
+        VkPhysicalDeviceGraphicsPipelineLibraryFeaturesEXT pipelineLibraryFeatures{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_FEATURES_EXT, nullptr, VK_FALSE };
+        VkPhysicalDeviceGraphicsPipelineLibraryPropertiesEXT pipelineLibraryProperties{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_PROPERTIES_EXT, nullptr, VK_FALSE, VK_FALSE };
+        void* deviceCreateNext = nullptr;
+        const auto chainDeviceCreateInfo = [&deviceCreateNext](auto& features) {
+            features.pNext = deviceCreateNext;
+            deviceCreateNext = &features;
+        };
+        const auto enableExtension = [&deviceExtensions, &deviceExtensionsString](const char* name) {
+            deviceExtensions.push_back(name);
+            deviceExtensionsString += name;
+            deviceExtensionsString += ", ";
+        };
+        // these extensions depend on VK_KHR_get_physical_device_properties2, without it they stay disabled: every render
+        // state in use is baked into its own pipeline
+        PFN_vkGetPhysicalDeviceFeatures2KHR getFeatures2 = nullptr;
+        if (m_instance.HasPhysicalDeviceProperties2()) {
+            getFeatures2 = m_instance.GetProcAddr<PFN_vkGetPhysicalDeviceFeatures2KHR, false>("vkGetPhysicalDeviceFeatures2KHR");
+        }
+        PFN_vkGetPhysicalDeviceProperties2KHR getProperties2 = nullptr;
+        if (m_instance.HasPhysicalDeviceProperties2()) {
+            getProperties2 = m_instance.GetProcAddr<PFN_vkGetPhysicalDeviceProperties2KHR, false>("vkGetPhysicalDeviceProperties2KHR");
+        }
+        if (getFeatures2 != nullptr) {
+            VkPhysicalDeviceFeatures2 features2{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2, nullptr };
+            const auto chainQuery = [&features2](auto& features) {
+                features.pNext = features2.pNext;
+                features2.pNext = &features;
+            };
+            if (isExtensionAvailable(VK_EXT_EXTENDED_DYNAMIC_STATE_EXTENSION_NAME)) {
+                chainQuery(extendedDynamicStateFeatures);
+                if (isExtensionAvailable(VK_EXT_EXTENDED_DYNAMIC_STATE_2_EXTENSION_NAME)) {
+                    chainQuery(extendedDynamicState2Features);
+                }
+            }
+            // libraries only pay off when linking them is fast
+            if (getProperties2 != nullptr && isExtensionAvailable(VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME) && isExtensionAvailable(VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME)) {
+                chainQuery(pipelineLibraryFeatures);
+                VkPhysicalDeviceProperties2 properties2{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2, &pipelineLibraryProperties };
+                getProperties2(m_physicalDevice, &properties2);
+            }
+            getFeatures2(m_physicalDevice, &features2);
+        }
+        if (extendedDynamicStateFeatures.extendedDynamicState == VK_TRUE) {
+            enableExtension(VK_EXT_EXTENDED_DYNAMIC_STATE_EXTENSION_NAME);
+            chainDeviceCreateInfo(extendedDynamicStateFeatures);
+            m_dynamicState.extendedDynamicState = true;
+            // the second extension only adds to the first one
+            if (extendedDynamicState2Features.extendedDynamicState2 == VK_TRUE) {
+                enableExtension(VK_EXT_EXTENDED_DYNAMIC_STATE_2_EXTENSION_NAME);
+                // only the plain feature is used
+                extendedDynamicState2Features.extendedDynamicState2LogicOp = VK_FALSE;
+                extendedDynamicState2Features.extendedDynamicState2PatchControlPoints = VK_FALSE;
+                chainDeviceCreateInfo(extendedDynamicState2Features);
+                m_dynamicState.extendedDynamicState2 = true;
+            }
+        }
+        // otherwise pipelines are compiled monolithically
+        if (m_instance.HasPhysicalDeviceProperties2() && pipelineLibraryFeatures.graphicsPipelineLibrary == VK_TRUE && pipelineLibraryProperties.graphicsPipelineLibraryFastLinking == VK_TRUE) {
+            enableExtension(VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME);
+            enableExtension(VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME);
+            chainDeviceCreateInfo(pipelineLibraryFeatures);
+            m_graphicsPipelineLibrary = true;
+        }
+
         VkPhysicalDeviceFeatures deviceFeatures = {};
         std::string deviceFeaturesString = "";
         for (FeatureType feature : deviceInfo.supportedFeatures) {
@@ -561,6 +1977,7 @@ protected:
 
         VkDeviceCreateInfo createInfo = {};
         createInfo.sType            = VkStructureType::VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+        createInfo.pNext            = deviceCreateNext;
         createInfo.pQueueCreateInfos = queueCreateInfos.data();
         createInfo.queueCreateInfoCount = queueCreateInfos.size();
         createInfo.enabledExtensionCount = deviceExtensions.size();
@@ -602,8 +2019,34 @@ protected:
             }
         }
         m_queueIndices = deviceInfo.queueIndices;
+        loadDynamicStateCommands();
+        vkGetPhysicalDeviceProperties(m_physicalDevice, &m_properties);
+        m_allocator = std::make_unique<VulkanMemoryAllocator>(m_physicalDevice, m_logicalDevice, getMemoryProperties2);
+        m_pipelineCache = std::make_unique<VulkanPipelineCache>(m_logicalDevice, m_properties, PipelineCachePath);
+        m_layoutCache = std::make_unique<VulkanLayoutCache>(m_logicalDevice);
         return true;
     }
+    // falls back to baked state if a command is missing even though the extension was enabled
+    void loadDynamicStateCommands() {
+        const auto load = [this](auto& func, const char* name) {
+            func = reinterpret_cast<std::remove_reference_t<decltype(func)>>(vkGetDeviceProcAddr(m_logicalDevice, name));
+            return func != nullptr;
+        };
+        if (m_dynamicState.extendedDynamicState) {
+            m_dynamicState.extendedDynamicState = load(m_dynamicState.cmdSetCullMode, "vkCmdSetCullModeEXT") &&
+                load(m_dynamicState.cmdSetFrontFace, "vkCmdSetFrontFaceEXT") &&
+                load(m_dynamicState.cmdSetPrimitiveTopology, "vkCmdSetPrimitiveTopologyEXT") &&
+                load(m_dynamicState.cmdSetDepthTestEnable, "vkCmdSetDepthTestEnableEXT") &&
+                load(m_dynamicState.cmdSetDepthWriteEnable, "vkCmdSetDepthWriteEnableEXT") &&
+                load(m_dynamicState.cmdSetDepthCompareOp, "vkCmdSetDepthCompareOpEXT");
+        }
+        if (m_dynamicState.extendedDynamicState2) {
+            m_dynamicState.extendedDynamicState2 = m_dynamicState.extendedDynamicState &&
+                load(m_dynamicState.cmdSetDepthBiasEnable, "vkCmdSetDepthBiasEnableEXT") &&
+                load(m_dynamicState.cmdSetPrimitiveRestartEnable, "vkCmdSetPrimitiveRestartEnableEXT");
+        }
+        std::cout << "[VulkanDevice] Extended dynamic state: " << (m_dynamicState.extendedDynamicState ? "yes" : "no") << ", extended dynamic state 2: " << (m_dynamicState.extendedDynamicState2 ? "yes" : "no") << std::endl;
+    }
 protected:
     VulkanInstance &m_instance;
     VkPhysicalDevice m_physicalDevice = VK_NULL_HANDLE;
@@ -615,6 +2058,15 @@ protected:
     VkQueue m_transferQueue = VK_NULL_HANDLE;
     VkQueue m_presentQueue = VK_NULL_HANDLE;
     std::map< VulkanDevice::QueueType, uint32_t > m_queueIndices;
+
+    VkPhysicalDeviceProperties m_properties;
+    std::unique_ptr<VulkanMemoryAllocator> m_allocator;
+    std::unique_ptr<VulkanPipelineCache> m_pipelineCache;
+    std::unique_ptr<VulkanLayoutCache> m_layoutCache;
+    DynamicStateSupport m_dynamicState;
+    bool m_graphicsPipelineLibrary = false;
+
+    static constexpr const char* PipelineCachePath = "pipeline_cache.bin";
 };
 const std::map< VulkanDevice::ExtensionType, const char* > VulkanDevice::ExtensionType2VkName = {
     { ExtensionType::SwapChainSupported, VK_KHR_SWAPCHAIN_EXTENSION_NAME },
@@ -642,103 +2094,846 @@ public:
             std::transform(m_commandbuffers.begin(), m_commandbuffers.end(), std::inserter(uniqueQueues, uniqueQueues.begin()), [](const auto& pair) { return pair.first; });
             vc->m_datas.resize(uniqueQueues.size());
 
-            std::map<uint32_t, uint32_t> mapQueueToIndex;
-            int i = 0;
-            for (uint32_t queueIndex : uniqueQueues) {
-                VkCommandPoolCreateInfo poolInfo{ VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO, nullptr, 0 };
-                poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-                poolInfo.queueFamilyIndex = queueIndex;
+            std::map<uint32_t, uint32_t> mapQueueToIndex;
+            int i = 0;
+            for (uint32_t queueIndex : uniqueQueues) {
+                VkCommandPoolCreateInfo poolInfo{ VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO, nullptr, 0 };
+                poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+                poolInfo.queueFamilyIndex = queueIndex;
+
+                if (vkCreateCommandPool(device.Get(), &poolInfo, nullptr, &vc->m_datas[i].pool) != VK_SUCCESS) {
+                    throw std::runtime_error("failed to create command pool!");
+                }
+
+                mapQueueToIndex[queueIndex] = i;
+
+                ++i;
+            }
+
+            for (auto& [queueIdx, count] : m_commandbuffers) {
+                CommandPool cp = vc->m_datas[mapQueueToIndex[queueIdx]];
+                cp.buffers.resize(count);
+
+                VkCommandBufferAllocateInfo allocInfo{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, nullptr, 0 };
+                allocInfo.commandBufferCount = count;
+                allocInfo.commandPool = cp.pool;
+                allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+                
+                if (vkAllocateCommandBuffers(device.Get(), &allocInfo, cp.buffers.data()) != VK_SUCCESS) {
+                    throw std::runtime_error("failed to allocate command buffers!");
+                }
+            }
+
+            return vc;
+        }
+    protected:
+        // first one is queue index, second one is count
+        std::vector< std::pair<uint32_t, uint32_t> > m_commandbuffers;
+    };
+    ~VulkanCommand() {
+        for (CommandPool &cp : m_datas) {
+            if (cp.pool != VK_NULL_HANDLE) {
+                vkDestroyCommandPool(m_device.Get(), cp.pool, nullptr);
+            }
+        }
+    }
+    VulkanCommand(VulkanCommand&& other) : m_device{ other.m_device } {
+        std::swap(m_datas, other.m_datas);
+    }
+protected:
+    VulkanCommand(VulkanDevice& device) : m_device{ device } { };
+    VulkanDevice& m_device;
+    std::vector<CommandPool> m_datas;
+};
+
+class VulkanMemory {
+public:
+    enum class StoreLocation {
+        Local,     // written by cpu, read by gpu
+        Device,    // gpu only
+        Transient, // transient attachments, may never be backed by real memory on tilers
+        Readback   // written by gpu, read by cpu
+    };
+    // A memory type matches a rank if it has all `required` flags and none of the `avoided` flags.
+    struct MemoryTypeRank {
+        VkMemoryPropertyFlags required;
+        VkMemoryPropertyFlags avoided = 0;
+    };
+    // Ranked from the most preferred to the last fallback.
+    typedef std::vector<MemoryTypeRank> MemoryPolicy;
+
+    static const MemoryPolicy& GetDefaultPolicy(StoreLocation storeLocation) {
+        static const std::map<StoreLocation, MemoryPolicy> DefaultPolicies{
+            { StoreLocation::Local, {
+                { VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, VK_MEMORY_PROPERTY_HOST_CACHED_BIT },
+                { VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT },
+            } },
+            { StoreLocation::Device, {
+                { VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT },
+                { VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT },
+                { 0, VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT },
+            } },
+            { StoreLocation::Transient, {
+                { VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT },
+                { VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT },
+                { VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT },
+                { 0 },
+            } },
+            { StoreLocation::Readback, {
+                { VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT },
+                { VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT },
+                { VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT },
+            } },
+        };
+        return DefaultPolicies.at(storeLocation);
+    }
+
+    // Allocate memory for `image` from the device allocator and bind it.
+    // `category` is a string literal grouping the allocation in allocator statistics.
+    // `policy` overrides the default memory type policy of `storeLocation`.
+    VulkanMemory(VulkanDevice &device, VkImage image, StoreLocation storeLocation, const char* category = "image", const std::optional<MemoryPolicy>& policy = std::nullopt) : m_device{ device }, m_storeLocation{ storeLocation }, m_policy{ policy.value_or(GetDefaultPolicy(storeLocation)) } {
+        VkMemoryRequirements memRequirements;
+        vkGetImageMemoryRequirements(m_device.Get(), image, &memRequirements);
+        allocate(memRequirements, VulkanMemoryAllocator::ResourceKind::Optimal, category);
+
+        if (VkResult result = vkBindImageMemory(m_device.Get(), image, m_allocation.memory, m_allocation.offset); result != VK_SUCCESS) {
+            m_device.GetAllocator().Free(m_allocation);
+            throw std::runtime_error("failed to bind image memory!");
+        }
+    }
+    // Allocate memory for `buffer` from the device allocator and bind it.
+    VulkanMemory(VulkanDevice &device, VkBuffer buffer, StoreLocation storeLocation, const char* category = "buffer", const std::optional<MemoryPolicy>& policy = std::nullopt) : m_device{ device }, m_storeLocation{ storeLocation }, m_policy{ policy.value_or(GetDefaultPolicy(storeLocation)) } {
+        VkMemoryRequirements memRequirements;
+        vkGetBufferMemoryRequirements(m_device.Get(), buffer, &memRequirements);
+        allocate(memRequirements, VulkanMemoryAllocator::ResourceKind::Linear, category);
+
+        if (VkResult result = vkBindBufferMemory(m_device.Get(), buffer, m_allocation.memory, m_allocation.offset); result != VK_SUCCESS) {
+            m_device.GetAllocator().Free(m_allocation);
+            throw std::runtime_error("failed to bind buffer memory!");
+        }
+    }
+    // Allocate memory without binding it, for resources that share (alias) one memory range.
+    VulkanMemory(VulkanDevice &device, const VkMemoryRequirements& memRequirements, StoreLocation storeLocation, VulkanMemoryAllocator::ResourceKind kind, const char* category = "aliased", const std::optional<MemoryPolicy>& policy = std::nullopt) : m_device{ device }, m_storeLocation{ storeLocation }, m_policy{ policy.value_or(GetDefaultPolicy(storeLocation)) } {
+        allocate(memRequirements, kind, category);
+    }
+    ~VulkanMemory() {
+        m_device.GetAllocator().Free(m_allocation);
+    }
+    VulkanMemory(const VulkanMemory&) = delete;
+    VulkanMemory& operator=(const VulkanMemory&) = delete;
+
+    // Allocate an unbound memory with the same placement in a denser block, for defragmentation. nullptr if there is no room.
+    std::unique_ptr<VulkanMemory> AllocateForMove(const VkMemoryRequirements& requirements) const {
+        std::optional<VulkanMemoryAllocator::Allocation> allocation = m_device.GetAllocator().AllocateForMove(m_allocation, requirements);
+        if (!allocation.has_value()) return nullptr;
+        return std::unique_ptr<VulkanMemory>{ new VulkanMemory{ m_device, allocation.value(), m_storeLocation, m_policy } };
+    }
+    inline const VulkanMemoryAllocator::Allocation& GetAllocation() const noexcept {
+        return m_allocation;
+    }
+
+    inline VkDeviceMemory GetMemory() const noexcept{
+        return m_allocation.memory;
+    }
+    inline VkDeviceSize GetOffset() const noexcept{
+        return m_allocation.offset;
+    }
+    inline VkDeviceSize GetSize() const noexcept{
+        return m_allocation.size;
+    }
+    inline StoreLocation GetStoreLocation() const noexcept{
+        return m_storeLocation;
+    }
+    inline uint32_t GetMemoryTypeIndex() const noexcept{
+        return m_allocation.memoryTypeIndex;
+    }
+    // Mapping is reference counted by the allocator, every `Map()` must be paired with an `Unmap()`.
+    inline void* Map() {
+        return m_device.GetAllocator().Map(m_allocation);
+    }
+    inline void Unmap() {
+        m_device.GetAllocator().Unmap(m_allocation);
+    }
+    inline VkMemoryPropertyFlags GetPropertyFlags() const {
+        return m_device.GetAllocator().GetMemoryTypeFlags(m_allocation.memoryTypeIndex);
+    }
+    inline bool IsHostVisible() const {
+        return (GetPropertyFlags() & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != 0;
+    }
+    inline bool IsHostCoherent() const {
+        return (GetPropertyFlags() & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) != 0;
+    }
+    // No-op on coherent memory.
+    void Flush(VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE) {
+        if (IsHostCoherent()) return;
+        m_device.GetAllocator().Flush(m_allocation, offset, size);
+    }
+    void Invalidate(VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE) {
+        if (IsHostCoherent()) return;
+        m_device.GetAllocator().Invalidate(m_allocation, offset, size);
+    }
+protected:
+    VulkanDevice& m_device;
+    VulkanMemoryAllocator::Allocation m_allocation;
+    StoreLocation m_storeLocation = StoreLocation::Local;
+    MemoryPolicy m_policy;
+protected:
+    VulkanMemory(VulkanDevice &device, const VulkanMemoryAllocator::Allocation& allocation, StoreLocation storeLocation, const MemoryPolicy& policy) : m_device{ device }, m_allocation{ allocation }, m_storeLocation{ storeLocation }, m_policy{ policy } {
+
+    }
+    void allocate(const VkMemoryRequirements& memRequirements, VulkanMemoryAllocator::ResourceKind kind, const char* category) {
+        m_allocation = m_device.GetAllocator().Allocate(memRequirements, findMemoryType(memRequirements.memoryTypeBits), kind, category);
+    }
+    // Walk the policy from the most preferred rank, the first memory type allowed by `typeFilter` wins.
+    uint32_t findMemoryType(uint32_t typeFilter) {
+        VkPhysicalDeviceMemoryProperties memProperties;
+        vkGetPhysicalDeviceMemoryProperties(m_device.GetPhysicalDevice(), &memProperties);
+        for (const MemoryTypeRank& rank : m_policy) {
+            for (uint32_t i = 0; i < memProperties.memoryTypeCount; ++i){
+                const VkMemoryPropertyFlags flags = memProperties.memoryTypes[i].propertyFlags;
+                if ((typeFilter & (1 << i)) && (flags & rank.required) == rank.required && (flags & rank.avoided) == 0) {
+                    return i;
+                }
+            }
+        }
+        throw std::runtime_error("failed to find suitable memory type!");
+    }
+};
+
+/**
+ * A resource whose memory can be moved by `VulkanDefragmenter`. Whoever keeps raw handles of it (views, framebuffers,
+ * descriptors) subscribes with `OnRelocated()` to fix them up after a move. Subscribers are called while frames using
+ * the old handles may still execute, so they replace what they hold instead of rewriting it in place.
+ */
+class IVulkanRelocatable {
+public:
+    // Destruction of replaced handles is deferred until the gpu no longer uses them.
+    typedef std::function<void(std::function<void()>)> DeferFunction;
+    typedef std::function<void(IVulkanRelocatable& resource, const DeferFunction& defer)> RelocationCallback;
+
+    virtual ~IVulkanRelocatable() {
+        m_allocator->UnregisterRelocatable(this);
+    }
+
+    // nullptr if the resource can't be moved now, e.g. it's mapped or its memory is shared.
+    virtual const VulkanMemory* GetRelocatableMemory() const = 0;
+    virtual VkMemoryRequirements GetMemoryRequirements() const = 0;
+    // Recreate the resource on `memory`, record the copy of its content into `commandBuffer` and notify subscribers.
+    virtual void Relocate(std::unique_ptr<VulkanMemory> memory, VkCommandBuffer commandBuffer, const DeferFunction& defer) = 0;
+
+    // The callback is dropped once `lifetime` expires, so subscribers don't need to unsubscribe.
+    void OnRelocated(std::weak_ptr<void> lifetime, RelocationCallback callback) {
+        m_relocationCallbacks.emplace_back(std::move(lifetime), std::move(callback));
+    }
+protected:
+    VulkanMemoryAllocator* m_allocator; // borrow
+    std::vector< std::pair< std::weak_ptr<void>, RelocationCallback > > m_relocationCallbacks;
+
+protected:
+    IVulkanRelocatable(VulkanDevice& device) : m_allocator{ &device.GetAllocator() } {
+        m_allocator->RegisterRelocatable(this);
+    }
+    IVulkanRelocatable(IVulkanRelocatable&& other) : m_allocator{ other.m_allocator }, m_relocationCallbacks{ std::move(other.m_relocationCallbacks) } {
+        m_allocator->RegisterRelocatable(this);
+    }
+    IVulkanRelocatable& operator=(IVulkanRelocatable&& other) {
+        m_relocationCallbacks = std::move(other.m_relocationCallbacks);
+        return *this;
+    }
+    void notifyRelocated(const DeferFunction& defer) {
+        m_relocationCallbacks.erase(std::remove_if(m_relocationCallbacks.begin(), m_relocationCallbacks.end(), [](const auto& pair) { return pair.first.expired(); }), m_relocationCallbacks.end());
+        for (auto& [lifetime, callback] : m_relocationCallbacks) {
+            callback(*this, defer);
+        }
+    }
+};
+
+/**
+ * A `VkBuffer` with its own memory. Host visible buffers stay mapped for their whole lifetime, use `Write()`/`Read()`
+ * or `GetMapped()` with `Flush()`/`Invalidate()` instead of mapping per update.
+ * If no store location is given it is chosen from `usage`: uniform and transfer source buffers live in host memory,
+ * buffers only used as transfer destination are for readback, everything else (vertex, index, storage) is device
+ * local and gets `VK_BUFFER_USAGE_TRANSFER_DST_BIT` so it can be filled by `VulkanUploader`.
+ * Device local buffers can be moved by `VulkanDefragmenter`, subscribe with `OnRelocated()` if you keep the raw handle.
+ */
+class VulkanBuffer : public IVulkanRelocatable {
+public:
+    VulkanBuffer(VulkanDevice& device, VkDeviceSize size, VkBufferUsageFlags usage, std::optional<VulkanMemory::StoreLocation> storeLocation = std::nullopt, const char* category = "buffer", const std::optional<VulkanMemory::MemoryPolicy>& policy = std::nullopt) : 
+        IVulkanRelocatable{ device }, m_device{ &device }, m_size{ size }, m_usage{ usage }
+    {
+        const VulkanMemory::StoreLocation location = storeLocation.value_or(GetDefaultStoreLocation(usage));
+        if (location == VulkanMemory::StoreLocation::Device) {
+            // transfer source for the defragmenter
+            m_usage |= VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+        }
+
+        m_buffer = createBuffer();
+        try {
+            m_memory = std::make_unique<VulkanMemory>(*m_device, m_buffer, location, category, policy);
+        } catch (...) {
+            vkDestroyBuffer(m_device->Get(), m_buffer, nullptr);
+            throw;
+        }
+        if (m_memory->IsHostVisible()) {
+            m_mapped = static_cast<char*>(m_memory->Map());
+        }
+    }
+    ~VulkanBuffer() {
+        release();
+    }
+    VulkanBuffer(const VulkanBuffer&) = delete;
+    VulkanBuffer& operator=(const VulkanBuffer&) = delete;
+    VulkanBuffer(VulkanBuffer&& other) : IVulkanRelocatable{ std::move(other) }, m_device{ other.m_device } {
+        swap(other);
+    }
+    VulkanBuffer& operator=(VulkanBuffer&& other) {
+        if (this != &other) {
+            release();
+            IVulkanRelocatable::operator=(std::move(other));
+            m_device = other.m_device;
+            swap(other);
+        }
+        return *this;
+    }
+
+    static VulkanMemory::StoreLocation GetDefaultStoreLocation(VkBufferUsageFlags usage) {
+        if ((usage & (VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT)) != 0) {
+            return VulkanMemory::StoreLocation::Local;
+        }
+        if (usage == VK_BUFFER_USAGE_TRANSFER_DST_BIT) {
+            return VulkanMemory::StoreLocation::Readback;
+        }
+        return VulkanMemory::StoreLocation::Device;
+    }
+
+    // Copy into the mapped memory and flush it if the memory is not coherent.
+    void Write(const void* data, VkDeviceSize size, VkDeviceSize offset = 0) {
+        checkRange(size, offset);
+        std::memcpy(m_mapped + offset, data, size);
+        m_memory->Flush(offset, size);
+    }
+    template <typename T>
+    void Write(const T& data, VkDeviceSize offset = 0) {
+        Write(&data, sizeof(T), offset);
+    }
+    // Invalidate the mapped memory if it is not coherent and copy out of it.
+    void Read(void* data, VkDeviceSize size, VkDeviceSize offset = 0) {
+        checkRange(size, offset);
+        m_memory->Invalidate(offset, size);
+        std::memcpy(data, m_mapped + offset, size);
+    }
+    inline void Flush(VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE) {
+        m_memory->Flush(offset, size);
+    }
+    inline void Invalidate(VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE) {
+        m_memory->Invalidate(offset, size);
+    }
+
+    inline VkBuffer Get() const noexcept {
+        return m_buffer;
+    }
+    inline VkDeviceSize GetSize() const noexcept {
+        return m_size;
+    }
+    inline VkBufferUsageFlags GetUsage() const noexcept {
+        return m_usage;
+    }
+    // nullptr if the buffer is not host visible
+    inline char* GetMapped() const noexcept {
+        return m_mapped;
+    }
+    inline bool IsMapped() const noexcept {
+        return m_mapped != nullptr;
+    }
+    inline const VulkanMemory& GetMemory() const noexcept {
+        return *m_memory;
+    }
+
+    // the mapped pointer is handed out to users, so mapped buffers never move
+    virtual const VulkanMemory* GetRelocatableMemory() const override {
+        return (m_memory == nullptr || m_mapped != nullptr) ? nullptr : m_memory.get();
+    }
+    virtual VkMemoryRequirements GetMemoryRequirements() const override {
+        VkMemoryRequirements requirements;
+        vkGetBufferMemoryRequirements(m_device->Get(), m_buffer, &requirements);
+        return requirements;
+    }
+    virtual void Relocate(std::unique_ptr<VulkanMemory> memory, VkCommandBuffer commandBuffer, const DeferFunction& defer) override {
+        VkBuffer buffer = createBuffer();
+        if (VkResult result = vkBindBufferMemory(m_device->Get(), buffer, memory->GetMemory(), memory->GetOffset()); result != VK_SUCCESS) {
+            vkDestroyBuffer(m_device->Get(), buffer, nullptr);
+            throw std::runtime_error("failed to bind buffer memory!");
+        }
+        VkBufferCopy region{ 0, 0, m_size };
+        vkCmdCopyBuffer(commandBuffer, m_buffer, buffer, 1, &region);
+
+        defer([device = m_device->Get(), oldBuffer = m_buffer, oldMemory = std::shared_ptr<VulkanMemory>{ std::move(m_memory) }]() {
+            vkDestroyBuffer(device, oldBuffer, nullptr);
+        });
+        m_buffer = buffer;
+        m_memory = std::move(memory);
+        notifyRelocated(defer);
+    }
+protected:
+    VulkanDevice* m_device; // borrow
+    VkBuffer m_buffer = VK_NULL_HANDLE;
+    std::unique_ptr<VulkanMemory> m_memory;
+    char* m_mapped = nullptr;
+    VkDeviceSize m_size = 0;
+    VkBufferUsageFlags m_usage = 0;
+
+protected:
+    VkBuffer createBuffer() const {
+        VkBuffer buffer = VK_NULL_HANDLE;
+        VkBufferCreateInfo bufferInfo{ VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO, nullptr, 0 };
+        bufferInfo.size = m_size;
+        bufferInfo.usage = m_usage;
+        bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        if (vkCreateBuffer(m_device->Get(), &bufferInfo, nullptr, &buffer) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create buffer!");
+        }
+        return buffer;
+    }
+    void swap(VulkanBuffer& other) noexcept {
+        std::swap(m_buffer, other.m_buffer);
+        std::swap(m_memory, other.m_memory);
+        std::swap(m_mapped, other.m_mapped);
+        std::swap(m_size, other.m_size);
+        std::swap(m_usage, other.m_usage);
+    }
+    void release() noexcept {
+        if (m_mapped != nullptr) {
+            m_memory->Unmap();
+            m_mapped = nullptr;
+        }
+        m_memory.reset();
+        if (m_buffer != VK_NULL_HANDLE) {
+            vkDestroyBuffer(m_device->Get(), m_buffer, nullptr);
+            m_buffer = VK_NULL_HANDLE;
+        }
+    }
+    void checkRange(VkDeviceSize size, VkDeviceSize offset) const {
+        if (m_mapped == nullptr) {
+            throw std::runtime_error("buffer is not host visible, use VulkanUploader to fill it.");
+        }
+        if (offset + size > m_size) {
+            throw std::out_of_range("buffer access out of range.");
+        }
+    }
+};
+
+/**
+ * Persistently mapped ring buffer for per-draw uniform data.
+ * The buffer is split into one region per frame in flight, each `Push()` bumps a cursor inside the current frame's region
+ * and returns the dynamic offset to pass to `vkCmdBindDescriptorSets`. Bind the buffer once with
+ * `DescriptorSet::DynamicUniformDescriptor`, no descriptor write is needed per draw.
+ */
+class VulkanUniformRing {
+public:
+    VulkanUniformRing(VulkanDevice& device, VkDeviceSize bytesPerFrame, uint32_t framesInFlight) : m_device{ device }, m_framesInFlight{ framesInFlight } {
+        m_alignment = std::max<VkDeviceSize>(device.GetProperties().limits.minUniformBufferOffsetAlignment, 1);
+        m_frameSize = alignUp(bytesPerFrame, m_alignment);
+
+        // host visible and coherent, so writes need no flush
+        m_buffer = std::make_unique<VulkanBuffer>(m_device, m_frameSize * m_framesInFlight, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VulkanMemory::StoreLocation::Local, "uniform ring");
+        m_mapped = m_buffer->GetMapped();
+    }
+    VulkanUniformRing(const VulkanUniformRing&) = delete;
+    VulkanUniformRing& operator=(const VulkanUniformRing&) = delete;
+
+    // Call once per frame after the fence of `frameIndex` is signaled, the region of that frame is reused.
+    void BeginFrame(uint32_t frameIndex) {
+        m_frameIndex = frameIndex % m_framesInFlight;
+        m_head = 0;
+    }
+
+    // Copy `size` bytes into the current frame's region and return the dynamic offset of the slice.
+    uint32_t Push(const void* data, size_t size) {
+        const VkDeviceSize offset = m_head;
+        if (offset + size > m_frameSize) {
+            throw std::runtime_error("uniform ring overflow, increase bytes per frame.");
+        }
+        m_head = alignUp(offset + size, m_alignment);
+
+        const VkDeviceSize absolute = m_frameIndex * m_frameSize + offset;
+        std::memcpy(m_mapped + absolute, data, size);
+        return static_cast<uint32_t>(absolute);
+    }
+    template <typename T>
+    uint32_t Push(const T& data) {
+        return Push(&data, sizeof(T));
+    }
+
+    inline VkBuffer GetBuffer() const noexcept {
+        return m_buffer->Get();
+    }
+    inline VkDeviceSize GetFrameSize() const noexcept {
+        return m_frameSize;
+    }
+protected:
+    VulkanDevice& m_device;
+    std::unique_ptr<VulkanBuffer> m_buffer;
+    char* m_mapped = nullptr; // borrow, mapped by `m_buffer`
+
+    uint32_t m_framesInFlight;
+    uint32_t m_frameIndex = 0;
+    VkDeviceSize m_alignment = 1;
+    VkDeviceSize m_frameSize = 0;
+    VkDeviceSize m_head = 0;
+
+protected:
+    static VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment) {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+};
+
+/**
+ * Upload data to device local buffers and images on the transfer queue without stalling the graphics queue.
+ * Data is copied into a persistently mapped staging ring, copies are batched into one command buffer per `Flush()`.
+ * A batch signals a fence (to recycle its staging range) and a semaphore the consumer queue waits on.
+ * If the transfer family differs from the consumer family, the batch releases ownership of every destination and
+ * `RecordAcquire()` records the matching acquire barriers into the consumer's command buffer.
+ * 
+ * Typical usage:
+ *   uploader.UploadBuffer(vertexBuffer, 0, vertices.data(), bytes, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT);
+ *   uploader.Flush();
+ *   ... in the next graphics submission:
+ *   uploader.RecordAcquire(commandBuffer, waitSemaphores, waitStages);
+ */
+class VulkanUploader {
+public:
+    struct Statistics {
+        uint64_t bytesUploaded = 0;
+        uint64_t batchCount = 0;
+        uint64_t stallCount = 0; // times the staging ring was full and the cpu waited for the gpu
+        double busySeconds = 0.0; // from the first submission to the last observed completion
+    };
+    typedef uint64_t BatchSerial;
 
-                if (vkCreateCommandPool(device.Get(), &poolInfo, nullptr, &vc->m_datas[i].pool) != VK_SUCCESS) {
-                    throw std::runtime_error("failed to create command pool!");
-                }
+    static constexpr uint32_t BatchCount = 4;
+    static constexpr VkDeviceSize DefaultStagingSize = 32ull * 1024 * 1024;
 
-                mapQueueToIndex[queueIndex] = i;
+    VulkanUploader(VulkanDevice& device, VkDeviceSize stagingSize = DefaultStagingSize) : 
+        m_device{ device }, m_transferQueue{ device.GetTransferQueue() }, m_consumerQueue{ device.GetGraphicsQueue() }, m_stagingSize{ stagingSize }
+    {
+        m_alignment = std::max<VkDeviceSize>(device.GetProperties().limits.optimalBufferCopyOffsetAlignment, 16);
 
-                ++i;
-            }
+        m_staging = std::make_unique<VulkanBuffer>(m_device, m_stagingSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VulkanMemory::StoreLocation::Local, "staging ring");
+        m_mapped = m_staging->GetMapped();
 
-            for (auto& [queueIdx, count] : m_commandbuffers) {
-                CommandPool cp = vc->m_datas[mapQueueToIndex[queueIdx]];
-                cp.buffers.resize(count);
+        VkCommandPoolCreateInfo poolInfo{ VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO, nullptr, 0 };
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+        poolInfo.queueFamilyIndex = m_transferQueue.index;
+        if (vkCreateCommandPool(m_device.Get(), &poolInfo, nullptr, &m_commandPool) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create upload command pool!");
+        }
 
-                VkCommandBufferAllocateInfo allocInfo{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, nullptr, 0 };
-                allocInfo.commandBufferCount = count;
-                allocInfo.commandPool = cp.pool;
-                allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-                
-                if (vkAllocateCommandBuffers(device.Get(), &allocInfo, cp.buffers.data()) != VK_SUCCESS) {
-                    throw std::runtime_error("failed to allocate command buffers!");
-                }
-            }
+        std::array<VkCommandBuffer, BatchCount> commandBuffers;
+        VkCommandBufferAllocateInfo allocInfo{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, nullptr, 0 };
+        allocInfo.commandPool = m_commandPool;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandBufferCount = BatchCount;
+        if (vkAllocateCommandBuffers(m_device.Get(), &allocInfo, commandBuffers.data()) != VK_SUCCESS) {
+            throw std::runtime_error("failed to allocate upload command buffers!");
+        }
+        for (uint32_t i = 0; i < BatchCount; ++i) {
+            m_batches[i].commandBuffer = commandBuffers[i];
 
-            return vc;
+            VkFenceCreateInfo fenceInfo{ VK_STRUCTURE_TYPE_FENCE_CREATE_INFO, nullptr, 0 };
+            if (vkCreateFence(m_device.Get(), &fenceInfo, nullptr, &m_batches[i].fence) != VK_SUCCESS) {
+                throw std::runtime_error("failed to create upload fence!");
+            }
+            m_batches[i].semaphore = createSemaphore();
         }
-    protected:
-        // first one is queue index, second one is count
-        std::vector< std::pair<uint32_t, uint32_t> > m_commandbuffers;
-    };
-    ~VulkanCommand() {
-        for (CommandPool &cp : m_datas) {
-            if (cp.pool != VK_NULL_HANDLE) {
-                vkDestroyCommandPool(m_device.Get(), cp.pool, nullptr);
+        std::cout << "[VulkanUploader] Using transfer queue family " << m_transferQueue.index << " for consumer queue family " << m_consumerQueue.index << "." << std::endl;
+    }
+    ~VulkanUploader() {
+        for (Batch& batch : m_batches) {
+            if (batch.state == BatchState::Submitted) {
+                vkWaitForFences(m_device.Get(), 1, &batch.fence, VK_TRUE, std::numeric_limits<uint64_t>::max());
             }
+            vkDestroyFence(m_device.Get(), batch.fence, nullptr);
+            vkDestroySemaphore(m_device.Get(), batch.semaphore, nullptr);
         }
+        vkDestroyCommandPool(m_device.Get(), m_commandPool, nullptr);
     }
-    VulkanCommand(VulkanCommand&& other) : m_device{ other.m_device } {
-        std::swap(m_datas, other.m_datas);
+    VulkanUploader(const VulkanUploader&) = delete;
+    VulkanUploader& operator=(const VulkanUploader&) = delete;
+
+    // Copy `size` bytes into `dst` at `dstOffset`. Large uploads are split into several chunks of the staging ring.
+    // `dstAccess` and `dstStage` describe how the consumer queue will read the buffer.
+    void UploadBuffer(VkBuffer dst, VkDeviceSize dstOffset, const void* data, VkDeviceSize size, VkAccessFlags dstAccess, VkPipelineStageFlags dstStage) {
+        const VkDeviceSize chunkSize = m_stagingSize / 2;
+        for (VkDeviceSize done = 0; done < size; ) {
+            const VkDeviceSize chunk = std::min(chunkSize, size - done);
+            const VkDeviceSize stagingOffset = allocateStaging(chunk);
+            std::memcpy(m_mapped + stagingOffset, static_cast<const char*>(data) + done, chunk);
+
+            VkBufferCopy region{ stagingOffset, dstOffset + done, chunk };
+            vkCmdCopyBuffer(currentBatch().commandBuffer, m_staging->Get(), dst, 1, &region);
+            currentBatch().bytes += chunk;
+            done += chunk;
+        }
+
+        if (needOwnershipTransfer()) {
+            VkBufferMemoryBarrier barrier{ VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER, nullptr };
+            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barrier.dstAccessMask = 0;
+            barrier.srcQueueFamilyIndex = m_transferQueue.index;
+            barrier.dstQueueFamilyIndex = m_consumerQueue.index;
+            barrier.buffer = dst;
+            barrier.offset = dstOffset;
+            barrier.size = size;
+            vkCmdPipelineBarrier(currentBatch().commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+
+            barrier.srcAccessMask = 0;
+            barrier.dstAccessMask = dstAccess;
+            currentBatch().bufferAcquires.push_back(barrier);
+        }
+        currentBatch().waitStage |= dstStage;
+    }
+    // Upload a whole single mip, single layer 2D image, `data` is tightly packed. The image ends up in `finalLayout`.
+    void UploadImage(VkImage dst, uint32_t width, uint32_t height, VkImageAspectFlags aspect, const void* data, VkDeviceSize size, VkImageLayout finalLayout, VkAccessFlags dstAccess, VkPipelineStageFlags dstStage) {
+        if (size > m_stagingSize) {
+            throw std::runtime_error("image is larger than the staging ring, increase staging size.");
+        }
+        const VkDeviceSize stagingOffset = allocateStaging(size);
+        std::memcpy(m_mapped + stagingOffset, data, size);
+        VkCommandBuffer commandBuffer = currentBatch().commandBuffer;
+
+        VkImageMemoryBarrier barrier{ VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER, nullptr };
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = dst;
+        barrier.subresourceRange = { aspect, 0, 1, 0, 1 };
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+        VkBufferImageCopy region{ 0 };
+        region.bufferOffset = stagingOffset;
+        region.imageSubresource = { aspect, 0, 0, 1 };
+        region.imageExtent = { width, height, 1 };
+        vkCmdCopyBufferToImage(commandBuffer, m_staging->Get(), dst, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+        currentBatch().bytes += size;
+
+        // layout transition happens in the release barrier, the acquire barrier must repeat the same layouts
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = 0;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.newLayout = finalLayout;
+        if (needOwnershipTransfer()) {
+            barrier.srcQueueFamilyIndex = m_transferQueue.index;
+            barrier.dstQueueFamilyIndex = m_consumerQueue.index;
+        }
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+        if (needOwnershipTransfer()) {
+            barrier.srcAccessMask = 0;
+            barrier.dstAccessMask = dstAccess;
+            currentBatch().imageAcquires.push_back(barrier);
+        }
+        currentBatch().waitStage |= dstStage;
     }
-protected:
-    VulkanCommand(VulkanDevice& device) : m_device{ device } { };
-    VulkanDevice& m_device;
-    std::vector<CommandPool> m_datas;
-};
 
-class VulkanMemory {
-public:
-    enum class StoreLocation {
-        Local,
-        Device
-    };
-    VulkanMemory(VulkanDevice &device, VkMemoryRequirements memRequirements, StoreLocation storeLocation) : m_device{ device } {
-        VkMemoryPropertyFlagBits memPropFlags;
-        switch (m_storeLocation) {
-            case StoreLocation::Local : 
-                memPropFlags = static_cast<VkMemoryPropertyFlagBits>(VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-                break;
-            case StoreLocation::Device : 
-                memPropFlags = VkMemoryPropertyFlagBits::VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT; 
-                break;
+    // Submit the recorded copies, return the serial to query with `IsComplete()` or `Wait()`. Do nothing if no copy is recorded.
+    BatchSerial Flush() {
+        Batch& batch = m_batches[m_current];
+        if (batch.state != BatchState::Recording) return m_nextSerial - 1;
+
+        if (vkEndCommandBuffer(batch.commandBuffer) != VK_SUCCESS) {
+            throw std::runtime_error("failed to record upload command buffer!");
+        }
+        VkSubmitInfo submitInfo{ VK_STRUCTURE_TYPE_SUBMIT_INFO, nullptr };
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &batch.commandBuffer;
+        submitInfo.signalSemaphoreCount = 1;
+        submitInfo.pSignalSemaphores = &batch.semaphore;
+        if (vkQueueSubmit(m_transferQueue.raw, 1, &submitInfo, batch.fence) != VK_SUCCESS) {
+            throw std::runtime_error("failed to submit upload command buffer!");
         }
 
-        VkMemoryAllocateInfo memAllocInfo{VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, nullptr};
-        memAllocInfo.allocationSize = memRequirements.size;
-        memAllocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, memPropFlags);
+        batch.state = BatchState::Submitted;
+        batch.stagingEnd = m_head;
+        batch.submitTime = std::chrono::steady_clock::now();
+        if (m_stats.batchCount == 0) {
+            m_firstSubmitTime = batch.submitTime;
+        }
+        ++m_stats.batchCount;
+        m_pendingAcquires.push_back(m_current);
+        m_current = (m_current + 1) % BatchCount;
+        return batch.serial;
     }
-    ~VulkanMemory() {
-        vkFreeMemory(m_device.Get(), m_memory, nullptr);
+
+    // Record acquire barriers of every flushed batch into `commandBuffer` of the consumer queue, the submission of
+    // `commandBuffer` must wait on the returned semaphores at the returned stages.
+    void RecordAcquire(VkCommandBuffer commandBuffer, std::vector<VkSemaphore>& waitSemaphores, std::vector<VkPipelineStageFlags>& waitStages) {
+        for (uint32_t index : m_pendingAcquires) {
+            Batch& batch = m_batches[index];
+            if (!batch.bufferAcquires.empty() || !batch.imageAcquires.empty()) {
+                // starts at the stages the semaphore wait blocks, so it chains after the wait
+                vkCmdPipelineBarrier(commandBuffer, batch.waitStage, batch.waitStage, 0, 0, nullptr, 
+                    static_cast<uint32_t>(batch.bufferAcquires.size()), batch.bufferAcquires.data(), static_cast<uint32_t>(batch.imageAcquires.size()), batch.imageAcquires.data());
+            }
+            waitSemaphores.push_back(batch.semaphore);
+            waitStages.push_back(batch.waitStage);
+            batch.acquired = true;
+        }
+        m_pendingAcquires.clear();
     }
 
-    inline VkDeviceMemory GetMemory() const noexcept{
-        return m_memory;
+    bool IsComplete(BatchSerial serial) {
+        retire(false);
+        return serial < m_completedSerial;
     }
-    inline StoreLocation GetStoreLocation() const noexcept{
-        return m_storeLocation;
+    void Wait(BatchSerial serial) {
+        if (m_batches[m_current].state == BatchState::Recording && serial >= m_batches[m_current].serial) {
+            Flush();
+        }
+        while (!IsComplete(serial)) {
+            retire(true);
+        }
+    }
+
+    inline Statistics GetStatistics() const noexcept {
+        return m_stats;
+    }
+    void PrintStatistics() const {
+        const double throughput = m_stats.busySeconds > 0.0 ? m_stats.bytesUploaded / m_stats.busySeconds : 0.0;
+        std::cout << "[VulkanUploader] " << m_stats.bytesUploaded << " bytes in " << m_stats.batchCount << " batches, " << throughput / (1024.0 * 1024.0) << " MB/s, " << m_stats.stallCount << " stalls." << std::endl;
     }
+
 protected:
+    enum class BatchState {
+        Idle,
+        Recording,
+        Submitted
+    };
+    struct Batch {
+        VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+        VkFence fence = VK_NULL_HANDLE;
+        VkSemaphore semaphore = VK_NULL_HANDLE;
+        BatchState state = BatchState::Idle;
+        BatchSerial serial = 0;
+        uint64_t stagingEnd = 0;
+        VkDeviceSize bytes = 0;
+        VkPipelineStageFlags waitStage = 0;
+        bool acquired = false;
+        std::vector<VkBufferMemoryBarrier> bufferAcquires;
+        std::vector<VkImageMemoryBarrier> imageAcquires;
+        std::chrono::steady_clock::time_point submitTime;
+    };
+
     VulkanDevice& m_device;
-    VkDeviceMemory m_memory = VK_NULL_HANDLE;
-    StoreLocation m_storeLocation = StoreLocation::Local;
+    VulkanDevice::Queue m_transferQueue, m_consumerQueue;
+
+    std::unique_ptr<VulkanBuffer> m_staging;
+    char* m_mapped = nullptr; // borrow, mapped by `m_staging`
+    VkDeviceSize m_stagingSize;
+    VkDeviceSize m_alignment = 16;
+    // monotonic positions in the ring, the live range is [m_tail, m_head)
+    uint64_t m_head = 0, m_tail = 0;
+
+    VkCommandPool m_commandPool = VK_NULL_HANDLE;
+    std::array<Batch, BatchCount> m_batches;
+    uint32_t m_current = 0;
+    BatchSerial m_nextSerial = 1, m_completedSerial = 1; // serials below `m_completedSerial` are completed
+    std::vector<uint32_t> m_pendingAcquires;
+
+    Statistics m_stats;
+    std::chrono::steady_clock::time_point m_firstSubmitTime;
+
 protected:
-    uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) {
-        VkPhysicalDeviceMemoryProperties memProperties;
-        vkGetPhysicalDeviceMemoryProperties(m_device.GetPhysicalDevice(), &memProperties);
-        for (uint32_t i = 0; i < memProperties.memoryTypeCount; ++i){
-            if ((typeFilter & (1 << i)) && (memProperties.memoryTypes[i].propertyFlags & properties) == properties) {
-                return i;
+    inline bool needOwnershipTransfer() const noexcept {
+        return m_transferQueue.index != m_consumerQueue.index;
+    }
+    VkSemaphore createSemaphore() {
+        VkSemaphore semaphore = VK_NULL_HANDLE;
+        VkSemaphoreCreateInfo semaphoreInfo{ VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO, nullptr, 0 };
+        if (vkCreateSemaphore(m_device.Get(), &semaphoreInfo, nullptr, &semaphore) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create upload semaphore!");
+        }
+        return semaphore;
+    }
+    // Return the batch being recorded, begin a new one if needed.
+    Batch& currentBatch() {
+        Batch& batch = m_batches[m_current];
+        if (batch.state == BatchState::Recording) return batch;
+
+        if (batch.state == BatchState::Submitted) {
+            ++m_stats.stallCount;
+            while (batch.state == BatchState::Submitted) retire(true);
+        }
+        if (!batch.acquired) {
+            // nobody waited on the signaled semaphore, a binary semaphore can't be signaled twice
+            vkDestroySemaphore(m_device.Get(), batch.semaphore, nullptr);
+            batch.semaphore = createSemaphore();
+        }
+        batch.state = BatchState::Recording;
+        batch.serial = m_nextSerial++;
+        batch.bytes = 0;
+        batch.waitStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+        batch.acquired = false;
+        batch.bufferAcquires.clear();
+        batch.imageAcquires.clear();
+
+        vkResetCommandBuffer(batch.commandBuffer, 0);
+        VkCommandBufferBeginInfo beginInfo{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr, VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT };
+        if (vkBeginCommandBuffer(batch.commandBuffer, &beginInfo) != VK_SUCCESS) {
+            throw std::runtime_error("failed to begin upload command buffer!");
+        }
+        return batch;
+    }
+    // Reserve `size` bytes in the staging ring, flush and wait for older batches when the ring is full.
+    VkDeviceSize allocateStaging(VkDeviceSize size) {
+        currentBatch();
+        while (true) {
+            uint64_t begin = (m_head + m_alignment - 1) / m_alignment * m_alignment;
+            if (begin % m_stagingSize + size > m_stagingSize) {
+                begin = (begin / m_stagingSize + 1) * m_stagingSize; // wrap around, never split a copy
             }
+            if (begin + size - m_tail <= m_stagingSize) {
+                m_head = begin + size;
+                return begin % m_stagingSize;
+            }
+
+            // the ring is full, the current batch must go first if it holds the whole ring
+            if (std::none_of(m_batches.begin(), m_batches.end(), [](const Batch& b) { return b.state == BatchState::Submitted; })) {
+                Flush();
+                currentBatch();
+            }
+            ++m_stats.stallCount;
+            retire(true);
+        }
+    }
+    // Release the staging ranges of completed batches in submission order, `wait` blocks on the oldest one.
+    void retire(bool wait) {
+        const uint64_t stagingHead = m_head;
+        bool waited = false;
+        for (uint32_t k = 0; k < BatchCount; ++k) {
+            // the oldest submitted batch comes right after the current one
+            Batch& batch = m_batches[(m_current + k) % BatchCount];
+            if (batch.state != BatchState::Submitted) continue;
+
+            VkResult status = vkGetFenceStatus(m_device.Get(), batch.fence);
+            if (status == VK_NOT_READY && wait && !waited) {
+                status = vkWaitForFences(m_device.Get(), 1, &batch.fence, VK_TRUE, std::numeric_limits<uint64_t>::max());
+                waited = true;
+            }
+            if (status != VK_SUCCESS) break;
+
+            vkResetFences(m_device.Get(), 1, &batch.fence);
+            batch.state = BatchState::Idle;
+            m_tail = batch.stagingEnd;
+            m_completedSerial = batch.serial + 1;
+            m_stats.bytesUploaded += batch.bytes;
+            m_stats.busySeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_firstSubmitTime).count();
+        }
+        // everything submitted is done and nothing is being recorded, restart from the beginning of the ring
+        if (m_tail == stagingHead && m_batches[m_current].state != BatchState::Recording) {
+            m_head = m_tail = 0;
         }
-        throw std::runtime_error("failed to find suitable memory type!");
     }
 };
 
@@ -752,6 +2947,9 @@ public:
     VkImageView GetImageView() const noexcept{
         return m_imageView;
     }
+    VkImage GetImage() const noexcept{
+        return m_image;
+    }
     virtual ~IVulkanImage() = default;
 
     inline ImageType GetImageType() const noexcept{
@@ -760,6 +2958,12 @@ public:
      inline VkFormat GetFormat() const noexcept{
         return m_format;
      }
+     inline uint32_t GetWidth() const noexcept{
+        return m_width;
+     }
+     inline uint32_t GetHeight() const noexcept{
+        return m_height;
+     }
 protected:
     VkImage m_image = VK_NULL_HANDLE;
     VkImageView m_imageView = VK_NULL_HANDLE;
@@ -767,7 +2971,7 @@ protected:
     VulkanDevice &m_device;
     uint32_t m_width, m_height;
     VkFormat m_format = VK_FORMAT_UNDEFINED;
-    std::unique_ptr<VulkanMemory> m_memory = nullptr;
+    std::shared_ptr<VulkanMemory> m_memory = nullptr; // shared when the memory is aliased with other images
     VulkanMemory::StoreLocation m_storeLocation = VulkanMemory::StoreLocation::Local;
     ImageType m_type;
 
@@ -777,10 +2981,14 @@ protected:
     }
 };
 
-class VulkanColorImage : public IVulkanImage {
+class VulkanColorImage : public IVulkanImage, public IVulkanRelocatable {
 public:
-    VulkanColorImage(VulkanDevice& device, uint32_t width, uint32_t height, VkFormat format, VulkanMemory::StoreLocation storeLocation) : IVulkanImage{device, width, height, format, storeLocation, IVulkanImage::ImageType::Color } {
-        create();
+    // Transient images are placed by `StoreLocation::Transient` whatever `storeLocation` is, unless `memoryPolicy`
+    // overrides it.
+    VulkanColorImage(VulkanDevice& device, uint32_t width, uint32_t height, VkFormat format, VulkanMemory::StoreLocation storeLocation, std::optional<VulkanMemory::MemoryPolicy> memoryPolicy = std::nullopt) : 
+        VulkanColorImage{ device, width, height, format, storeLocation, IVulkanImage::ImageType::Color, VkImageUsageFlagBits::VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT | VkImageUsageFlagBits::VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, VkSampleCountFlagBits::VK_SAMPLE_COUNT_1_BIT, true, std::move(memoryPolicy) }
+    {
+
     }
     virtual ~VulkanColorImage() override {
         cleanup();
@@ -789,7 +2997,110 @@ public:
         cleanup();
         create();
     }
+
+    virtual VkMemoryRequirements GetMemoryRequirements() const override {
+        VkMemoryRequirements requirements;
+        vkGetImageMemoryRequirements(m_device.Get(), m_image, &requirements);
+        return requirements;
+    }
+    // The layout the content is kept in between frames. Content of images in `VK_IMAGE_LAYOUT_UNDEFINED` (e.g. attachments
+    // cleared every frame) is dropped when the image is moved, others are copied and need transfer src/dst usage.
+    void SetLayout(VkImageLayout layout) {
+        m_layout = layout;
+    }
+
+    virtual const VulkanMemory* GetRelocatableMemory() const override {
+        // aliased memory is shared with other images, lazily allocated memory is not really backed
+        if (!m_ownMemory || m_memory == nullptr || m_memory.use_count() != 1 || (m_memory->GetPropertyFlags() & VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT) != 0) {
+            return nullptr;
+        }
+        const VkImageUsageFlags transferUsage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+        if (m_layout != VK_IMAGE_LAYOUT_UNDEFINED && (m_usage & transferUsage) != transferUsage) {
+            return nullptr;
+        }
+        return m_memory.get();
+    }
+    virtual void Relocate(std::unique_ptr<VulkanMemory> memory, VkCommandBuffer commandBuffer, const DeferFunction& defer) override {
+        const VkImage oldImage = m_image;
+        const VkImageView oldImageView = m_imageView;
+        std::shared_ptr<VulkanMemory> oldMemory = std::move(m_memory);
+
+        createImage();
+        if (VkResult result = vkBindImageMemory(m_device.Get(), m_image, memory->GetMemory(), memory->GetOffset()); result != VK_SUCCESS) {
+            vkDestroyImage(m_device.Get(), m_image, nullptr);
+            m_image = oldImage;
+            m_memory = std::move(oldMemory);
+            throw std::runtime_error("failed to bind image memory!");
+        }
+        m_memory = std::move(memory);
+        createView();
+
+        if (m_layout != VK_IMAGE_LAYOUT_UNDEFINED) {
+            const VkImageAspectFlags aspect = (m_type == ImageType::DepthStencil ? VK_IMAGE_ASPECT_DEPTH_BIT : VK_IMAGE_ASPECT_COLOR_BIT);
+            std::array<VkImageMemoryBarrier, 2> barriers;
+            barriers.fill(VkImageMemoryBarrier{ VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER, nullptr, VK_ACCESS_MEMORY_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT, m_layout, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, oldImage, { aspect, 0, 1, 0, 1 } });
+            barriers[1].srcAccessMask = 0;
+            barriers[1].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barriers[1].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+            barriers[1].newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+            barriers[1].image = m_image;
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, static_cast<uint32_t>(barriers.size()), barriers.data());
+
+            VkImageCopy region{};
+            region.srcSubresource = { aspect, 0, 0, 1 };
+            region.dstSubresource = { aspect, 0, 0, 1 };
+            region.extent = { m_width, m_height, 1 };
+            vkCmdCopyImage(commandBuffer, oldImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, m_image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+            barriers[1].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barriers[1].dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+            barriers[1].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+            barriers[1].newLayout = m_layout;
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, 0, nullptr, 1, &barriers[1]);
+        }
+
+        defer([device = m_device.Get(), oldImage, oldImageView, oldMemory]() {
+            vkDestroyImageView(device, oldImageView, nullptr);
+            vkDestroyImage(device, oldImage, nullptr);
+        });
+        notifyRelocated(defer);
+    }
+
+    // Bind the image to a memory which may be shared (aliased) with other images, and create the image view.
+    void BindMemory(std::shared_ptr<VulkanMemory> memory) {
+        if (m_memory != nullptr) {
+            throw std::runtime_error("image memory is already bound!");
+        }
+        if (VkResult result = vkBindImageMemory(m_device.Get(), m_image, memory->GetMemory(), memory->GetOffset()); result != VK_SUCCESS) {
+            throw std::runtime_error("failed to bind image memory!");
+        }
+        m_memory = std::move(memory);
+        createView();
+    }
+    inline VkImageUsageFlags GetUsage() const noexcept {
+        return m_usage;
+    }
+    inline VkSampleCountFlagBits GetSampleCount() const noexcept {
+        return m_samples;
+    }
 protected:
+    friend class VulkanImagePool;
+    VulkanColorImage(VulkanDevice& device, uint32_t width, uint32_t height, VkFormat format, VulkanMemory::StoreLocation storeLocation, ImageType type, VkImageUsageFlags usage, VkSampleCountFlagBits samples, bool ownMemory, std::optional<VulkanMemory::MemoryPolicy> memoryPolicy = std::nullopt) : 
+        IVulkanImage{device, width, height, format, storeLocation, type }, IVulkanRelocatable{ device }, m_usage{ usage }, m_samples{ samples }, m_ownMemory{ ownMemory }, m_memoryPolicy{ std::move(memoryPolicy) }
+    {
+        // transient attachments are never accessed by the host, whatever location was asked for
+        if ((m_usage & VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT) != 0) {
+            m_storeLocation = VulkanMemory::StoreLocation::Transient;
+        }
+        create();
+    }
+
+    VkImageUsageFlags m_usage;
+    VkSampleCountFlagBits m_samples;
+    bool m_ownMemory;
+    std::optional<VulkanMemory::MemoryPolicy> m_memoryPolicy;
+    VkImageLayout m_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+
     void cleanup() {
         if (m_imageView!= VK_NULL_HANDLE) {
 			vkDestroyImageView(m_device.Get(), m_imageView, nullptr);
@@ -800,9 +3111,20 @@ protected:
 		if (m_memory != nullptr) {
 			m_memory.reset();
 		}
+        m_imageView = VK_NULL_HANDLE;
+        m_image = VK_NULL_HANDLE;
     }
     void create() {
-        // create image
+        createImage();
+
+        // memory of aliased images are bound later by `BindMemory()`
+        if (!m_ownMemory) return;
+
+        // allocate and bind memory, image view requires the image to be bound
+        m_memory = std::make_shared<VulkanMemory>(m_device, m_image, m_storeLocation, m_type == ImageType::DepthStencil ? "depth image" : "color image", m_memoryPolicy);
+        createView();
+    }
+    void createImage() {
         VkImageCreateInfo imageInfo{ VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO, nullptr, 0 };
 		imageInfo.imageType = VK_IMAGE_TYPE_2D;
 		imageInfo.format = m_format;
@@ -811,9 +3133,9 @@ protected:
 		imageInfo.extent.depth = 1;
 		imageInfo.mipLevels = 1;
 		imageInfo.arrayLayers = 1;
-		imageInfo.samples = VkSampleCountFlagBits::VK_SAMPLE_COUNT_1_BIT;
+		imageInfo.samples = m_samples;
 		imageInfo.tiling = VkImageTiling::VK_IMAGE_TILING_OPTIMAL;
-		imageInfo.usage = VkImageUsageFlagBits::VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT | VkImageUsageFlagBits::VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+		imageInfo.usage = m_usage;
 		imageInfo.sharingMode = VkSharingMode::VK_SHARING_MODE_EXCLUSIVE;
 		imageInfo.queueFamilyIndexCount = 0;
 		imageInfo.pQueueFamilyIndices = nullptr;
@@ -822,8 +3144,8 @@ protected:
 		if (vkCreateImage(m_device.Get(), &imageInfo, nullptr, &m_image) != VK_SUCCESS) {
 			throw std::runtime_error("failed to create image!");
 		}
-
-        // create image view
+    }
+    void createView() {
         VkImageViewCreateInfo imageViewInfo{ VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO, nullptr, 0 };
 		imageViewInfo.image = m_image;
 		imageViewInfo.viewType = VkImageViewType::VK_IMAGE_VIEW_TYPE_2D;
@@ -831,7 +3153,7 @@ protected:
         imageViewInfo.components.r = VkComponentSwizzle::VK_COMPONENT_SWIZZLE_IDENTITY;
         imageViewInfo.components.g = VkComponentSwizzle::VK_COMPONENT_SWIZZLE_IDENTITY;
         imageViewInfo.components.b = VkComponentSwizzle::VK_COMPONENT_SWIZZLE_IDENTITY;
-		imageViewInfo.subresourceRange.aspectMask = VkImageAspectFlagBits::VK_IMAGE_ASPECT_COLOR_BIT;
+		imageViewInfo.subresourceRange.aspectMask = (m_type == ImageType::DepthStencil ? VkImageAspectFlagBits::VK_IMAGE_ASPECT_DEPTH_BIT : VkImageAspectFlagBits::VK_IMAGE_ASPECT_COLOR_BIT);
 		imageViewInfo.subresourceRange.baseMipLevel  = 0;
 		imageViewInfo.subresourceRange.levelCount  = 1;
 		imageViewInfo.subresourceRange.baseArrayLayer  = 0;
@@ -840,12 +3162,6 @@ protected:
         if (vkCreateImageView(m_device.Get(), &imageViewInfo, nullptr, &m_imageView)!= VK_SUCCESS) {
 			throw std::runtime_error("failed to create texture image view!");
 		}
-
-        // get image memory requirements
-        VkMemoryRequirements imageMemoryRequirements;
-        vkGetImageMemoryRequirements(m_device.Get(), m_image, &imageMemoryRequirements);
-
-        m_memory = std::make_unique<VulkanMemory>(m_device, imageMemoryRequirements, m_storeLocation);
     }
 };
 
@@ -857,6 +3173,139 @@ class VulkanPresentImage : public VulkanColorImage {
     }
 };
 
+/**
+ * Color or depth attachment created without memory, call `BindMemory()` before use.
+ * This allows attachments whose lifetimes don't overlap to alias the same memory range.
+ */
+class VulkanAliasableImage : public VulkanColorImage {
+public:
+    VulkanAliasableImage(VulkanDevice& device, uint32_t width, uint32_t height, VkFormat format, VkSampleCountFlagBits samples, VkImageUsageFlags usage, ImageType type) :
+        VulkanColorImage{ device, width, height, format, VulkanMemory::StoreLocation::Device, type, usage, samples, false }
+    {
+
+    }
+};
+
+/**
+ * Recycles images with their own memory across swapchain recreations and frames instead of destroying them.
+ * Images are keyed by format, extent, usage, sample count and type. Extents are rounded up to `extentGranularity`, so
+ * an attachment may be slightly larger than requested (framebuffers only need attachments at least as large as
+ * themselves) and small steps of an interactive resize reuse the same images.
+ * Released images stay idle for at most `maxIdleFrames` calls of `EndFrame()`, and the least recently released ones
+ * are evicted first once idle images take more than `maxIdleBytes`. Release images only once the gpu is done with them.
+ */
+class VulkanImagePool {
+public:
+    struct Key {
+        VkFormat format;
+        uint32_t width, height;
+        VkImageUsageFlags usage;
+        VkSampleCountFlagBits samples;
+        IVulkanImage::ImageType type;
+
+        bool operator<(const Key& other) const {
+            return std::tie(format, width, height, usage, samples, type) < std::tie(other.format, other.width, other.height, other.usage, other.samples, other.type);
+        }
+    };
+    struct Statistics {
+        uint64_t hitCount = 0, missCount = 0, evictionCount = 0;
+        size_t idleCount = 0;
+        VkDeviceSize idleBytes = 0;
+    };
+
+    VulkanImagePool(VulkanDevice& device, uint32_t extentGranularity = 64, uint32_t maxIdleFrames = 120, VkDeviceSize maxIdleBytes = 256ull * 1024 * 1024) : 
+        m_device{ device }, m_extentGranularity{ std::max(extentGranularity, 1u) }, m_maxIdleFrames{ maxIdleFrames }, m_maxIdleBytes{ maxIdleBytes }
+    {
+
+    }
+    ~VulkanImagePool() {
+        Clear();
+    }
+    VulkanImagePool(const VulkanImagePool&) = delete;
+    VulkanImagePool& operator=(const VulkanImagePool&) = delete;
+
+    std::unique_ptr<VulkanColorImage> Acquire(VkFormat format, uint32_t width, uint32_t height, VkImageUsageFlags usage, VkSampleCountFlagBits samples, IVulkanImage::ImageType type) {
+        const Key key{ format, roundUp(width), roundUp(height), usage, samples, type };
+        auto found = std::find_if(m_idle.rbegin(), m_idle.rend(), [&key](const Entry& entry) { return !(entry.key < key) && !(key < entry.key); });
+        if (found != m_idle.rend()) {
+            std::unique_ptr<VulkanColorImage> image = std::move(found->image);
+            m_stats.idleBytes -= found->size;
+            m_idle.erase(std::next(found).base());
+            ++m_stats.hitCount;
+            return image;
+        }
+
+        ++m_stats.missCount;
+        return std::unique_ptr<VulkanColorImage>{ new VulkanColorImage{ m_device, key.width, key.height, key.format, VulkanMemory::StoreLocation::Device, key.type, key.usage, key.samples, true } };
+    }
+    // Images which didn't come from a pool are accepted too, as long as they own their memory.
+    void Release(std::unique_ptr<VulkanColorImage> image) {
+        if (image == nullptr) return;
+        if (typeid(*image) != typeid(VulkanColorImage) || !image->m_ownMemory) {
+            return;
+        }
+        image->m_relocationCallbacks.clear();
+        image->SetLayout(VK_IMAGE_LAYOUT_UNDEFINED);
+
+        const VkDeviceSize size = image->GetMemoryRequirements().size;
+        const Key key{ image->GetFormat(), image->GetWidth(), image->GetHeight(), image->GetUsage(), image->GetSampleCount(), image->GetImageType() };
+        m_idle.push_back(Entry{ key, std::move(image), m_frame, size });
+        m_stats.idleBytes += size;
+
+        while (m_stats.idleBytes > m_maxIdleBytes && !m_idle.empty()) {
+            evictOldest();
+        }
+    }
+    // Evict images which stayed idle for too long.
+    void EndFrame() {
+        ++m_frame;
+        while (!m_idle.empty() && m_frame - m_idle.front().releasedFrame > m_maxIdleFrames) {
+            evictOldest();
+        }
+    }
+    void Clear() {
+        while (!m_idle.empty()) {
+            evictOldest();
+        }
+    }
+
+    Statistics GetStatistics() const {
+        Statistics stats = m_stats;
+        stats.idleCount = m_idle.size();
+        return stats;
+    }
+    void PrintStatistics() const {
+        const uint64_t requests = m_stats.hitCount + m_stats.missCount;
+        std::cout << "[VulkanImagePool] " << m_stats.hitCount << " hits, " << m_stats.missCount << " misses (" << (requests == 0 ? 0.0 : 100.0 * m_stats.hitCount / requests) << "% hit rate), "
+            << m_stats.evictionCount << " evictions, " << m_idle.size() << " idle images in " << m_stats.idleBytes << " bytes." << std::endl;
+    }
+protected:
+    struct Entry {
+        Key key;
+        std::unique_ptr<VulkanColorImage> image;
+        uint64_t releasedFrame;
+        VkDeviceSize size;
+    };
+
+    uint32_t roundUp(uint32_t value) const {
+        return (value + m_extentGranularity - 1) / m_extentGranularity * m_extentGranularity;
+    }
+    void evictOldest() {
+        m_stats.idleBytes -= m_idle.front().size;
+        m_idle.pop_front();
+        ++m_stats.evictionCount;
+    }
+protected:
+    VulkanDevice& m_device;
+    uint32_t m_extentGranularity;
+    uint32_t m_maxIdleFrames;
+    VkDeviceSize m_maxIdleBytes;
+
+    std::deque<Entry> m_idle; // ordered by release, the front is evicted first
+    uint64_t m_frame = 0;
+    Statistics m_stats;
+};
+
 class VulkanFramebufferResource {
 public:
     struct Attachments {
@@ -961,19 +3410,29 @@ public:
             throw std::runtime_error("failed to create framebuffer!");
         }
     }
+    VulkanFramebuffer(const VulkanFramebuffer&) = delete;
+    VulkanFramebuffer& operator=(const VulkanFramebuffer&) = delete;
+    VulkanFramebuffer(VulkanFramebuffer&& other) noexcept : m_device{ other.m_device }, m_renderPass{ other.m_renderPass }, m_framebuffer{ other.m_framebuffer } {
+        other.m_framebuffer = VK_NULL_HANDLE;
+    }
     ~VulkanFramebuffer() {
-        vkDestroyFramebuffer(m_device.Get(), m_framebuffer, nullptr);
+        if (m_framebuffer != VK_NULL_HANDLE) {
+            vkDestroyFramebuffer(m_device.Get(), m_framebuffer, nullptr);
+        }
+    }
+    inline VkFramebuffer Get() const noexcept {
+        return m_framebuffer;
     }
 protected:
     VulkanDevice &m_device;
     VkRenderPass m_renderPass; // borrow. do not delete!
 
-    VkFramebuffer m_framebuffer;
+    VkFramebuffer m_framebuffer = VK_NULL_HANDLE;
 };
 
 class VulkanSwapChain {
 public:
-    VulkanSwapChain(VulkanDevice& device) : m_device{device} {
+    VulkanSwapChain(VulkanDevice& device) : m_device{device}, m_imagePool{device} {
         if (device.GetSurface() == VK_NULL_HANDLE) {
             throw std::runtime_error("Swapchain require a surface provided for device.");
         }
@@ -1002,6 +3461,8 @@ public:
         return VK_SAMPLE_COUNT_1_BIT;
     }
     VulkanDevice& GetDevice() const { return m_device; }
+    // Framebuffer resources are recycled through this pool, call its `EndFrame()` once per frame.
+    VulkanImagePool& GetImagePool() { return m_imagePool; }
     inline uint32_t Count() const {
         return m_imageCount;
     }
@@ -1009,20 +3470,30 @@ public:
 
     template <typename ...Args>
     std::vector<VulkanFramebuffer>& RecreateFramebuffers(VkRenderPass renderPass) {
-        const size_t swapChainImageCount = m_images.size();
+        // resize is where memory spikes, watch the peak between releasing old attachments and creating new ones
+        VulkanMemoryAllocator& allocator = m_device.GetAllocator();
+        const VkDeviceSize usedBefore = allocator.GetStatistics().usedBytes;
+        allocator.BeginWatermark();
 
         cleanupResources();
-        ( m_framebufferResources.emplace_back(new Args{ m_device, m_width, m_height, m_format, VulkanMemory::StoreLocation::Device }), ... );
+        ( m_framebufferResources.emplace_back(createResource<Args>()), ... );
 
-        m_framebuffers.clear();
-        for (int i = 0; i < swapChainImageCount; ++i) {
-            std::vector<VkImageView> attachments{ m_imageViews[i] };
-            std::transform(m_framebufferResources.begin(), m_framebufferResources.end(), std::back_inserter(attachments), [](auto& resource) {
-                return resource->GetImageView();
-            });
+        const VkDeviceSize peak = allocator.EndWatermark();
+        std::cout << "[VulkanSwapChain] Recreated framebuffer resources, memory " << usedBefore << " -> " << allocator.GetStatistics().usedBytes << " bytes, peak " << peak << " bytes." << std::endl;
 
-            m_framebuffers.emplace_back(m_device, m_width, m_height, attachments, renderPass);
+        // framebuffers reference the views of the resources, rebuild them when the defragmenter moves one
+        m_renderPass = renderPass;
+        for (IVulkanImage* image : m_framebufferResources) {
+            if (IVulkanRelocatable* relocatable = dynamic_cast<IVulkanRelocatable*>(image); relocatable != nullptr) {
+                relocatable->OnRelocated(m_lifetime, [this](IVulkanRelocatable&, const IVulkanRelocatable::DeferFunction& defer) {
+                    auto retired = std::make_shared<std::vector<VulkanFramebuffer>>(std::move(m_framebuffers));
+                    defer([retired]() {});
+                    createFramebuffers();
+                });
+            }
         }
+
+        createFramebuffers();
         return m_framebuffers;
     }
 protected:
@@ -1144,30 +3615,228 @@ protected:
 			createInfo.subresourceRange.baseArrayLayer = 0;
 			createInfo.subresourceRange.layerCount = 1;
 
-            if (VkResult result = vkCreateImageView(device, &createInfo, nullptr, &m_imageViews[i]); result!= VK_SUCCESS) {
-				throw std::runtime_error("failed to create image views!");
-			}
+            if (VkResult result = vkCreateImageView(device, &createInfo, nullptr, &m_imageViews[i]); result!= VK_SUCCESS) {
+				throw std::runtime_error("failed to create image views!");
+			}
+        }
+    }
+    void createFramebuffers() {
+        m_framebuffers.clear();
+        for (size_t i = 0; i < m_images.size(); ++i) {
+            std::vector<VkImageView> attachments{ m_imageViews[i] };
+            std::transform(m_framebufferResources.begin(), m_framebufferResources.end(), std::back_inserter(attachments), [](auto& resource) {
+                return resource->GetImageView();
+            });
+
+            m_framebuffers.emplace_back(m_device, m_extent.width, m_extent.height, attachments, m_renderPass);
+        }
+    }
+    template <typename T>
+    IVulkanImage* createResource() {
+        if constexpr (std::is_same_v<T, VulkanColorImage>) {
+            return m_imagePool.Acquire(m_format, m_extent.width, m_extent.height, VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, VK_SAMPLE_COUNT_1_BIT, IVulkanImage::ImageType::Color).release();
+        } else {
+            return new T{ m_device, m_extent.width, m_extent.height, m_format, VulkanMemory::StoreLocation::Device };
+        }
+    }
+    void cleanupResources() {
+        for (IVulkanImage* image : m_framebufferResources) {
+            if (VulkanColorImage* colorImage = dynamic_cast<VulkanColorImage*>(image); colorImage != nullptr) {
+                m_imagePool.Release(std::unique_ptr<VulkanColorImage>{ colorImage });
+            } else {
+                delete image;
+            }
+        }
+        m_framebufferResources.clear();
+    }
+protected:
+    VulkanDevice& m_device;
+    VkSurfaceKHR m_surface; // borrow, do not destroy!
+
+    VkSwapchainKHR m_swapChain;
+    std::vector<VkImage> m_images;
+    std::vector<VkImageView> m_imageViews;
+    VkExtent2D m_extent;
+    VkFormat m_format;
+    uint32_t m_imageCount;
+
+    std::vector<VulkanFramebuffer> m_framebuffers;
+    std::vector<IVulkanImage*> m_framebufferResources; // own, remember to destroy!
+    VulkanImagePool m_imagePool;
+    VkRenderPass m_renderPass = VK_NULL_HANDLE; // borrow, do not destroy!
+    std::shared_ptr<void> m_lifetime = std::make_shared<char>(); // expires relocation callbacks with the swapchain
+};
+
+/**
+ * Incrementally compacts device memory: each `Step()` moves live buffers and images out of sparse blocks into denser
+ * ones of the same pool with gpu copies, at most `bytesPerStep` per call, so emptied blocks go back to the driver.
+ * Call `Step()` once per frame before recording. Moved resources switch to their new handles right away: the copy is
+ * submitted to the graphics queue before any later frame and waits for the earlier ones, so the gpu is never drained.
+ * `OnRelocated()` subscribers (descriptor sets, framebuffers) hand the new handles to frames recorded from now on.
+ * Replaced handles are destroyed once the fence of the copy has signaled, by then the frames before it are done too.
+ */
+class VulkanDefragmenter {
+public:
+    struct Statistics {
+        uint64_t movedBytes = 0;
+        uint64_t moveCount = 0;
+        uint64_t passCount = 0; // steps which moved something
+        uint64_t noRoomCount = 0; // candidates skipped because no denser block had room
+    };
+    static constexpr VkDeviceSize DefaultBytesPerStep = 16ull * 1024 * 1024;
+
+    VulkanDefragmenter(VulkanDevice& device, VkDeviceSize bytesPerStep = DefaultBytesPerStep, double sparseThreshold = 0.5) : 
+        m_device{ device }, m_queue{ device.GetGraphicsQueue() }, m_bytesPerStep{ bytesPerStep }, m_sparseThreshold{ sparseThreshold }
+    {
+        VkCommandPoolCreateInfo poolInfo{ VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO, nullptr, 0 };
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+        poolInfo.queueFamilyIndex = m_queue.index;
+        if (vkCreateCommandPool(m_device.Get(), &poolInfo, nullptr, &m_commandPool) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create defragmentation command pool!");
+        }
+
+        VkCommandBufferAllocateInfo allocInfo{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, nullptr, 0 };
+        allocInfo.commandPool = m_commandPool;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandBufferCount = 1;
+        if (vkAllocateCommandBuffers(m_device.Get(), &allocInfo, &m_commandBuffer) != VK_SUCCESS) {
+            throw std::runtime_error("failed to allocate defragmentation command buffer!");
+        }
+
+        VkFenceCreateInfo fenceInfo{ VK_STRUCTURE_TYPE_FENCE_CREATE_INFO, nullptr, 0 };
+        if (vkCreateFence(m_device.Get(), &fenceInfo, nullptr, &m_fence) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create defragmentation fence!");
+        }
+    }
+    ~VulkanDefragmenter() {
+        if (m_submitted) {
+            vkWaitForFences(m_device.Get(), 1, &m_fence, VK_TRUE, std::numeric_limits<uint64_t>::max());
+        }
+        runDeferred();
+        vkDestroyFence(m_device.Get(), m_fence, nullptr);
+        vkDestroyCommandPool(m_device.Get(), m_commandPool, nullptr);
+    }
+    VulkanDefragmenter(const VulkanDefragmenter&) = delete;
+    VulkanDefragmenter& operator=(const VulkanDefragmenter&) = delete;
+
+    // Returns true if something was moved. Does nothing while the previous pass is still executing.
+    bool Step() {
+        if (m_submitted) {
+            if (vkGetFenceStatus(m_device.Get(), m_fence) != VK_SUCCESS) return false;
+            vkResetFences(m_device.Get(), 1, &m_fence);
+            m_submitted = false;
+            runDeferred();
+        }
+
+        VulkanMemoryAllocator& allocator = m_device.GetAllocator();
+        const std::vector<const VulkanMemoryAllocator::Block*> sparseBlocks = allocator.QuerySparseBlocks(m_sparseThreshold);
+        if (sparseBlocks.empty()) return false;
+
+        // resources in the sparsest blocks first
+        std::vector< std::pair<size_t, IVulkanRelocatable*> > candidates;
+        for (IVulkanRelocatable* relocatable : allocator.GetRelocatables()) {
+            const VulkanMemory* memory = relocatable->GetRelocatableMemory();
+            if (memory == nullptr) continue;
+            auto found = std::find(sparseBlocks.begin(), sparseBlocks.end(), memory->GetAllocation().GetBlock());
+            if (found != sparseBlocks.end()) {
+                candidates.emplace_back(std::distance(sparseBlocks.begin(), found), relocatable);
+            }
+        }
+        std::stable_sort(candidates.begin(), candidates.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+        const DeferFunction defer = [this](std::function<void()> destroy) {
+            m_deferred.push_back(std::move(destroy));
+        };
+        bool recording = false;
+        VkDeviceSize movedBytes = 0;
+        for (auto& [rank, relocatable] : candidates) {
+            if (movedBytes >= m_bytesPerStep) break;
+
+            const VulkanMemory* memory = relocatable->GetRelocatableMemory();
+            if (memory == nullptr) continue;
+            const VkMemoryRequirements requirements = relocatable->GetMemoryRequirements();
+            std::unique_ptr<VulkanMemory> destination = memory->AllocateForMove(requirements);
+            if (destination == nullptr) {
+                ++m_stats.noRoomCount;
+                continue;
+            }
+
+            if (!recording) {
+                beginPass();
+                recording = true;
+            }
+            relocatable->Relocate(std::move(destination), m_commandBuffer, defer);
+            movedBytes += requirements.size;
+            ++m_stats.moveCount;
         }
+        if (!recording) return false;
+
+        endPass();
+        m_stats.movedBytes += movedBytes;
+        ++m_stats.passCount;
+        return true;
     }
-    void cleanupResources() {
-        for (IVulkanImage* image : m_framebufferResources) {
-            delete image;
+
+    inline const Statistics& GetStatistics() const noexcept {
+        return m_stats;
+    }
+    void PrintStatistics() const {
+        std::cout << "[VulkanDefragmenter] Moved " << m_stats.movedBytes << " bytes in " << m_stats.moveCount << " moves over " << m_stats.passCount << " passes, "
+            << m_stats.noRoomCount << " candidates without room." << std::endl;
+    }
+protected:
+    typedef IVulkanRelocatable::DeferFunction DeferFunction;
+
+    void beginPass() {
+        VkCommandBufferBeginInfo beginInfo{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr, 0 };
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        if (vkBeginCommandBuffer(m_commandBuffer, &beginInfo) != VK_SUCCESS) {
+            throw std::runtime_error("failed to begin defragmentation command buffer!");
         }
-        m_framebufferResources.clear();
+
+        // the copies read what the frames submitted earlier on the queue wrote
+        VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr };
+        barrier.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        vkCmdPipelineBarrier(m_commandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+    }
+    void endPass() {
+        // later submissions on the queue read the moved resources
+        VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr };
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+        vkCmdPipelineBarrier(m_commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+        if (vkEndCommandBuffer(m_commandBuffer) != VK_SUCCESS) {
+            throw std::runtime_error("failed to end defragmentation command buffer!");
+        }
+        VkSubmitInfo submitInfo{ VK_STRUCTURE_TYPE_SUBMIT_INFO, nullptr };
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &m_commandBuffer;
+        if (vkQueueSubmit(m_queue.raw, 1, &submitInfo, m_fence) != VK_SUCCESS) {
+            throw std::runtime_error("failed to submit defragmentation commands!");
+        }
+        m_submitted = true;
+    }
+    void runDeferred() {
+        for (std::function<void()>& destroy : m_deferred) {
+            destroy();
+        }
+        m_deferred.clear();
     }
 protected:
     VulkanDevice& m_device;
-    VkSurfaceKHR m_surface; // borrow, do not destroy!
+    VulkanDevice::Queue m_queue;
+    VkDeviceSize m_bytesPerStep;
+    double m_sparseThreshold;
 
-    VkSwapchainKHR m_swapChain;
-    std::vector<VkImage> m_images;
-    std::vector<VkImageView> m_imageViews;
-    VkExtent2D m_extent;
-    VkFormat m_format;
-    uint32_t m_imageCount;
+    VkCommandPool m_commandPool = VK_NULL_HANDLE;
+    VkCommandBuffer m_commandBuffer = VK_NULL_HANDLE; // freed with the pool
+    VkFence m_fence = VK_NULL_HANDLE;
+    bool m_submitted = false;
+    std::vector< std::function<void()> > m_deferred; // destruction of replaced handles, run when `m_fence` signals
 
-    std::vector<VulkanFramebuffer> m_framebuffers;
-    std::vector<IVulkanImage*> m_framebufferResources; // own, remember to destroy!
+    Statistics m_stats;
 };
 
 struct MinMax {
@@ -1459,8 +4128,10 @@ class DescriptorSet {
 public:
     enum class Type {
         Uniform,
+        DynamicUniform,
         ImageSampler,
-        StorageBuffer
+        StorageBuffer,
+        InputAttachment
     };
 protected:
     struct DescriptorBase {
@@ -1474,7 +4145,7 @@ protected:
         }
     };
     struct DescriptorSetDescription {
-        VkDescriptorSetLayout layout;
+        VulkanLayoutCache::DescriptorSetLayout layout; // shared with identical sets
         uint32_t count;
 
         // members in layout
@@ -1485,15 +4156,24 @@ public:
     template <size_t N> struct ArrayDescriptor<Type::Uniform, N> : public DescriptorBase {
         ArrayDescriptor(uint32_t bindPoint, VkShaderStageFlags stages) : DescriptorBase(bindPoint, VkDescriptorType::VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, N, stages) {}
     };
+    template <size_t N> struct ArrayDescriptor<Type::DynamicUniform, N> : public DescriptorBase {
+        ArrayDescriptor(uint32_t bindPoint, VkShaderStageFlags stages) : DescriptorBase(bindPoint, VkDescriptorType::VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, N, stages) {}
+    };
     template <size_t N> struct ArrayDescriptor<Type::ImageSampler, N> : public DescriptorBase {
         ArrayDescriptor(uint32_t bindPoint, VkShaderStageFlags stages) : DescriptorBase(bindPoint, VkDescriptorType::VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, N, stages) {}
     };
     template <size_t N> struct ArrayDescriptor<Type::StorageBuffer, N>  : public DescriptorBase {
         ArrayDescriptor(uint32_t bindPoint, VkShaderStageFlags stages) : DescriptorBase(bindPoint, VkDescriptorType::VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, N, stages) {}
     };
+    // Input attachments are only readable from the fragment stage.
+    template <size_t N> struct ArrayDescriptor<Type::InputAttachment, N> : public DescriptorBase {
+        ArrayDescriptor(uint32_t bindPoint) : DescriptorBase(bindPoint, VkDescriptorType::VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT, N, VK_SHADER_STAGE_FRAGMENT_BIT) {}
+    };
     using UniformDescriptor = ArrayDescriptor<Type::Uniform, 1>;
+    using DynamicUniformDescriptor = ArrayDescriptor<Type::DynamicUniform, 1>;
     using ImageSamplerDescriptor = ArrayDescriptor<Type::ImageSampler, 1>;
     using StorageBufferDescriptor = ArrayDescriptor<Type::StorageBuffer, 1>;
+    using InputAttachmentDescriptor = ArrayDescriptor<Type::InputAttachment, 1>;
 
     typedef size_t DescriptorSetId;
 public:
@@ -1503,36 +4183,118 @@ public:
             if (m_pool != VK_NULL_HANDLE) {
                 vkDestroyDescriptorPool(m_device.Get(), m_pool, nullptr);
             }
-            for (DescriptorSet::DescriptorSetDescription& desc : m_descriptions) {
-                if (desc.layout != VK_NULL_HANDLE) {
-                    vkDestroyDescriptorSetLayout(m_device.Get(), desc.layout, nullptr);
-                }
-            }
         }
 
-        CompiledDescriptorSet(CompiledDescriptorSet&& other) : m_device{ other.m_device }, m_pool{ other.m_pool } {
+        CompiledDescriptorSet(CompiledDescriptorSet&& other) : m_device{ other.m_device }, m_pool{ other.m_pool }, m_self{ std::move(other.m_self) } {
             other.m_pool = VK_NULL_HANDLE;
+            *m_self = this;
             
             std::swap(m_sets, other.m_sets);
+            std::swap(m_stale, other.m_stale);
             std::swap(m_descriptions, other.m_descriptions);
             assert(other.m_descriptions.size() == 0 && "Unexpected behaviour");
         }
 
         void UpdateUniformDescriptor(DescriptorSetId setId, uint32_t bindingId, VkBuffer buffer, uint32_t offset, size_t size) {
+            updateBufferDescriptor(setId, bindingId, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, buffer, offset, size);
+        }
+        // The descriptor follows `buffer` when it is moved by `VulkanDefragmenter`.
+        void UpdateUniformDescriptor(DescriptorSetId setId, uint32_t bindingId, VulkanBuffer& buffer, VkDeviceSize offset, VkDeviceSize size) {
+            updateTrackedBufferDescriptor(setId, bindingId, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, buffer, offset, size);
+        }
+        void UpdateStorageDescriptor(DescriptorSetId setId, uint32_t bindingId, VulkanBuffer& buffer, VkDeviceSize offset, VkDeviceSize size) {
+            updateTrackedBufferDescriptor(setId, bindingId, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, buffer, offset, size);
+        }
+
+        // Bind a `VulkanUniformRing` to a dynamic uniform binding once, the per draw offset is given at bind time.
+        // `range` is the size of a single slice pushed into the ring.
+        void UpdateDynamicUniformDescriptor(DescriptorSetId setId, uint32_t bindingId, const VulkanUniformRing& ring, size_t range) {
+            updateBufferDescriptor(setId, bindingId, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, ring.GetBuffer(), 0, range);
+        }
+
+        // `layout` must match the layout the subpass reading the attachment uses, see `FrameGraph::UpdateInputAttachmentDescriptor`.
+        void UpdateInputAttachmentDescriptor(DescriptorSetId setId, uint32_t bindingId, VkImageView imageView, VkImageLayout layout) {
+            dropStale(setId, bindingId);
+            VkDescriptorImageInfo imageInfo{};
+            imageInfo.sampler = VK_NULL_HANDLE;
+            imageInfo.imageView = imageView;
+            imageInfo.imageLayout = layout;
+
+            ScratchArena& arena = ScratchArena::ThreadLocal();
+            ScratchArena::Scope scope{ arena };
+            std::vector<VkDescriptorSet>& set = m_sets[setId];
+            std::pmr::vector<VkWriteDescriptorSet> writes(set.size(), &arena);
+            std::transform(set.begin(), set.end(), writes.begin(), [pImageInfo = &imageInfo, bindingId](VkDescriptorSet& set) {
+                VkWriteDescriptorSet write{ VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, nullptr };
+                write.dstSet = set;
+                write.dstBinding = bindingId;
+                write.dstArrayElement = 0;
+                write.descriptorCount = 1;
+                write.descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+                write.pImageInfo = pImageInfo;
+                write.pBufferInfo = nullptr;
+                write.pTexelBufferView = nullptr;
+
+                return write;
+            });
+
+            vkUpdateDescriptorSets(m_device.Get(), writes.size(), writes.data(), 0, nullptr);
+        }
+        // The descriptor follows `image` when it is moved by `VulkanDefragmenter`.
+        void UpdateInputAttachmentDescriptor(DescriptorSetId setId, uint32_t bindingId, IVulkanImage& image, VkImageLayout layout) {
+            UpdateInputAttachmentDescriptor(setId, bindingId, image.GetImageView(), layout);
+            if (IVulkanRelocatable* relocatable = dynamic_cast<IVulkanRelocatable*>(&image); relocatable != nullptr) {
+                relocatable->OnRelocated(m_self, [self = m_self.get(), setId, bindingId, layout](IVulkanRelocatable& resource, const IVulkanRelocatable::DeferFunction&) {
+                    const VkImageView imageView = dynamic_cast<IVulkanImage&>(resource).GetImageView();
+                    (*self)->markStale(setId, bindingId, StaleDescriptor{ VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT, {}, { VK_NULL_HANDLE, imageView, layout } });
+                });
+            }
+        }
+
+        VkDescriptorSetLayout GetLayout(DescriptorSetId setId) const { 
+            return m_descriptions[setId].layout->handle; 
+        }
+        const VulkanLayoutCache::DescriptorSetLayout& GetLayoutRef(DescriptorSetId setId) const {
+            return m_descriptions[setId].layout;
+        }
+        const std::vector<VkDescriptorSetLayoutBinding>& GetBindings(DescriptorSetId setId) const {
+            return m_descriptions[setId].bindings;
+        }
+        // Call when recording the frame using the set at `index`, once the gpu is done with its previous use. Descriptors
+        // of resources moved by `VulkanDefragmenter` are rewritten here, the set may be in use by another frame before.
+        VkDescriptorSet GetDescriptorSet(DescriptorSetId setId, uint32_t index) {
+            const VkDescriptorSet set = m_sets[setId][index];
+            if (setId < m_stale.size() && !m_stale[setId][index].empty()) {
+                writeStaleDescriptors(set, m_stale[setId][index]);
+                m_stale[setId][index].clear();
+            }
+            return set;
+        }
+    protected:
+        struct StaleDescriptor {
+            VkDescriptorType type;
+            VkDescriptorBufferInfo bufferInfo; // buffer descriptors
+            VkDescriptorImageInfo imageInfo; // image descriptors
+        };
+
+        void updateBufferDescriptor(DescriptorSetId setId, uint32_t bindingId, VkDescriptorType type, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size) {
+            dropStale(setId, bindingId);
             VkDescriptorBufferInfo bufferInfo{};
 			bufferInfo.buffer = buffer;
-			bufferInfo.offset = 0;
+			bufferInfo.offset = offset;
 			bufferInfo.range = size;
 
+            ScratchArena& arena = ScratchArena::ThreadLocal();
+            ScratchArena::Scope scope{ arena };
             std::vector<VkDescriptorSet>& set = m_sets[setId];
-            std::vector<VkWriteDescriptorSet> writes(set.size());
-            std::transform(set.begin(), set.end(), writes.begin(), [pBufferInfo = &bufferInfo, bindingId](VkDescriptorSet& set) {
+            std::pmr::vector<VkWriteDescriptorSet> writes(set.size(), &arena);
+            std::transform(set.begin(), set.end(), writes.begin(), [pBufferInfo = &bufferInfo, bindingId, type](VkDescriptorSet& set) {
                 VkWriteDescriptorSet write{ VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, nullptr };
 				write.dstSet  = set;
                 write.dstBinding = bindingId;
 				write.dstArrayElement = 0;
                 write.descriptorCount = 1;
-                write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+                write.descriptorType = type;
                 write.pImageInfo = nullptr;
                 write.pBufferInfo = pBufferInfo;
                 write.pTexelBufferView = nullptr;
@@ -1542,11 +4304,50 @@ public:
 
             vkUpdateDescriptorSets(m_device.Get(), writes.size(), writes.data(), 0, nullptr);
         }
-
-        VkDescriptorSetLayout GetLayout(DescriptorSetId setId) const { 
-            return m_descriptions[setId].layout; 
+        void updateTrackedBufferDescriptor(DescriptorSetId setId, uint32_t bindingId, VkDescriptorType type, VulkanBuffer& buffer, VkDeviceSize offset, VkDeviceSize size) {
+            updateBufferDescriptor(setId, bindingId, type, buffer.Get(), offset, size);
+            buffer.OnRelocated(m_self, [self = m_self.get(), setId, bindingId, type, offset, size](IVulkanRelocatable& resource, const IVulkanRelocatable::DeferFunction&) {
+                (*self)->markStale(setId, bindingId, StaleDescriptor{ type, { static_cast<VulkanBuffer&>(resource).Get(), offset, size }, {} });
+            });
         }
-    protected:
+        void markStale(DescriptorSetId setId, uint32_t bindingId, const StaleDescriptor& descriptor) {
+            if (m_stale.size() < m_sets.size()) {
+                m_stale.resize(m_sets.size());
+            }
+            m_stale[setId].resize(m_sets[setId].size());
+            for (std::map<uint32_t, StaleDescriptor>& stale : m_stale[setId]) {
+                stale[bindingId] = descriptor;
+            }
+        }
+        // a direct update of the binding replaces its pending rewrite
+        void dropStale(DescriptorSetId setId, uint32_t bindingId) {
+            if (setId >= m_stale.size()) return;
+            for (std::map<uint32_t, StaleDescriptor>& stale : m_stale[setId]) {
+                stale.erase(bindingId);
+            }
+        }
+        void writeStaleDescriptors(VkDescriptorSet set, const std::map<uint32_t, StaleDescriptor>& stale) {
+            ScratchArena& arena = ScratchArena::ThreadLocal();
+            ScratchArena::Scope scope{ arena };
+            std::pmr::vector<VkWriteDescriptorSet> writes(&arena);
+            writes.reserve(stale.size());
+            for (const auto& [bindingId, descriptor] : stale) {
+                VkWriteDescriptorSet write{ VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, nullptr };
+                write.dstSet = set;
+                write.dstBinding = bindingId;
+                write.dstArrayElement = 0;
+                write.descriptorCount = 1;
+                write.descriptorType = descriptor.type;
+                if (descriptor.type == VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT) {
+                    write.pImageInfo = &descriptor.imageInfo;
+                } else {
+                    write.pBufferInfo = &descriptor.bufferInfo;
+                }
+                writes.push_back(write);
+            }
+            vkUpdateDescriptorSets(m_device.Get(), static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+        }
+
         friend DescriptorSet;
         CompiledDescriptorSet(VulkanDevice& device) : m_device(device) { } 
         VulkanDevice& m_device;
@@ -1554,17 +4355,18 @@ public:
         // generated from `DescriptorSet`
         VkDescriptorPool m_pool;
         std::vector< std::vector< VkDescriptorSet > > m_sets;
+        // descriptors of relocated resources waiting for their set to be handed out again, [setId][index] by binding
+        std::vector< std::vector< std::map<uint32_t, StaleDescriptor> > > m_stale;
 
         // transferred owner from `DescriptorSet` to `CompiledDescriptorSet`
         std::vector<DescriptorSet::DescriptorSetDescription> m_descriptions;
+
+        // follows moves of this object, relocation callbacks expire with it
+        std::shared_ptr<CompiledDescriptorSet*> m_self = std::make_shared<CompiledDescriptorSet*>(this);
     };
     DescriptorSet(VulkanDevice &device) : m_device(device) { }
 
-    ~DescriptorSet() {
-        for (auto &set : m_descriptorSets) {
-            vkDestroyDescriptorSetLayout(m_device.Get(), set.layout, nullptr);
-        }
-    }
+    ~DescriptorSet() = default;
 
     DescriptorSetId AddDescriptorSet(std::initializer_list<DescriptorBase> layout, uint32_t count) {
         { // check all components in layout have different binding locations
@@ -1584,14 +4386,7 @@ public:
         std::transform(layout.begin(), layout.end(), std::back_inserter(description.bindings), [](const DescriptorBase& descriptor) { return descriptor.vkBinding; });
 
         description.count = count;
-
-		VkDescriptorSetLayoutCreateInfo layoutInfo{ VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO, nullptr, 0 };
-        layoutInfo.bindingCount = static_cast<uint32_t>(description.bindings.size());
-        layoutInfo.pBindings = description.bindings.data();
-        
-        if (VkResult result = vkCreateDescriptorSetLayout(m_device.Get(), &layoutInfo, nullptr, &description.layout); result != VK_SUCCESS) {
-            throw std::runtime_error("Failed to create descriptor set layout!");
-        }
+        description.layout = m_device.GetLayoutCache().GetDescriptorSetLayout(description.bindings.data(), description.bindings.size());
 
         return m_descriptorSets.size() - 1;
     }
@@ -1630,7 +4425,7 @@ public:
             std::vector<VkDescriptorSet>& retSet = ret->m_sets.emplace_back();
             retSet.resize(set.count);
 
-            std::vector<VkDescriptorSetLayout> layouts(set.count, set.layout);
+            std::vector<VkDescriptorSetLayout> layouts(set.count, set.layout->handle);
             VkDescriptorSetAllocateInfo allocInfo{ VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO, nullptr };
             allocInfo.descriptorPool = ret->m_pool;
             allocInfo.descriptorSetCount = set.count;
@@ -1655,6 +4450,497 @@ protected:
     VulkanDevice &m_device;
 };
 
+/**
+ * Read-only memory mapping of a whole file.
+ */
+class MappedFile {
+public:
+    explicit MappedFile(const std::filesystem::path& path) {
+#ifdef _WIN32
+        m_file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (m_file == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("failed to open file " + path.string());
+        }
+        LARGE_INTEGER size;
+        GetFileSizeEx(m_file, &size);
+        m_size = static_cast<size_t>(size.QuadPart);
+        if (m_size != 0) {
+            m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            m_data = m_mapping == nullptr ? nullptr : static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+        }
+#else
+        m_file = open(path.c_str(), O_RDONLY);
+        if (m_file < 0) {
+            throw std::runtime_error("failed to open file " + path.string());
+        }
+        struct stat status;
+        fstat(m_file, &status);
+        m_size = static_cast<size_t>(status.st_size);
+        if (m_size != 0) {
+            void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_file, 0);
+            m_data = data == MAP_FAILED ? nullptr : static_cast<const char*>(data);
+        }
+#endif
+        if (m_size != 0 && m_data == nullptr) {
+            close();
+            throw std::runtime_error("failed to map file " + path.string());
+        }
+    }
+    ~MappedFile() {
+        close();
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    inline const char* GetData() const noexcept {
+        return m_data;
+    }
+    inline size_t GetSize() const noexcept {
+        return m_size;
+    }
+protected:
+    void close() {
+#ifdef _WIN32
+        if (m_data != nullptr) UnmapViewOfFile(m_data);
+        if (m_mapping != nullptr) CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+        m_mapping = nullptr;
+        m_file = INVALID_HANDLE_VALUE;
+#else
+        if (m_data != nullptr) munmap(const_cast<char*>(m_data), m_size);
+        if (m_file >= 0) ::close(m_file);
+        m_file = -1;
+#endif
+        m_data = nullptr;
+    }
+protected:
+#ifdef _WIN32
+    HANDLE m_file = INVALID_HANDLE_VALUE;
+    HANDLE m_mapping = nullptr;
+#else
+    int m_file = -1;
+#endif
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+};
+
+/**
+ * SPIR-V compiled into the executable by `add_shaders` in CMakeLists.txt. `name` is the path the `.spv` file is written
+ * to, relative to the working directory of the executable.
+ */
+struct EmbeddedShader {
+    const char* name;
+    const uint32_t* code;
+    size_t size; // in bytes
+};
+#if __has_include("embedded_shaders.h")
+#include "embedded_shaders.h"
+#else
+inline constexpr std::array<EmbeddedShader, 0> EmbeddedShaderRegistry{};
+#endif
+
+/**
+ * Immutable SPIR-V code shared by every pipeline using it. The `VkShaderModule` is created on first use and destroyed
+ * with the binary, i.e. when the last `GraphicsPipelineConfig::ShaderModule` referencing it goes away. A mapped file
+ * is unmapped as soon as the module exists, so the file can be rebuilt while the binary is in use.
+ */
+class ShaderBinary {
+public:
+    ~ShaderBinary() {
+        if (m_module != VK_NULL_HANDLE) {
+            vkDestroyShaderModule(m_device, m_module, nullptr);
+        }
+    }
+    ShaderBinary(const ShaderBinary&) = delete;
+    ShaderBinary& operator=(const ShaderBinary&) = delete;
+
+    // in bytes
+    inline size_t GetSize() const noexcept {
+        return m_size;
+    }
+    inline bool IsEmbedded() const noexcept {
+        return m_embedded;
+    }
+    inline uint64_t GetHash() const noexcept {
+        return m_hash;
+    }
+    inline const std::filesystem::path& GetPath() const noexcept {
+        return m_path;
+    }
+
+    // Thread safe, pipelines compiled in parallel share the module.
+    VkShaderModule GetModule(VkDevice device) const {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        if (m_module != VK_NULL_HANDLE) {
+            assert(device == m_device && "ShaderBinary is shared by a single device");
+            return m_module;
+        }
+
+        if (m_data == nullptr) {
+            throw std::runtime_error("the code of " + m_path.string() + " was released, load it again");
+        }
+        VkShaderModuleCreateInfo createInfo{ VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO, nullptr, 0 };
+        createInfo.codeSize = m_size;
+        createInfo.pCode = reinterpret_cast<const uint32_t*>(m_data);
+        if (vkCreateShaderModule(device, &createInfo, nullptr, &m_module) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create shader module from " + m_path.string());
+        }
+        m_device = device;
+        // the module keeps its own copy of the code
+        if (m_file != nullptr) {
+            m_file.reset();
+            m_data = nullptr;
+        }
+        return m_module;
+    }
+    // Thread safe. Once the code is released (see `GetModule()`) only the FNV-1a hash and the size are compared, the
+    // module made from it is shared all the same.
+    bool HasContent(uint64_t hash, const void* code, size_t size) const {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        if (m_hash != hash || m_size != size) return false;
+        return m_data == nullptr || std::memcmp(m_data, code, size) == 0;
+    }
+protected:
+    friend class ShaderLibrary;
+    void releaseModule() const {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        if (m_module != VK_NULL_HANDLE) {
+            vkDestroyShaderModule(m_device, m_module, nullptr);
+            m_module = VK_NULL_HANDLE;
+        }
+    }
+    ShaderBinary(std::filesystem::path path, std::unique_ptr<MappedFile> file, uint64_t hash) : m_path{ std::move(path) }, m_file{ std::move(file) }, m_data{ m_file->GetData() }, m_size{ m_file->GetSize() }, m_hash{ hash } {
+
+    }
+    ShaderBinary(std::filesystem::path path, std::vector<char> code, uint64_t hash) : m_path{ std::move(path) }, m_code{ std::move(code) }, m_data{ m_code.data() }, m_size{ m_code.size() }, m_hash{ hash } {
+
+    }
+    ShaderBinary(const EmbeddedShader& embedded, uint64_t hash) : m_path{ embedded.name }, m_data{ reinterpret_cast<const char*>(embedded.code) }, m_size{ embedded.size }, m_hash{ hash }, m_embedded{ true } {
+
+    }
+
+    std::filesystem::path m_path; // first file this content was loaded from, or the name of the embedded shader
+    mutable std::unique_ptr<MappedFile> m_file; // null if embedded, read into `m_code` or released
+    std::vector<char> m_code; // owned copy of a file that may be rewritten while in use
+    mutable const char* m_data; // borrow, from `m_file`, `m_code` or the executable, null once released
+    size_t m_size;
+    uint64_t m_hash;
+    bool m_embedded = false;
+
+    mutable std::mutex m_mutex; // guards the lazily created module
+    mutable VkDevice m_device = VK_NULL_HANDLE; // borrow
+    mutable VkShaderModule m_module = VK_NULL_HANDLE;
+};
+
+/**
+ * Loads every `.spv` file once and dedupes identical content loaded from different paths. The library only keeps weak
+ * references, binaries (and their shader modules) are freed when no pipeline config holds them anymore.
+ * Shaders embedded at build time are used in place of their files without any I/O or copy, unless the file override is
+ * enabled for development.
+ */
+class ShaderLibrary {
+public:
+    struct Statistics {
+        uint64_t fileLoads = 0; // files mapped or read
+        uint64_t pathHits = 0; // loads served without touching the file
+        uint64_t contentDedupes = 0; // files loaded whose content was already loaded from another path
+        uint64_t embeddedLoads = 0; // binaries referenced from the executable
+    };
+
+    static ShaderLibrary& Get() {
+        static ShaderLibrary library;
+        return library;
+    }
+
+    // Files changed on disk since they were loaded are mapped again. An embedded shader named `filename` is returned
+    // instead of the file unless `SetFileOverride()` is enabled and the file exists.
+    std::shared_ptr<const ShaderBinary> Load(const std::filesystem::path& filename) {
+        if (const EmbeddedShader* embedded = findEmbedded(filename); embedded != nullptr && (!m_fileOverride || !std::filesystem::exists(filename))) {
+            return loadEmbedded(*embedded);
+        }
+
+        const std::filesystem::path path = std::filesystem::absolute(filename).lexically_normal();
+        const std::filesystem::file_time_type writeTime = std::filesystem::last_write_time(path);
+
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        if (auto found = m_byPath.find(path); found != m_byPath.end() && found->second.writeTime == writeTime) {
+            if (std::shared_ptr<const ShaderBinary> binary = found->second.binary.lock(); binary != nullptr) {
+                ++m_stats.pathHits;
+                return binary;
+            }
+        }
+
+        // Overridden files are being edited and rebuilt, a mapping would keep them from being replaced (Windows) or
+        // break when they are truncated in place (POSIX). They are read into memory instead.
+        std::unique_ptr<MappedFile> file;
+        std::vector<char> code;
+        if (m_fileOverride) {
+            code = readFile(path);
+        } else {
+            file = std::make_unique<MappedFile>(path);
+        }
+        const char* data = file != nullptr ? file->GetData() : code.data();
+        const size_t size = file != nullptr ? file->GetSize() : code.size();
+        ++m_stats.fileLoads;
+        if (size < sizeof(uint32_t) || size % sizeof(uint32_t) != 0 || *reinterpret_cast<const uint32_t*>(data) != SpirvMagic) {
+            throw std::runtime_error("not a SPIR-V binary: " + path.string());
+        }
+        const uint64_t hash = HashBytes(data, size);
+
+        std::shared_ptr<const ShaderBinary> binary = findContent(hash, data, size);
+        if (binary != nullptr) {
+            ++m_stats.contentDedupes;
+        } else {
+            binary = std::shared_ptr<const ShaderBinary>{ file != nullptr ? new ShaderBinary{ path, std::move(file), hash } : new ShaderBinary{ path, std::move(code), hash } };
+            m_byHash.emplace(hash, binary);
+        }
+        m_byPath[path] = PathEntry{ binary, writeTime };
+        prune();
+        return binary;
+    }
+
+    // Destroys the shader modules of the loaded binaries and forgets them, call it before the device is destroyed.
+    // Binaries still referenced outlive the library's references but don't touch the device anymore.
+    void Clear() {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        for (const auto& [hash, reference] : m_byHash) {
+            if (std::shared_ptr<const ShaderBinary> binary = reference.lock(); binary != nullptr) {
+                binary->releaseModule();
+            }
+        }
+        m_byPath.clear();
+        m_byHash.clear();
+    }
+
+    Statistics GetStatistics() const {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        return m_stats;
+    }
+    void PrintStatistics() const {
+        const Statistics stats = GetStatistics();
+        std::cout << "[ShaderLibrary] " << stats.embeddedLoads << " embedded binaries used, " << stats.fileLoads << " files loaded, " << stats.pathHits << " loads served from memory, " << stats.contentDedupes << " duplicated binaries shared." << std::endl;
+    }
+
+    // Load the `.spv` files even for embedded shaders, e.g. to iterate on shaders without rebuilding the executable.
+    // Embedded shaders whose file is missing are still used. Affects later loads only.
+    void SetFileOverride(bool enable) {
+        m_fileOverride = enable;
+    }
+    inline bool IsFileOverride() const noexcept {
+        return m_fileOverride;
+    }
+protected:
+    static constexpr uint32_t SpirvMagic = 0x07230203;
+    struct PathEntry {
+        std::weak_ptr<const ShaderBinary> binary;
+        std::filesystem::file_time_type writeTime;
+    };
+
+    ShaderLibrary() = default;
+
+    static const EmbeddedShader* findEmbedded(const std::filesystem::path& filename) {
+        const std::string name = filename.lexically_normal().generic_string();
+        for (const EmbeddedShader& embedded : EmbeddedShaderRegistry) {
+            if (name == embedded.name) {
+                return &embedded;
+            }
+        }
+        return nullptr;
+    }
+    static std::vector<char> readFile(const std::filesystem::path& path) {
+        std::ifstream file{ path, std::ios::ate | std::ios::binary };
+        if (!file.is_open()) {
+            throw std::runtime_error("failed to open file " + path.string());
+        }
+        std::vector<char> code(static_cast<size_t>(file.tellg()));
+        file.seekg(0);
+        file.read(code.data(), static_cast<std::streamsize>(code.size()));
+        if (!file) {
+            throw std::runtime_error("failed to read file " + path.string());
+        }
+        return code;
+    }
+    // Embedded binaries are cached by name, they never change.
+    std::shared_ptr<const ShaderBinary> loadEmbedded(const EmbeddedShader& embedded) {
+        const std::filesystem::path name{ embedded.name };
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        if (auto found = m_byPath.find(name); found != m_byPath.end()) {
+            if (std::shared_ptr<const ShaderBinary> binary = found->second.binary.lock(); binary != nullptr) {
+                ++m_stats.pathHits;
+                return binary;
+            }
+        }
+
+        const uint64_t hash = HashBytes(embedded.code, embedded.size);
+        std::shared_ptr<const ShaderBinary> binary = findContent(hash, embedded.code, embedded.size);
+        if (binary == nullptr) {
+            binary = std::shared_ptr<const ShaderBinary>{ new ShaderBinary{ embedded, hash } };
+            m_byHash.emplace(hash, binary);
+        }
+        ++m_stats.embeddedLoads;
+        m_byPath[name] = PathEntry{ binary, std::filesystem::file_time_type{} };
+        prune();
+        return binary;
+    }
+    // assumes `m_mutex` is locked
+    std::shared_ptr<const ShaderBinary> findContent(uint64_t hash, const void* code, size_t size) const {
+        auto [first, last] = m_byHash.equal_range(hash);
+        for (auto it = first; it != last; ++it) {
+            std::shared_ptr<const ShaderBinary> candidate = it->second.lock();
+            if (candidate != nullptr && candidate->HasContent(hash, code, size)) {
+                return candidate;
+            }
+        }
+        return nullptr;
+    }
+
+    // drop entries of freed binaries
+    void prune() {
+        for (auto it = m_byPath.begin(); it != m_byPath.end(); ) {
+            it = it->second.binary.expired() ? m_byPath.erase(it) : std::next(it);
+        }
+        for (auto it = m_byHash.begin(); it != m_byHash.end(); ) {
+            it = it->second.expired() ? m_byHash.erase(it) : std::next(it);
+        }
+    }
+protected:
+    mutable std::mutex m_mutex;
+    std::map<std::filesystem::path, PathEntry> m_byPath;
+    std::multimap<uint64_t, std::weak_ptr<const ShaderBinary>> m_byHash;
+    Statistics m_stats;
+    std::atomic<bool> m_fileOverride = false;
+};
+
+/**
+ * Polls shader files on a background thread. A GLSL source next to a watched `.spv` file (the path without `.spv`, as
+ * laid out by `add_shaders` in CMakeLists.txt) is recompiled with glslc when it changes, changed `.spv` files are
+ * reported to the callback on the watcher thread.
+ */
+class ShaderWatcher {
+public:
+    typedef std::function<void(const std::vector<std::filesystem::path>&)> Callback;
+
+    ShaderWatcher(Callback callback, std::chrono::milliseconds interval = std::chrono::milliseconds{ 250 }) : m_callback{ std::move(callback) }, m_interval{ interval }, m_compiler{ findCompiler() }, m_thread{ [this]() { watchLoop(); } } {
+
+    }
+    ~ShaderWatcher() {
+        {
+            std::lock_guard<std::mutex> lock{ m_mutex };
+            m_stop = true;
+        }
+        m_wake.notify_all();
+        m_thread.join();
+    }
+    ShaderWatcher(const ShaderWatcher&) = delete;
+    ShaderWatcher& operator=(const ShaderWatcher&) = delete;
+
+    // Changes made before the call aren't reported.
+    void Watch(const std::filesystem::path& spirv) {
+        const std::filesystem::path path = std::filesystem::absolute(spirv).lexically_normal();
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        if (m_entries.count(path) != 0) return;
+        Entry entry;
+        entry.source = path;
+        entry.source.replace_extension();
+        entry.sourceTime = getWriteTime(entry.source);
+        entry.spirvTime = getWriteTime(path);
+        m_entries.emplace(path, entry);
+    }
+protected:
+    struct Entry {
+        std::filesystem::path source; // GLSL, may not exist
+        std::filesystem::file_time_type sourceTime, spirvTime; // zero if missing
+    };
+
+    // glslc of the Vulkan SDK, otherwise the one in PATH
+    static std::string findCompiler() {
+        if (const char* sdk = std::getenv("VULKAN_SDK"); sdk != nullptr) {
+            for (const char* bin : { "Bin", "bin" }) {
+                std::filesystem::path compiler = std::filesystem::path{ sdk } / bin / "glslc";
+#ifdef _WIN32
+                compiler += ".exe";
+#endif
+                if (std::filesystem::exists(compiler)) return compiler.string();
+            }
+        }
+        return "glslc";
+    }
+    // Files being saved may be missing for a moment, they are picked up by the next poll.
+    static std::filesystem::file_time_type getWriteTime(const std::filesystem::path& path) {
+        std::error_code error;
+        const std::filesystem::file_time_type time = std::filesystem::last_write_time(path, error);
+        return error ? std::filesystem::file_time_type{} : time;
+    }
+
+    void watchLoop() {
+        std::unique_lock<std::mutex> lock{ m_mutex };
+        while (!m_wake.wait_for(lock, m_interval, [this]() { return m_stop; })) {
+            std::map<std::filesystem::path, Entry> entries = m_entries;
+            lock.unlock();
+            const std::vector<std::filesystem::path> changed = poll(entries);
+            if (!changed.empty()) {
+                m_callback(changed);
+            }
+            lock.lock();
+            for (const auto& [path, entry] : entries) {
+                m_entries[path] = entry;
+            }
+        }
+    }
+    std::vector<std::filesystem::path> poll(std::map<std::filesystem::path, Entry>& entries) {
+        std::vector<std::filesystem::path> changed;
+        for (auto& [path, entry] : entries) {
+            if (const std::filesystem::file_time_type sourceTime = getWriteTime(entry.source); sourceTime != entry.sourceTime) {
+                entry.sourceTime = sourceTime;
+                if (sourceTime != std::filesystem::file_time_type{}) {
+                    compile(entry.source, path);
+                }
+            }
+            if (const std::filesystem::file_time_type spirvTime = getWriteTime(path); spirvTime != entry.spirvTime) {
+                entry.spirvTime = spirvTime;
+                if (spirvTime != std::filesystem::file_time_type{}) {
+                    changed.push_back(path);
+                }
+            }
+        }
+        return changed;
+    }
+    // Compiled to a temporary file and renamed, the `.spv` file never holds partial output. A failed compile keeps the
+    // previous binary.
+    bool compile(const std::filesystem::path& source, const std::filesystem::path& spirv) {
+        std::filesystem::path temporary = spirv;
+        temporary += ".tmp";
+        std::string command = "\"" + m_compiler + "\" -O \"" + source.string() + "\" -o \"" + temporary.string() + "\"";
+#ifdef _WIN32
+        command = "\"" + command + "\""; // cmd.exe strips the outer quotes
+#endif
+        std::cout << "[ShaderWatcher] Compiling " << source.string() << std::endl;
+        if (std::system(command.c_str()) != 0) {
+            std::cout << "[ShaderWatcher][Error] Failed to compile " << source.string() << ", keeping the previous binary." << std::endl;
+            std::error_code error;
+            std::filesystem::remove(temporary, error);
+            return false;
+        }
+        std::error_code error;
+        std::filesystem::rename(temporary, spirv, error);
+        if (error) {
+            std::cout << "[ShaderWatcher][Error] Failed to replace " << spirv.string() << ": " << error.message() << std::endl;
+            return false;
+        }
+        return true;
+    }
+protected:
+    Callback m_callback;
+    std::chrono::milliseconds m_interval;
+    std::string m_compiler;
+
+    std::mutex m_mutex; // guards everything below
+    std::condition_variable m_wake;
+    std::map<std::filesystem::path, Entry> m_entries; // by `.spv` path
+    bool m_stop = false;
+    std::thread m_thread; // last, starts after everything above is initialized
+};
+
 struct GraphicsPipelineConfig {
     class ShaderModule {
     public:
@@ -1670,42 +4956,81 @@ struct GraphicsPipelineConfig {
             Reset();
         }
         inline void Reset() {
-            m_loaded = false;
+            m_binary.reset();
+        }
+        inline bool Empty() const {
+            return m_binary == nullptr;
+        }
+
+        // The binary is shared through `ShaderLibrary`, copying the config doesn't copy the code.
+        bool LoadFromFile(const std::string& filename, std::string entryName = "main") {
+            m_binary = ShaderLibrary::Get().Load(filename);
+            m_filename = filename;
+            m_entryName = entryName;
+            return !Empty();
+        }
+        // Load the file again, picks up changes made on disk since.
+        bool Reload() {
+            if (m_filename.empty()) return !Empty();
+            m_binary = ShaderLibrary::Get().Load(m_filename);
+            return !Empty();
+        }
+        // as passed to `LoadFromFile()`, empty if nothing was loaded
+        inline const std::string& GetFilename() const noexcept {
+            return m_filename;
+        }
+
+        // Value of `layout(constant_id = constantId) const T name = ...;` in the shader, folded by the driver compiler.
+        // `T` is bool, a 32/64 bit integer, float or double and must match the declaration in the shader.
+        template <typename T>
+        ShaderModule& SetConstant(uint32_t constantId, T value) {
+            static_assert(std::is_arithmetic_v<T> && (sizeof(T) == 4 || sizeof(T) == 8 || std::is_same_v<T, bool>), "specialization constants are bool, 32 or 64 bit scalars");
+            if constexpr (std::is_same_v<T, bool>) {
+                return SetConstant<VkBool32>(constantId, value ? VK_TRUE : VK_FALSE);
+            } else {
+                auto found = std::lower_bound(m_specializationEntries.begin(), m_specializationEntries.end(), constantId, [](const VkSpecializationMapEntry& entry, uint32_t id) { return entry.constantID < id; });
+                if (found == m_specializationEntries.end() || found->constantID != constantId) {
+                    found = m_specializationEntries.insert(found, VkSpecializationMapEntry{ constantId, static_cast<uint32_t>(m_specializationData.size()), sizeof(T) });
+                    m_specializationData.resize(m_specializationData.size() + sizeof(T));
+                } else if (found->size != sizeof(T)) {
+                    throw std::runtime_error("specialization constant " + std::to_string(constantId) + " was set with another type");
+                }
+                std::memcpy(m_specializationData.data() + found->offset, &value, sizeof(T));
+                return *this;
+            }
+        }
+        void ClearConstants() {
+            m_specializationEntries.clear();
+            m_specializationData.clear();
+        }
+        // Entries sorted by constant id, pointing into `GetSpecializationData()`.
+        inline const std::vector<VkSpecializationMapEntry>& GetSpecializationEntries() const noexcept {
+            return m_specializationEntries;
         }
-        inline bool Empty() const {
-            return !m_loaded;
+        inline const std::vector<char>& GetSpecializationData() const noexcept {
+            return m_specializationData;
         }
 
-        bool LoadFromFile(const std::string& filename, std::string entryName = "main") {
-            m_binaryCode = readFile(filename);
-            m_entryName = entryName;
-            m_loaded = true;
-            return m_loaded;
+        // Identifies the compiled stage: binary content, entry point and specialization constants. Independent of the
+        // order constants were set in.
+        uint64_t GetIdentity() const {
+            uint64_t identity = HashBytes(m_entryName.data(), m_entryName.size(), m_binary == nullptr ? 0 : m_binary->GetHash());
+            identity = HashBytes(&m_type, sizeof(m_type), identity);
+            for (const VkSpecializationMapEntry& entry : m_specializationEntries) {
+                identity = HashBytes(&entry.constantID, sizeof(entry.constantID), identity);
+                identity = HashBytes(m_specializationData.data() + entry.offset, entry.size, identity);
+            }
+            return identity;
         }
 
     protected:
         friend class FrameGraph;
         Type m_type;
-        std::vector<char> m_binaryCode;
+        std::shared_ptr<const ShaderBinary> m_binary;
+        std::string m_filename;
         std::string m_entryName;
-        bool m_loaded = false;
-    private:
-    	static std::vector<char> readFile(const std::string& filename) {
-            std::ifstream file(filename, std::ios::ate | std::ios::binary);
-
-            if (!file.is_open()) {
-                throw std::runtime_error("failed to open file!");
-            }
-
-            size_t fileSize = (size_t)file.tellg();
-            std::vector<char> buffer(fileSize);
-
-            file.seekg(0);
-            file.read(buffer.data(), fileSize);
-
-            file.close();
-            return buffer;
-        }
+        std::vector<VkSpecializationMapEntry> m_specializationEntries;
+        std::vector<char> m_specializationData;
     };
 
     class VertexInput {
@@ -1778,11 +5103,64 @@ struct GraphicsPipelineConfig {
         
     protected:
         friend class FrameGraph;
+        friend struct GraphicsPipelineConfig;
         std::vector<BindingDescription> m_bindings;
-        VkPrimitiveTopology m_topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
 
     };
 
+    // Fixed function state that is recorded with `FrameGraph::BindPipeline()` on devices with
+    // VK_EXT_extended_dynamic_state(2). Without them every combination in use is baked into its own pipeline.
+    struct RenderState {
+        VkCullModeFlags cullMode = VK_CULL_MODE_BACK_BIT;
+        VkFrontFace frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+        VkPrimitiveTopology topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+        VkBool32 depthTestEnable = VK_TRUE;
+        VkBool32 depthWriteEnable = VK_TRUE;
+        VkCompareOp depthCompareOp = VK_COMPARE_OP_LESS;
+        VkBool32 depthBiasEnable = VK_FALSE; // biases themselves are 0, set `VK_DYNAMIC_STATE_DEPTH_BIAS` to change them
+        VkBool32 primitiveRestartEnable = VK_FALSE;
+
+        // The part a pipeline has to bake on `support`, dynamic fields are reset to their defaults. A dynamic
+        // topology must stay in the class of the baked one, so it is reduced to its class.
+        RenderState Baked(const VulkanDevice::DynamicStateSupport& support) const {
+            RenderState baked = *this;
+            if (support.extendedDynamicState) {
+                const RenderState defaults;
+                baked.cullMode = defaults.cullMode;
+                baked.frontFace = defaults.frontFace;
+                baked.topology = TopologyClass(topology);
+                baked.depthTestEnable = defaults.depthTestEnable;
+                baked.depthWriteEnable = defaults.depthWriteEnable;
+                baked.depthCompareOp = defaults.depthCompareOp;
+            }
+            if (support.extendedDynamicState2) {
+                const RenderState defaults;
+                baked.depthBiasEnable = defaults.depthBiasEnable;
+                baked.primitiveRestartEnable = defaults.primitiveRestartEnable;
+            }
+            return baked;
+        }
+        // all members are 4 bytes, there is no padding to hash
+        uint64_t GetHash() const {
+            return HashBytes(this, sizeof(RenderState));
+        }
+        static VkPrimitiveTopology TopologyClass(VkPrimitiveTopology topology) {
+            switch (topology) {
+                case VK_PRIMITIVE_TOPOLOGY_POINT_LIST:
+                    return VK_PRIMITIVE_TOPOLOGY_POINT_LIST;
+                case VK_PRIMITIVE_TOPOLOGY_LINE_LIST:
+                case VK_PRIMITIVE_TOPOLOGY_LINE_STRIP:
+                case VK_PRIMITIVE_TOPOLOGY_LINE_LIST_WITH_ADJACENCY:
+                case VK_PRIMITIVE_TOPOLOGY_LINE_STRIP_WITH_ADJACENCY:
+                    return VK_PRIMITIVE_TOPOLOGY_LINE_LIST;
+                case VK_PRIMITIVE_TOPOLOGY_PATCH_LIST:
+                    return VK_PRIMITIVE_TOPOLOGY_PATCH_LIST;
+                default:
+                    return VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+            }
+        }
+    };
+
     struct VulkanDepth {
         MinMax bounds;
     };
@@ -1790,6 +5168,16 @@ struct GraphicsPipelineConfig {
     struct PipelineLayout {
         std::shared_ptr<DescriptorSet::CompiledDescriptorSet> descriptorSets;
         std::vector<DescriptorSet::DescriptorSetId> used;
+        // A stage may appear in one range only, offsets and sizes are multiples of 4. Validated by `FrameGraph`.
+        std::vector<VkPushConstantRange> pushConstants;
+
+        // Reserve `sizeof(T)` bytes at `offset` for `stages`, recorded with `FrameGraph::PushConstants()`.
+        template <typename T>
+        PipelineLayout& AddPushConstants(VkShaderStageFlags stages, uint32_t offset = 0) {
+            static_assert(std::is_trivially_copyable_v<T> && sizeof(T) % 4 == 0, "push constants are trivially copyable and a multiple of 4 bytes");
+            pushConstants.push_back(VkPushConstantRange{ stages, offset, static_cast<uint32_t>(sizeof(T)) });
+            return *this;
+        }
     };
 
     ShaderModule vertexShader;
@@ -1799,6 +5187,10 @@ struct GraphicsPipelineConfig {
     VertexInput vertexInput;
     VulkanDepth depthStencil;
     PipelineLayout pipelineLayout;
+    RenderState renderState; // bound by `FrameGraph::BindPipeline()` without a state
+    // Other states bound with this pipeline. Only needed without extended dynamic state, where they are compiled
+    // ahead of time instead of on first use.
+    std::vector<RenderState> statePermutations;
     
     
     GraphicsPipelineConfig() :
@@ -1809,6 +5201,43 @@ struct GraphicsPipelineConfig {
     {
 
     }
+
+    GraphicsPipelineConfig& AddStatePermutation(const RenderState& state) {
+        statePermutations.push_back(state);
+        return *this;
+    }
+    // every stage, empty ones included
+    inline std::array<ShaderModule*, 4> GetShaderModules() {
+        return { &vertexShader, &tessellationShader, &geometryShader, &fragmentShader };
+    }
+    inline std::array<const ShaderModule*, 4> GetShaderModules() const {
+        return { &vertexShader, &tessellationShader, &geometryShader, &fragmentShader };
+    }
+
+    // Configs with the same identity build the same pipelines, shaders are identified with their specialization constants.
+    // Render states aren't part of it, a permutation is identified by the config and its `RenderState`.
+    uint64_t GetIdentity() const {
+        uint64_t identity = 0;
+        for (const ShaderModule* shader : GetShaderModules()) {
+            const uint64_t shaderIdentity = shader->Empty() ? 0 : shader->GetIdentity();
+            identity = HashBytes(&shaderIdentity, sizeof(shaderIdentity), identity);
+        }
+        for (const VertexInput::BindingDescription& binding : vertexInput.m_bindings) {
+            identity = HashBytes(&binding.vkDescription, sizeof(binding.vkDescription), identity);
+            identity = HashBytes(binding.attributes.data(), binding.attributes.size() * sizeof(VkVertexInputAttributeDescription), identity);
+        }
+        identity = HashBytes(&depthStencil.bounds, sizeof(depthStencil.bounds), identity);
+        // the layouts by content, identities are persisted across runs
+        for (DescriptorSet::DescriptorSetId setId : pipelineLayout.used) {
+            for (const VkDescriptorSetLayoutBinding& binding : pipelineLayout.descriptorSets->GetBindings(setId)) {
+                const uint32_t description[] = { binding.binding, static_cast<uint32_t>(binding.descriptorType), binding.descriptorCount, binding.stageFlags };
+                identity = HashBytes(description, sizeof(description), identity);
+            }
+            identity = HashBytes(&setId, sizeof(setId), identity);
+        }
+        identity = HashBytes(pipelineLayout.pushConstants.data(), pipelineLayout.pushConstants.size() * sizeof(VkPushConstantRange), identity);
+        return identity;
+    }
 };
 
 /**
@@ -1843,8 +5272,9 @@ public:
         arc.tailNextArc = m_vertices[tail].firstInArc;
         m_vertices[tail].firstInArc = arcIndex;
     }
-    std::vector<size_t> QueryStartingVertices() const {
-        std::vector<size_t> result;
+    // Results are allocated from `resource`, e.g. a `ScratchArena`.
+    std::pmr::vector<size_t> QueryStartingVertices(std::pmr::memory_resource* resource = std::pmr::get_default_resource()) const {
+        std::pmr::vector<size_t> result{ resource };
         for (size_t i = 0; i < m_vertices.size(); ++i) {
             if (m_vertices[i].firstInArc == EndOfList) {
                 result.emplace_back(i);
@@ -1852,8 +5282,8 @@ public:
         }
         return result;
     }
-    std::vector<size_t> QueryEndingVertices() const {
-        std::vector<size_t> result;
+    std::pmr::vector<size_t> QueryEndingVertices(std::pmr::memory_resource* resource = std::pmr::get_default_resource()) const {
+        std::pmr::vector<size_t> result{ resource };
         for (size_t i = 0; i < m_vertices.size(); ++i) {
             if (m_vertices[i].firstOutArc == EndOfList) {
                 result.emplace_back(i);
@@ -1861,24 +5291,24 @@ public:
         }
         return result;
     }
-    std::vector<size_t> QueryNextArcs(size_t vertexIndex) const {
+    std::pmr::vector<size_t> QueryNextArcs(size_t vertexIndex, std::pmr::memory_resource* resource = std::pmr::get_default_resource()) const {
         if (vertexIndex >= m_vertices.size()) {
             throw std::out_of_range("Vertex index out of range");
         }
 
-        std::vector<size_t> result;
+        std::pmr::vector<size_t> result{ resource };
         int current = m_vertices[vertexIndex].firstOutArc;
         for (; current != EndOfList; current = m_arcs[current].headNextArc) {
             result.emplace_back(m_arcs[current].tailVertex);
         }
         return result;
     }
-    std::vector<size_t> QueryPrevArcs(size_t vertexIndex) const {
+    std::pmr::vector<size_t> QueryPrevArcs(size_t vertexIndex, std::pmr::memory_resource* resource = std::pmr::get_default_resource()) const {
         if (vertexIndex >= m_vertices.size()) {
             throw std::out_of_range("vertex index out of range");
         }
 
-        std::vector<size_t> result;
+        std::pmr::vector<size_t> result{ resource };
         int current = m_vertices[vertexIndex].firstInArc;
         for (; current != EndOfList; current = m_arcs[current].tailNextArc) {
             result.emplace_back(m_arcs[current].headVertex);
@@ -1920,8 +5350,9 @@ public:
         attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
         attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
         m_attachments.push_back(attachment);
+        m_attachmentTypes.push_back(ResourceType::Color);
 
-        return ResourceId(ResourceType::Color, m_resources.size() - 1);
+        return ResourceId(ResourceType::Color, static_cast<uint32_t>(m_attachments.size()) - 1);
     }
 
     ResourceId AddResolveResource(VkAttachmentLoadOp loadOp = VkAttachmentLoadOp::VK_ATTACHMENT_LOAD_OP_DONT_CARE, VkAttachmentStoreOp storeOp = VkAttachmentStoreOp::VK_ATTACHMENT_STORE_OP_STORE) {
@@ -1935,8 +5366,9 @@ public:
         attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
         attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
         m_attachments.push_back(attachment);
+        m_attachmentTypes.push_back(ResourceType::Resolve);
 
-        return ResourceId(ResourceType::Resolve, m_resources.size() - 1);
+        return ResourceId(ResourceType::Resolve, static_cast<uint32_t>(m_attachments.size()) - 1);
     }
 
     ResourceId AddDepthResource(VkAttachmentLoadOp loadOp, VkAttachmentStoreOp storeOp = VkAttachmentStoreOp::VK_ATTACHMENT_STORE_OP_DONT_CARE, VkImageTiling tiling = VkImageTiling::VK_IMAGE_TILING_OPTIMAL, VkFormatFeatureFlags features = 0) {
@@ -1950,8 +5382,9 @@ public:
         attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
         attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
         m_attachments.push_back(attachment);
+        m_attachmentTypes.push_back(ResourceType::Depth);
 
-        return ResourceId(ResourceType::Depth, m_resources.size() - 1);
+        return ResourceId(ResourceType::Depth, static_cast<uint32_t>(m_attachments.size()) - 1);
     }
 
 #pragma endregion
@@ -1964,15 +5397,244 @@ public:
     // };
     typedef uint32_t PipelineId;
     struct Pipeline {
-        VkPipeline pipeline = VK_NULL_HANDLE;
-        VkPipelineLayout layout = VK_NULL_HANDLE;
+        VkPipeline pipeline = VK_NULL_HANDLE; // for the config's `renderState`, borrow from `permutations`
+        VkPipelineLayout layout = VK_NULL_HANDLE; // borrow from `layoutRef`
+        VulkanLayoutCache::PipelineLayout layoutRef; // shared by pipelines with identical layouts
+        // every compiled pipeline of the config keyed by the hash of its baked `RenderState`, own
+        std::unordered_map<uint64_t, VkPipeline> permutations;
+        // baked `RenderState` of every permutation, same keys
+        std::unordered_map<uint64_t, GraphicsPipelineConfig::RenderState> states;
+        // permutations queued on the background thread
+        std::unordered_map<uint64_t, BackgroundQueue::Priority> pending;
+        // permutations the background thread failed to compile and their errors, not queued again until a reload
+        std::unordered_map<uint64_t, std::string> failures;
+        uint32_t generation = 0; // incremented by every shader reload swapped in
     };
 
     PipelineId AddGraphicsPipeline(GraphicsPipelineConfig config) {
+        validatePushConstants(config.pipelineLayout.pushConstants);
         m_pipelineDescs.push_back(config);
+        watchShaders(m_pipelineDescs.back());
         return m_pipelineDescs.size() - 1;
         // return PipelineId{ static_cast<uint32_t>(m_pipelineDescs.size()) - 1 };
     }
+    // valid after `Build()`
+    inline const Pipeline& GetPipeline(PipelineId id) const {
+        return m_pipelines.at(id);
+    }
+
+    // Bind the pipeline with `state`. The dynamic part of the state is recorded, the baked part selects a permutation
+    // which is compiled on first use if it wasn't declared with `GraphicsPipelineConfig::AddStatePermutation()`.
+    void BindPipeline(VkCommandBuffer commandBuffer, PipelineId id, const GraphicsPipelineConfig::RenderState& state) {
+        recordBind(commandBuffer, findPermutation(id, state), state);
+    }
+    void BindPipeline(VkCommandBuffer commandBuffer, PipelineId id) {
+        BindPipeline(commandBuffer, id, m_pipelineDescs.at(id).renderState);
+    }
+    // Like `BindPipeline()` but never compiles on the calling thread. A permutation that isn't ready is queued on the
+    // background thread and false is returned, the caller skips the draw. Throws if the background compile failed.
+    bool TryBindPipeline(VkCommandBuffer commandBuffer, PipelineId id, const GraphicsPipelineConfig::RenderState& state) {
+        const VkPipeline pipeline = requestPermutation(id, state, BackgroundQueue::Priority::Urgent, true);
+        if (pipeline == VK_NULL_HANDLE) {
+            checkPermutationFailed(id, state);
+            return false;
+        }
+        recordBind(commandBuffer, pipeline, state);
+        return true;
+    }
+    bool TryBindPipeline(VkCommandBuffer commandBuffer, PipelineId id) {
+        return TryBindPipeline(commandBuffer, id, m_pipelineDescs.at(id).renderState);
+    }
+    bool IsPipelineReady(PipelineId id, const GraphicsPipelineConfig::RenderState& state) {
+        const uint64_t key = state.Baked(m_swapChain.GetDevice().GetDynamicStateSupport()).GetHash();
+        std::lock_guard<std::mutex> lock{ m_permutationMutex };
+        return m_pipelines.at(id).permutations.count(key) != 0;
+    }
+    // Permutations waiting for the background thread, including the idle warmup.
+    size_t GetPendingPipelineCount() const {
+        if (m_compileQueue == nullptr) return 0;
+        return m_compileQueue->GetPendingCount(BackgroundQueue::Priority::Urgent) + m_compileQueue->GetPendingCount(BackgroundQueue::Priority::Idle);
+    }
+
+    // Record per-draw data into the range declared with `PipelineLayout::AddPushConstants()`. `stages` must name every
+    // stage of the ranges overlapping `[offset, offset + sizeof(T))`.
+    template <typename T>
+    void PushConstants(VkCommandBuffer commandBuffer, PipelineId pipeline, VkShaderStageFlags stages, const T& data, uint32_t offset = 0) const {
+        static_assert(std::is_trivially_copyable_v<T> && sizeof(T) % 4 == 0, "push constants are trivially copyable and a multiple of 4 bytes");
+        assert(isPushConstantsCovered(pipeline, stages, offset, sizeof(T)) && "push constants don't match the pipeline layout");
+        vkCmdPushConstants(commandBuffer, m_pipelines[pipeline].layout, stages, offset, sizeof(T), &data);
+    }
+
+protected:
+    // The render pass and subpass a pipeline is compiled for. Background compiles get a copy taken on the recording thread,
+    // they must not read the render passes while `Build()` recreates them.
+    struct PipelineTarget {
+        uint32_t renderPass; // in `m_renderPasses`, identifies the render pass in library keys
+        VkRenderPass handle; // borrow
+        uint32_t subpass; // of the render pass
+    };
+
+    void recordBind(VkCommandBuffer commandBuffer, VkPipeline pipeline, const GraphicsPipelineConfig::RenderState& state) const {
+        const VulkanDevice::DynamicStateSupport& support = m_swapChain.GetDevice().GetDynamicStateSupport();
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+        if (support.extendedDynamicState) {
+            support.cmdSetCullMode(commandBuffer, state.cullMode);
+            support.cmdSetFrontFace(commandBuffer, state.frontFace);
+            support.cmdSetPrimitiveTopology(commandBuffer, state.topology);
+            support.cmdSetDepthTestEnable(commandBuffer, state.depthTestEnable);
+            support.cmdSetDepthWriteEnable(commandBuffer, state.depthWriteEnable);
+            support.cmdSetDepthCompareOp(commandBuffer, state.depthCompareOp);
+        }
+        if (support.extendedDynamicState2) {
+            support.cmdSetDepthBiasEnable(commandBuffer, state.depthBiasEnable);
+            support.cmdSetPrimitiveRestartEnable(commandBuffer, state.primitiveRestartEnable);
+        }
+    }
+    VkPipeline findPermutation(PipelineId id, const GraphicsPipelineConfig::RenderState& state) {
+        checkPipelineCulled(id);
+        const GraphicsPipelineConfig::RenderState baked = state.Baked(m_swapChain.GetDevice().GetDynamicStateSupport());
+        const uint64_t key = baked.GetHash();
+        uint32_t generation;
+        {
+            std::lock_guard<std::mutex> lock{ m_permutationMutex };
+            const Pipeline& pipeline = m_pipelines.at(id);
+            if (auto found = pipeline.permutations.find(key); found != pipeline.permutations.end()) {
+                return found->second;
+            }
+            recordWarmupState(id, state);
+            generation = pipeline.generation;
+        }
+        if (!isLinkingPipelines()) {
+            std::cout << "[FrameGraph][Warning] Compiling an undeclared render state of pipeline " << id << " while recording, declare it with `AddStatePermutation()`." << std::endl;
+        }
+        // linking is cheap enough for recording, the optimized pipeline follows in a later frame
+        return compilePermutation(m_pipelineDescs[id], id, findPipelineTarget(id), baked, key, generation);
+    }
+    // Returns the permutation if it is compiled, otherwise queues it once on `m_compileQueue` and returns null. An idle
+    // request is queued again when it becomes urgent, the first compile wins.
+    VkPipeline requestPermutation(PipelineId id, const GraphicsPipelineConfig::RenderState& state, BackgroundQueue::Priority priority, bool recordWarmup) {
+        checkPipelineCulled(id);
+        const GraphicsPipelineConfig::RenderState baked = state.Baked(m_swapChain.GetDevice().GetDynamicStateSupport());
+        const uint64_t key = baked.GetHash();
+        std::lock_guard<std::mutex> lock{ m_permutationMutex };
+        Pipeline& pipeline = m_pipelines.at(id);
+        if (auto found = pipeline.permutations.find(key); found != pipeline.permutations.end()) {
+            return found->second;
+        }
+        if (recordWarmup) {
+            recordWarmupState(id, state);
+        }
+        if (pipeline.failures.count(key) != 0) {
+            return VK_NULL_HANDLE;
+        }
+        if (auto [found, inserted] = pipeline.pending.emplace(key, priority); !inserted) {
+            if (found->second == BackgroundQueue::Priority::Urgent || priority == BackgroundQueue::Priority::Idle) {
+                return VK_NULL_HANDLE;
+            }
+            found->second = priority;
+        }
+        if (m_compileQueue == nullptr) {
+            m_compileQueue = std::make_unique<BackgroundQueue>();
+        }
+        m_compileQueue->Push(priority, [this, id, target = findPipelineTarget(id), baked, key, config = m_pipelineDescs[id], generation = pipeline.generation]() {
+            try {
+                compilePermutation(config, id, target, baked, key, generation);
+            } catch (const std::exception& e) {
+                std::cout << "[FrameGraph][Error] Failed to compile pipeline " << id << " in the background: " << e.what() << std::endl;
+                std::lock_guard<std::mutex> lock{ m_permutationMutex };
+                Pipeline& failed = m_pipelines.at(id);
+                if (failed.generation == generation) {
+                    failed.pending.erase(key);
+                    failed.failures.emplace(key, "failed to compile pipeline " + std::to_string(id) + ": " + e.what());
+                }
+            }
+        });
+        return VK_NULL_HANDLE;
+    }
+    void checkPermutationFailed(PipelineId id, const GraphicsPipelineConfig::RenderState& state) {
+        const uint64_t key = state.Baked(m_swapChain.GetDevice().GetDynamicStateSupport()).GetHash();
+        std::lock_guard<std::mutex> lock{ m_permutationMutex };
+        const Pipeline& pipeline = m_pipelines.at(id);
+        if (auto found = pipeline.failures.find(key); found != pipeline.failures.end()) {
+            throw std::runtime_error(found->second);
+        }
+    }
+    // Compiles outside of the lock, when threads race for a permutation the first one wins. `state` is baked. Returns null
+    // if a shader reload was swapped in meanwhile, the compiled pipeline used the previous shaders.
+    VkPipeline compilePermutation(const GraphicsPipelineConfig& config, PipelineId id, const PipelineTarget& target, const GraphicsPipelineConfig::RenderState& state, uint64_t key, uint32_t generation) {
+        Pipeline& pipeline = m_pipelines.at(id);
+        {
+            std::lock_guard<std::mutex> lock{ m_permutationMutex };
+            if (auto found = pipeline.permutations.find(key); found != pipeline.permutations.end()) {
+                return found->second;
+            }
+        }
+        ScratchArena& arena = ScratchArena::ThreadLocal();
+        ScratchArena::Scope scope{ arena };
+        const VkPipelineCache cache = m_swapChain.GetDevice().GetPipelineCache().Get();
+        const bool link = isLinkingPipelines();
+        const VkPipeline compiled = link ? linkPipeline(config, target, state, cache, &arena, pipeline) : buildPipeline(config, target, state, cache, &arena, pipeline);
+
+        std::lock_guard<std::mutex> lock{ m_permutationMutex };
+        if (pipeline.generation != generation) {
+            vkDestroyPipeline(m_swapChain.GetDevice().Get(), compiled, nullptr);
+            return VK_NULL_HANDLE;
+        }
+        pipeline.pending.erase(key);
+        auto [found, inserted] = pipeline.permutations.emplace(key, compiled);
+        if (!inserted) {
+            vkDestroyPipeline(m_swapChain.GetDevice().Get(), compiled, nullptr);
+            return found->second;
+        }
+        pipeline.states.emplace(key, state);
+        if (link) {
+            queueOptimization(config, id, target, key, state, pipeline);
+        }
+        if (key == config.renderState.Baked(m_swapChain.GetDevice().GetDynamicStateSupport()).GetHash()) {
+            pipeline.pipeline = compiled;
+        }
+        return compiled;
+    }
+    static void destroyPipeline(VkDevice device, Pipeline& pipeline) {
+        for (const auto& [key, permutation] : pipeline.permutations) {
+            vkDestroyPipeline(device, permutation, nullptr);
+        }
+        pipeline.permutations.clear();
+        pipeline.states.clear();
+        pipeline.pipeline = VK_NULL_HANDLE;
+    }
+
+    void validatePushConstants(const std::vector<VkPushConstantRange>& ranges) const {
+        const uint32_t maxSize = m_swapChain.GetDevice().GetProperties().limits.maxPushConstantsSize;
+        VkShaderStageFlags usedStages = 0;
+        for (const VkPushConstantRange& range : ranges) {
+            if (range.stageFlags == 0 || range.size == 0 || range.offset % 4 != 0 || range.size % 4 != 0) {
+                throw std::runtime_error("push constant ranges need stages and an offset and size aligned to 4 bytes");
+            }
+            // the end can wrap in 32 bits
+            if (range.size > maxSize || range.offset > maxSize - range.size) {
+                throw std::runtime_error("push constant range [" + std::to_string(range.offset) + ", " + std::to_string(uint64_t{ range.offset } + range.size) + ") exceeds maxPushConstantsSize " + std::to_string(maxSize));
+            }
+            if ((usedStages & range.stageFlags) != 0) {
+                throw std::runtime_error("a shader stage appears in more than one push constant range");
+            }
+            usedStages |= range.stageFlags;
+        }
+    }
+    bool isPushConstantsCovered(PipelineId pipeline, VkShaderStageFlags stages, uint32_t offset, uint32_t size) const {
+        VkShaderStageFlags coveredStages = 0;
+        const uint64_t end = uint64_t{ offset } + size;
+        for (const VkPushConstantRange& range : m_pipelineDescs[pipeline].pipelineLayout.pushConstants) {
+            const uint64_t rangeEnd = uint64_t{ range.offset } + range.size;
+            const bool overlaps = range.offset < end && offset < rangeEnd;
+            if (!overlaps) continue;
+            if ((range.stageFlags & ~stages) != 0) return false;
+            if (range.offset <= offset && end <= rangeEnd) {
+                coveredStages |= range.stageFlags;
+            }
+        }
+        return (stages & ~coveredStages) == 0;
+    }
 
 #pragma endregion
 
@@ -1988,10 +5650,23 @@ public:
     typedef int SubpassId;
 
     SubpassId AddGraphicsSubpass(std::initializer_list<ResourceId> inputs, std::initializer_list<ResourceId> outputs, PipelineId pipeline, SubpassId previous = -1) {
+        if (previous == -1) {
+            return AddGraphicsSubpass(inputs, outputs, pipeline, std::initializer_list<SubpassId>{});
+        }
+        return AddGraphicsSubpass(inputs, outputs, pipeline, { previous });
+    }
+    // `previous` only orders the subpasses, what they access orders them anyway. Any number of subpasses may start or
+    // end the frame.
+    SubpassId AddGraphicsSubpass(std::initializer_list<ResourceId> inputs, std::initializer_list<ResourceId> outputs, PipelineId pipeline, std::initializer_list<SubpassId> previous) {
+        for (SubpassId id : previous) {
+            if (id < 0 || static_cast<size_t>(id) >= m_subpassDescs.size()) {
+                throw std::runtime_error("previous subpass " + std::to_string(id) + " must be added before");
+            }
+        }
         SubpassDescription& subpass = m_subpassDescs.emplace_back();
         subpass.inputResources = std::vector<ResourceId>(inputs);
         subpass.outputResources = std::vector<ResourceId>(outputs);
-        subpass.previousPass = previous;
+        subpass.previousPasses = std::vector<SubpassId>(previous);
         subpass.type = SubpassType::Graphics;
         subpass.index = m_subpassDescs.size() - 1;
         subpass.pipeline = pipeline;
@@ -1999,13 +5674,64 @@ public:
         return subpass.index;
     }
 
+    // Let `subpass` read what earlier subpasses wrote to `resources` at the same pixel. The data stays on-tile instead of
+    // going through memory, the n-th resource is `input_attachment_index = n` in the fragment shader.
+    void AddInputAttachments(SubpassId subpass, std::initializer_list<ResourceId> resources) {
+        std::vector<ResourceId>& inputAttachments = m_subpassDescs.at(subpass).inputAttachments;
+        for (const ResourceId& resource : resources) {
+            if (resource.index == 0) {
+                throw std::runtime_error("the swapchain image can't be read as an input attachment");
+            }
+            inputAttachments.push_back(resource);
+        }
+    }
+
+    // Let `subpass` sample what earlier subpasses wrote to `resources` at any position, e.g. a shadow map or the source
+    // of a blur. Its render pass begins after the ones writing them ended, the images are bound by the caller through
+    // `GetImageView()` in the layout of `GetShaderReadLayout()`. An attachment loaded by the next frame must be used
+    // as an attachment again after its last sampled read.
+    void AddSampledResources(SubpassId subpass, std::initializer_list<ResourceId> resources) {
+        std::vector<ResourceId>& sampledResources = m_subpassDescs.at(subpass).sampledResources;
+        for (const ResourceId& resource : resources) {
+            if (resource.index == 0) {
+                throw std::runtime_error("the swapchain image can't be sampled");
+            }
+            sampledResources.push_back(resource);
+        }
+    }
+
+    // Valid after `Build()`, which recreates the images.
+    VkImageView GetImageView(ResourceId resource) const {
+        return getImage(resource).GetImageView();
+    }
+    // Layout of input attachments and sampled resources while they are read.
+    static VkImageLayout GetShaderReadLayout(ResourceType type) {
+        return type == ResourceType::Depth ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    }
+
+    // Point an input attachment binding at the image of `resource`, it follows the image when it is moved by
+    // `VulkanDefragmenter`. `Build()` recreates the images, update the descriptors again after every build.
+    void UpdateInputAttachmentDescriptor(DescriptorSet::CompiledDescriptorSet& descriptorSet, DescriptorSet::DescriptorSetId setId, uint32_t bindingId, ResourceId resource) const {
+        descriptorSet.UpdateInputAttachmentDescriptor(setId, bindingId, getImage(resource), GetShaderReadLayout(resource.type));
+    }
+
 protected:
+    IVulkanImage& getImage(ResourceId resource) const {
+        if (resource.index >= m_resources.size() || m_resources[resource.index] == nullptr) {
+            throw std::runtime_error("resource " + std::to_string(resource.index) + " has no image, build the frame graph first");
+        }
+        return *m_resources[resource.index];
+    }
+
     struct SubpassDescription {
         std::vector<ResourceId> inputResources;
         std::vector<ResourceId> outputResources;
-        SubpassId previousPass;
+        std::vector<ResourceId> inputAttachments; // read in the fragment shader, in `input_attachment_index` order
+        std::vector<ResourceId> sampledResources; // not attachments of the render pass
+        std::vector<SubpassId> previousPasses;
         SubpassType type;
         uint32_t index;
+        uint32_t renderPass = 0; // set by `schedulePasses()`
 
         PipelineId pipeline;
     };
@@ -2019,297 +5745,1045 @@ public:
             delete resource;
         }
 
+        m_shaderWatcher.reset();
+        stopPipelineWork();
         for (Pipeline& pipeline : m_pipelines) {
-            vkDestroyPipeline(m_swapChain.GetDevice().Get(), pipeline.pipeline, nullptr);
-            vkDestroyPipelineLayout(m_swapChain.GetDevice().Get(), pipeline.layout, nullptr);
+            destroyPipeline(m_swapChain.GetDevice().Get(), pipeline);
         }
-
-        if (m_renderPass != VK_NULL_HANDLE) {
-            vkDestroyRenderPass(m_swapChain.GetDevice().Get(), m_renderPass, nullptr);
+        try {
+            saveWarmupManifest();
+        } catch (const std::exception& e) {
+            std::cout << "[FrameGraph][Error] Failed to save the warmup manifest: " << e.what() << std::endl;
         }
+
+        destroyRenderPasses();
     }
 
     void Build() {
-        createRenderPass();
-        createPipelines();
+        ScratchArena::Scope scope{ m_scratch };
+        // background compiles of a previous build use its render passes
+        stopPipelineWork();
+        destroyRenderPasses();
+        cullPasses();
+        schedulePasses();
+        createResources();
+        createRenderPasses();
+        m_pipelineIdentities.clear();
+        for (const GraphicsPipelineConfig& config : m_pipelineDescs) {
+            m_pipelineIdentities.push_back(config.GetIdentity());
+        }
+        if (m_lazyPipelines) {
+            createPipelinesLazily();
+        } else {
+            createPipelines();
+        }
+    }
+
+    // Culled by the last `Build()`, see `cullPasses()`. Recording skips culled subpasses, binding a culled pipeline throws.
+    bool IsSubpassCulled(SubpassId id) const {
+        return id >= 0 && static_cast<size_t>(id) < m_culledSubpasses.size() && m_culledSubpasses[id];
+    }
+    bool IsPipelineCulled(PipelineId id) const {
+        return id < m_culledPipelines.size() && m_culledPipelines[id];
+    }
+
+    // Render passes are recorded in index order, each one's subpasses are advanced with `vkCmdNextSubpass()`.
+    size_t GetRenderPassCount() const {
+        return m_renderPasses.size();
+    }
+    VkRenderPass GetRenderPass(size_t pass) const {
+        return m_renderPasses.at(pass).renderPass;
+    }
+    uint32_t GetSubpassCount(size_t pass) const {
+        return m_renderPasses.at(pass).subpassCount;
+    }
+    // Views for the framebuffer of `pass` in its attachment order, `swapchainView` stands for the swapchain image.
+    std::vector<VkImageView> GetFramebufferAttachments(size_t pass, VkImageView swapchainView) const {
+        const RenderPass& renderPass = m_renderPasses.at(pass);
+        std::vector<VkImageView> views;
+        views.reserve(renderPass.attachments.size());
+        for (uint32_t attachment : renderPass.attachments) {
+            views.push_back(attachment == 0 ? swapchainView : m_resources[attachment]->GetImageView());
+        }
+        return views;
+    }
+
+    // With `lazy`, `Build()` returns once the render passes exist and pipelines are compiled on a background thread, see
+    // `TryBindPipeline()`. Render states first used in a run are recorded to `warmupManifestPath` when the frame graph is
+    // destroyed, later builds compile them at idle priority. An empty path disables the manifest.
+    void SetLazyPipelines(bool lazy, const std::string& warmupManifestPath = "") {
+        m_lazyPipelines = lazy;
+        m_warmupManifestPath = warmupManifestPath;
+    }
+
+    // Threads compiling pipelines in `Build()`, 0 for one per core. With `mergeCaches` every thread compiles into its own
+    // pipeline cache, they are merged into the device one afterwards.
+    void SetPipelineBuildThreads(size_t threadCount, bool mergeCaches = false) {
+        m_pipelineBuildThreads = threadCount;
+        m_mergePipelineCaches = mergeCaches;
+        m_workerPool.reset();
+    }
+
+    // With VK_EXT_graphics_pipeline_library pipelines are fast linked from libraries shared between configs and render
+    // states. With `optimizeInBackground` the linked ones are replaced by monolithic compiles from a background thread.
+    // Takes effect on the next `Build()`.
+    void SetPipelineLibraries(bool enable, bool optimizeInBackground = true) {
+        m_usePipelineLibraries = enable;
+        m_optimizeLinkedPipelines = optimizeInBackground;
+    }
+
+    // Call once per frame on the recording thread, after submitting the frame. `submitted` is the fence signaled by the
+    // last submission using the pipelines, or null if nothing was submitted. Swaps background optimized and reloaded
+    // pipelines in, the replaced ones are destroyed once a fence of a later `EndFrame()` call has signaled. Without a
+    // fence the device is waited on to destroy them. Fences may be reset and reused for later frames, but must stay
+    // alive as long as the frame graph.
+    void EndFrame(VkFence submitted) {
+        if (submitted != VK_NULL_HANDLE) {
+            m_submissions.push_back(Submission{ submitted, m_frameIndex });
+        }
+        if (m_optimizer.valid() && m_optimizer.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+            applyOptimizations(m_optimizer.get());
+        }
+        swapReloadedPipelines();
+        if (submitted == VK_NULL_HANDLE && !m_retiredPipelines.empty()) {
+            // nothing tells when the gpu is done with them, they would pile up
+            vkDeviceWaitIdle(m_swapChain.GetDevice().Get());
+            destroyRetiredPipelines(true);
+        } else {
+            destroyRetiredPipelines(false);
+        }
+        launchOptimizations();
+        queueShaderReloads();
+        ++m_frameIndex;
+    }
+
+    // Watch the shader files of the pipelines, see `ShaderWatcher`. Pipelines using a changed shader are compiled again
+    // on the background thread and swapped in by `EndFrame()`, the rest of the frame graph is kept. Shaders are loaded
+    // from their files from now on, see `ShaderLibrary::SetFileOverride()`.
+    void SetShaderReload(bool enable) {
+        if (!enable) {
+            m_shaderWatcher.reset();
+            return;
+        }
+        if (m_shaderWatcher != nullptr) return;
+        ShaderLibrary::Get().SetFileOverride(true);
+        m_shaderWatcher = std::make_unique<ShaderWatcher>([this](const std::vector<std::filesystem::path>& changed) {
+            std::lock_guard<std::mutex> lock{ m_reloadMutex };
+            m_changedShaders.insert(changed.begin(), changed.end());
+        });
+        for (const GraphicsPipelineConfig& config : m_pipelineDescs) {
+            watchShaders(config);
+        }
+    }
+
+    // Bytes of transient attachment memory saved by aliasing in the last `Build()`.
+    inline VkDeviceSize GetAliasingSavedBytes() const {
+        return m_aliasingSavedBytes;
     }
 private:
-    void createRenderPass() {
-        // transform m_subpasses into dag.
-        DAG dag{ m_subpassDescs.size() };
-        for (auto& subpass : m_subpassDescs) {
-            if (subpass.previousPass != -1) {
-                dag.AddEdge(subpass.previousPass, subpass.index);
+    struct Lifetime {
+        uint32_t first, last; // subpass indices, inclusive
+        inline bool Overlap(const Lifetime& other) const {
+            if (Dead() || other.Dead()) return false;
+            return !(last < other.first || other.last < first);
+        }
+        // only used by culled subpasses, the attachment is never accessed
+        inline bool Dead() const {
+            return first == LifetimeInfinity && last == 0;
+        }
+    };
+    static constexpr uint32_t LifetimeInfinity = std::numeric_limits<uint32_t>::max();
+
+    // Walks backwards from the attachments needed after the render pass: the presented swapchain image and the ones that
+    // are stored. A subpass is kept if it writes a needed attachment, the attachments it reads become needed too. Kept
+    // subpasses are renumbered into `m_subpasses`, pipelines only used by culled ones aren't compiled.
+    void cullPasses() {
+        std::pmr::vector<bool> needed(m_attachments.size(), false, &m_scratch);
+        for (size_t i = 0; i < m_attachments.size(); ++i) {
+            const VkAttachmentDescription& attachment = m_attachments[i];
+            needed[i] = i == 0 || attachment.finalLayout == VK_IMAGE_LAYOUT_PRESENT_SRC_KHR || attachment.storeOp == VK_ATTACHMENT_STORE_OP_STORE || attachment.stencilStoreOp == VK_ATTACHMENT_STORE_OP_STORE;
+        }
+        std::pmr::vector<bool> live(m_subpassDescs.size(), false, &m_scratch);
+        for (size_t i = m_subpassDescs.size(); i-- > 0; ) {
+            const std::pmr::vector<AttachmentUsage> usages = getAttachmentUsages(m_subpassDescs[i], &m_scratch);
+            live[i] = std::any_of(usages.begin(), usages.end(), [&needed](const AttachmentUsage& usage) { return usage.Writes() && needed[usage.attachment]; });
+            if (!live[i]) continue;
+            for (const AttachmentUsage& usage : usages) {
+                if (usage.Reads()) {
+                    needed[usage.attachment] = true;
+                }
             }
         }
-        size_t startPassId = DAG::EndOfList, endPassId = DAG::EndOfList;
-        if (std::vector<size_t> startPassIds = dag.QueryStartingVertices(); startPassIds.size() == 1) {
-            startPassId = startPassIds[0];
-        } else {
-            throw std::runtime_error("zero or more than one starting pass. require only one starting pass.");
+
+        // a culled previous pass is replaced by its own previous passes
+        std::pmr::vector<SubpassId> remap(m_subpassDescs.size(), -1, &m_scratch);
+        std::string culled;
+        m_subpasses.clear();
+        m_culledSubpasses.assign(m_subpassDescs.size(), false);
+        for (size_t i = 0; i < m_subpassDescs.size(); ++i) {
+            if (!live[i]) {
+                m_culledSubpasses[i] = true;
+                culled += (culled.empty() ? "" : ", ") + std::to_string(i);
+                continue;
+            }
+            SubpassDescription subpass = m_subpassDescs[i];
+            std::pmr::vector<SubpassId> pending{ subpass.previousPasses.begin(), subpass.previousPasses.end(), &m_scratch };
+            subpass.previousPasses.clear();
+            while (!pending.empty()) {
+                const SubpassId previous = pending.back();
+                pending.pop_back();
+                if (live[previous]) {
+                    subpass.previousPasses.push_back(remap[previous]);
+                } else {
+                    pending.insert(pending.end(), m_subpassDescs[previous].previousPasses.begin(), m_subpassDescs[previous].previousPasses.end());
+                }
+            }
+            subpass.index = static_cast<uint32_t>(m_subpasses.size());
+            remap[i] = subpass.index;
+            m_subpasses.push_back(subpass);
         }
-        if (std::vector<size_t> endPassIds = dag.QueryStartingVertices(); endPassIds.size() == 1) {
-            endPassId = endPassIds[0];
-        } else {
-            throw std::runtime_error("zero or more than one ending pass. require only one ending pass.");
+        if (m_subpasses.empty()) {
+            throw std::runtime_error("every subpass was culled, none writes the presented or stored attachments");
         }
 
-        // construct dependencies
-        // https://vulkan-tutorial.com/Drawing_a_triangle/Drawing/Rendering_and_presentation#page_Subpass-dependencies
-        std::vector<VkSubpassDependency> vkDependencies;
-        { // fill in vkDependencies
-            { // add starting pass dependency
-                SubpassDescription& startSubPass = m_subpassDescs[startPassId];
-                VkSubpassDependency dependency{ 0 };
-                dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-                dependency.dstSubpass = startPassId;
-                dependency.srcStageMask = VkPipelineStageFlagBits::VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-                dependency.dstStageMask = getSrcStageMask(startSubPass.inputResources);
-                dependency.srcAccessMask = 0; // FIXME: ?
-                dependency.dstAccessMask = getSrcAccessMask(startSubPass.inputResources);
+        m_culledPipelines.assign(m_pipelineDescs.size(), true);
+        for (const SubpassDescription& subpass : m_subpasses) {
+            m_culledPipelines[subpass.pipeline] = false;
+        }
+        const size_t culledPipelines = std::count(m_culledPipelines.begin(), m_culledPipelines.end(), true);
+        if (!culled.empty() || culledPipelines != 0) {
+            std::cout << "[FrameGraph] Culled " << m_subpassDescs.size() - m_subpasses.size() << " of " << m_subpassDescs.size() << " subpasses (" << (culled.empty() ? "none" : culled) << ") and " << culledPipelines << " of " << m_pipelineDescs.size() << " pipelines, their outputs are never consumed." << std::endl;
+        }
+    }
+    void checkPipelineCulled(PipelineId id) const {
+        if (IsPipelineCulled(id)) {
+            throw std::runtime_error("pipeline " + std::to_string(id) + " was culled, none of its subpasses contributes to the output, skip it when `IsPipelineCulled()`");
+        }
+    }
+    // referenced by any subpass, culled or not
+    bool isAttachmentDescribed(uint32_t attachment) const {
+        return std::any_of(m_subpassDescs.begin(), m_subpassDescs.end(), [attachment](const SubpassDescription& subpass) {
+            for (const std::vector<ResourceId>* resources : { &subpass.inputResources, &subpass.outputResources, &subpass.inputAttachments, &subpass.sampledResources }) {
+                for (const ResourceId& resource : *resources) {
+                    if (resource.index == attachment) return true;
+                }
+            }
+            return false;
+        });
+    }
+
+    // Indices are the ones of `m_subpasses`, in the order of `schedulePasses()`.
+    std::vector<Lifetime> computeLifetimes() const {
+        std::vector<Lifetime> lifetimes(m_attachments.size(), Lifetime{ LifetimeInfinity, 0 });
+        for (const SubpassDescription& subpass : m_subpasses) {
+            for (const std::vector<ResourceId>* resources : { &subpass.inputResources, &subpass.outputResources, &subpass.inputAttachments, &subpass.sampledResources }) {
+                for (const ResourceId& resource : *resources) {
+                    Lifetime& lifetime = lifetimes[resource.index];
+                    lifetime.first = std::min(lifetime.first, subpass.index);
+                    lifetime.last = std::max(lifetime.last, subpass.index);
+                }
+            }
+        }
+        for (size_t i = 0; i < m_attachments.size(); ++i) {
+            const VkAttachmentDescription& attachment = m_attachments[i];
+            if (lifetimes[i].first == LifetimeInfinity) {
+                if (isAttachmentDescribed(static_cast<uint32_t>(i))) continue;
+                // unused attachments are kept alive all the time, they can't alias anything
+                lifetimes[i] = Lifetime{ 0, LifetimeInfinity };
+            }
+            // content comes from before the render pass
+            if (attachment.loadOp == VK_ATTACHMENT_LOAD_OP_LOAD || attachment.stencilLoadOp == VK_ATTACHMENT_LOAD_OP_LOAD) {
+                lifetimes[i].first = 0;
+            }
+            // content is needed after the render pass
+            if (attachment.storeOp == VK_ATTACHMENT_STORE_OP_STORE || attachment.stencilStoreOp == VK_ATTACHMENT_STORE_OP_STORE) {
+                lifetimes[i].last = LifetimeInfinity;
+            }
+        }
+        return lifetimes;
+    }
+
+    // Create images for all attachments except the swapchain one. Attachments whose lifetimes don't overlap share memory.
+    void createResources() {
+        VulkanDevice& device = m_swapChain.GetDevice();
+        for (IVulkanImage* resource : m_resources) {
+            delete resource;
+        }
+        m_resources.assign(m_attachments.size(), nullptr);
+        m_aliasingDependencies.clear();
+        for (VkAttachmentDescription& attachment : m_attachments) {
+            attachment.flags &= ~VK_ATTACHMENT_DESCRIPTION_MAY_ALIAS_BIT;
+        }
 
-                vkDependencies.push_back(dependency);
+        std::vector<Lifetime> lifetimes = computeLifetimes();
+
+        // attachments used by several render passes or sampled go through memory, they can't be transient
+        std::pmr::vector<VkImageUsageFlags> readUsages(m_attachments.size(), 0, &m_scratch);
+        std::pmr::vector<bool> stored(m_attachments.size(), false, &m_scratch);
+        std::pmr::vector<uint32_t> renderPasses(m_attachments.size(), LifetimeInfinity, &m_scratch);
+        for (const SubpassDescription& subpass : m_subpasses) {
+            for (const AttachmentUsage& usage : getAttachmentUsages(subpass, &m_scratch)) {
+                const uint32_t i = usage.attachment;
+                if (usage.access & VK_ACCESS_INPUT_ATTACHMENT_READ_BIT) {
+                    readUsages[i] |= VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT;
+                }
+                if (usage.Sampled()) {
+                    readUsages[i] |= VK_IMAGE_USAGE_SAMPLED_BIT;
+                    stored[i] = true;
+                    continue;
+                }
+                stored[i] = stored[i] || (renderPasses[i] != LifetimeInfinity && renderPasses[i] != subpass.renderPass);
+                renderPasses[i] = subpass.renderPass;
+            }
+        }
+        auto isTransient = [&lifetimes, &stored](size_t i) {
+            return !stored[i] && (lifetimes[i].first != 0 || lifetimes[i].last != LifetimeInfinity);
+        };
+
+        std::vector<VulkanAliasableImage*> images(m_attachments.size(), nullptr);
+        std::vector<VkMemoryRequirements> requirements(m_attachments.size());
+        for (size_t i = 1; i < m_attachments.size(); ++i) {
+            const VkAttachmentDescription& attachment = m_attachments[i];
+            const bool isDepth = m_attachmentTypes[i] == ResourceType::Depth;
+            VkImageUsageFlags usage = isDepth ? VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT : VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+            if (isTransient(i)) {
+                usage |= VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+            }
+            usage |= readUsages[i];
+
+            images[i] = new VulkanAliasableImage{ device, m_swapChain.GetWidth(), m_swapChain.GetHeight(), attachment.format, attachment.samples, usage, isDepth ? IVulkanImage::ImageType::DepthStencil : IVulkanImage::ImageType::Color };
+            m_resources[i] = images[i];
+            requirements[i] = images[i]->GetMemoryRequirements();
+        }
+
+        // greedy interval packing, biggest resources first
+        struct MemorySlot {
+            VkMemoryRequirements requirements;
+            std::vector<size_t> attachments;
+        };
+        std::vector<size_t> order;
+        for (size_t i = 1; i < m_attachments.size(); ++i) order.push_back(i);
+        std::stable_sort(order.begin(), order.end(), [&requirements](size_t a, size_t b) { return requirements[a].size > requirements[b].size; });
+
+        std::vector<MemorySlot> slots;
+        VkDeviceSize requestedBytes = 0;
+        for (size_t i : order) {
+            requestedBytes += requirements[i].size;
+            auto found = std::find_if(slots.begin(), slots.end(), [&](const MemorySlot& slot) {
+                return (slot.requirements.memoryTypeBits & requirements[i].memoryTypeBits) != 0 && std::none_of(slot.attachments.begin(), slot.attachments.end(), [&](size_t other) {
+                    return lifetimes[other].Overlap(lifetimes[i]);
+                });
+            });
+            if (found == slots.end()) {
+                slots.push_back(MemorySlot{ requirements[i], { i } });
+            } else {
+                found->requirements.size = std::max(found->requirements.size, requirements[i].size);
+                found->requirements.alignment = std::max(found->requirements.alignment, requirements[i].alignment);
+                found->requirements.memoryTypeBits &= requirements[i].memoryTypeBits;
+                found->attachments.push_back(i);
+            }
+        }
+
+        VkDeviceSize allocatedBytes = 0;
+        for (MemorySlot& slot : slots) {
+            allocatedBytes += slot.requirements.size;
+            // lazily allocated memory only when every image sharing it is transient
+            const bool transient = std::all_of(slot.attachments.begin(), slot.attachments.end(), isTransient);
+            std::shared_ptr<VulkanMemory> memory = std::make_shared<VulkanMemory>(device, slot.requirements, transient ? VulkanMemory::StoreLocation::Transient : VulkanMemory::StoreLocation::Device, VulkanMemoryAllocator::ResourceKind::Optimal, "frame graph attachment");
+            for (size_t i : slot.attachments) {
+                images[i]->BindMemory(memory);
+            }
+            if (slot.attachments.size() < 2) continue;
+
+            // aliasing barriers: the next user of the memory waits for the writes of the previous one. Attachments of
+            // culled subpasses are never accessed, they need no barrier
+            for (size_t i : slot.attachments) {
+                m_attachments[i].flags |= VK_ATTACHMENT_DESCRIPTION_MAY_ALIAS_BIT;
             }
-            { // add ending pass dependency
-                SubpassDescription& endSubPass = m_subpassDescs[endPassId];
+            slot.attachments.erase(std::remove_if(slot.attachments.begin(), slot.attachments.end(), [&lifetimes](size_t i) { return lifetimes[i].Dead(); }), slot.attachments.end());
+            std::sort(slot.attachments.begin(), slot.attachments.end(), [&lifetimes](size_t a, size_t b) { return lifetimes[a].first < lifetimes[b].first; });
+            for (size_t k = 1; k < slot.attachments.size(); ++k) {
+
+                const size_t previous = slot.attachments[k - 1], next = slot.attachments[k];
                 VkSubpassDependency dependency{ 0 };
-                dependency.srcSubpass  = endPassId;
-                dependency.dstSubpass  = VK_SUBPASS_EXTERNAL;
-                dependency.srcStageMask  = getDstStageMask(endSubPass.outputResources);
-                dependency.dstStageMask  = VkPipelineStageFlagBits::VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-                dependency.srcAccessMask  = getDstAccessMask(endSubPass.outputResources);
-                dependency.dstAccessMask  = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+                dependency.srcSubpass = lifetimes[previous].last;
+                dependency.dstSubpass = lifetimes[next].first;
+                dependency.srcStageMask = getAttachmentStageMask(m_attachmentTypes[previous]) | (readUsages[previous] != 0 ? VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT : 0);
+                dependency.dstStageMask = getAttachmentStageMask(m_attachmentTypes[next]);
+                dependency.srcAccessMask = getAttachmentWriteAccessMask(m_attachmentTypes[previous]);
+                dependency.dstAccessMask = getAttachmentWriteAccessMask(m_attachmentTypes[next]);
+                m_aliasingDependencies.push_back(dependency);
+            }
+        }
+
+        m_aliasingSavedBytes = requestedBytes - allocatedBytes;
+        std::cout << "[FrameGraph] Transient attachments: " << order.size() << " images in " << slots.size() << " memory ranges, " << allocatedBytes << "/" << requestedBytes << " bytes, " << m_aliasingSavedBytes << " bytes saved by aliasing." << std::endl;
+    }
+
+    // Orders the kept subpasses and splits them into render passes. Subpasses are ordered by their previous passes and
+    // by every pair of them with a hazard on an attachment, in the order they were added. Sampling an attachment puts
+    // the subpass in another render pass than the ones using it as an attachment. Render passes are the levels of the
+    // longest path, then every subpass is pulled as late as its consumers allow so producers share the render pass of
+    // what reads them on-tile. Inside a render pass the ready subpass with the fewest layout transitions goes first.
+    // `m_subpasses` is renumbered in that order.
+    void schedulePasses() {
+        const size_t count = m_subpasses.size();
+        DAG dag{ count };
+        std::pmr::set<std::pair<size_t, size_t>> edges{ &m_scratch };
+        std::pmr::set<std::pair<size_t, size_t>> splits{ &m_scratch }; // the head is in a later render pass
+        auto order = [&](size_t from, size_t to, bool split) {
+            if (edges.insert({ from, to }).second) {
+                dag.AddEdge(from, to);
+            }
+            if (split) {
+                splits.insert({ from, to });
+            }
+        };
+
+        struct User {
+            uint32_t subpass;
+            AttachmentUsage usage;
+        };
+        std::pmr::vector<std::pmr::vector<User>> users(m_attachments.size(), &m_scratch);
+        std::pmr::vector<std::pmr::vector<AttachmentUsage>> usages{ &m_scratch };
+        usages.reserve(count);
+        for (const SubpassDescription& subpass : m_subpasses) {
+            for (SubpassId previous : subpass.previousPasses) {
+                order(previous, subpass.index, false);
+            }
+            for (const AttachmentUsage& usage : usages.emplace_back(getAttachmentUsages(subpass, &m_scratch))) {
+                for (const User& user : users[usage.attachment]) {
+                    const bool hazard = user.usage.Writes() || usage.Writes() || user.usage.layout != usage.layout;
+                    const bool split = user.usage.Sampled() != usage.Sampled();
+                    if (hazard || split) {
+                        order(user.subpass, subpass.index, split);
+                    }
+                }
+                users[usage.attachment].push_back(User{ subpass.index, usage });
+            }
+        }
+
+        // index order is a topological order, previous passes and users are always added before
+        std::pmr::vector<uint32_t> level(count, 0, &m_scratch);
+        for (size_t i = 0; i < count; ++i) {
+            for (size_t previous : dag.QueryPrevArcs(i, &m_scratch)) {
+                level[i] = std::max<uint32_t>(level[i], level[previous] + (splits.count({ previous, i }) ? 1 : 0));
+            }
+        }
+        for (size_t i = count; i-- > 0; ) {
+            const std::pmr::vector<size_t> next = dag.QueryNextArcs(i, &m_scratch);
+            if (next.empty()) continue;
+            uint32_t latest = LifetimeInfinity;
+            for (size_t j : next) {
+                latest = std::min<uint32_t>(latest, level[j] - (splits.count({ i, j }) ? 1 : 0));
+            }
+            level[i] = latest;
+        }
+        std::pmr::vector<uint32_t> levels{ level.begin(), level.end(), &m_scratch };
+        std::sort(levels.begin(), levels.end());
+        levels.erase(std::unique(levels.begin(), levels.end()), levels.end());
+
+        std::pmr::vector<size_t> waiting(count, 0, &m_scratch);
+        for (size_t i = 0; i < count; ++i) {
+            waiting[i] = dag.QueryPrevArcs(i, &m_scratch).size();
+        }
+        std::pmr::vector<VkImageLayout> layouts(m_attachments.size(), VK_IMAGE_LAYOUT_UNDEFINED, &m_scratch);
+        std::pmr::vector<bool> scheduled(count, false, &m_scratch);
+        std::pmr::vector<size_t> schedule{ &m_scratch };
+        schedule.reserve(count);
+        m_renderPasses.assign(levels.size(), RenderPass{});
+        for (uint32_t pass = 0; pass < levels.size(); ++pass) {
+            m_renderPasses[pass].firstSubpass = static_cast<uint32_t>(schedule.size());
+            while (true) {
+                size_t best = count, bestTransitions = 0;
+                for (size_t i = 0; i < count; ++i) {
+                    if (scheduled[i] || waiting[i] != 0 || level[i] != levels[pass]) continue;
+                    const size_t transitions = std::count_if(usages[i].begin(), usages[i].end(), [&layouts](const AttachmentUsage& usage) {
+                        return layouts[usage.attachment] != VK_IMAGE_LAYOUT_UNDEFINED && layouts[usage.attachment] != usage.layout;
+                    });
+                    if (best == count || transitions < bestTransitions) {
+                        best = i;
+                        bestTransitions = transitions;
+                    }
+                }
+                if (best == count) break;
+                scheduled[best] = true;
+                schedule.push_back(best);
+                for (const AttachmentUsage& usage : usages[best]) {
+                    layouts[usage.attachment] = usage.layout;
+                }
+                for (size_t next : dag.QueryNextArcs(best, &m_scratch)) {
+                    --waiting[next];
+                }
+            }
+            m_renderPasses[pass].subpassCount = static_cast<uint32_t>(schedule.size()) - m_renderPasses[pass].firstSubpass;
+        }
+        assert(schedule.size() == count && "subpass edges must be acyclic");
 
-                vkDependencies.push_back(dependency);
+        std::pmr::vector<SubpassId> remap(count, -1, &m_scratch);
+        for (size_t k = 0; k < count; ++k) {
+            remap[schedule[k]] = static_cast<SubpassId>(k);
+        }
+        std::vector<SubpassDescription> subpasses;
+        subpasses.reserve(count);
+        for (size_t k = 0; k < count; ++k) {
+            SubpassDescription subpass = m_subpasses[schedule[k]];
+            subpass.index = static_cast<uint32_t>(k);
+            subpass.renderPass = static_cast<uint32_t>(std::lower_bound(levels.begin(), levels.end(), level[schedule[k]]) - levels.begin());
+            for (SubpassId& previous : subpass.previousPasses) {
+                previous = remap[previous];
+            }
+            subpasses.push_back(subpass);
+        }
+        m_subpasses.swap(subpasses);
+        std::cout << "[FrameGraph] Scheduled " << count << " subpasses into " << m_renderPasses.size() << " render passes." << std::endl;
+    }
+    inline uint32_t getLocalSubpass(uint32_t subpass) const {
+        return subpass == VK_SUBPASS_EXTERNAL ? subpass : subpass - m_renderPasses[m_subpasses[subpass].renderPass].firstSubpass;
+    }
+
+    // An attachment keeps its content between the render passes using it: it is stored and loaded again, the layout
+    // of its last use is kept until the next render pass transitions it. Before it is sampled the render pass writing
+    // it transitions it to the shader read layout.
+    void createRenderPasses() {
+        std::pmr::vector<std::pmr::vector<AttachmentUsage>> usages{ &m_scratch };
+        usages.reserve(m_subpasses.size());
+        for (const SubpassDescription& subpass : m_subpasses) {
+            usages.emplace_back(getAttachmentUsages(subpass, &m_scratch));
+        }
+
+        // consecutive uses of an attachment either in one render pass or sampled
+        struct Segment {
+            uint32_t renderPass;
+            bool sampled;
+            VkImageLayout lastLayout;
+        };
+        std::pmr::vector<std::pmr::vector<Segment>> segments(m_attachments.size(), &m_scratch);
+        for (const SubpassDescription& subpass : m_subpasses) {
+            for (const AttachmentUsage& usage : usages[subpass.index]) {
+                std::pmr::vector<Segment>& list = segments[usage.attachment];
+                if (!list.empty() && list.back().sampled == usage.Sampled() && (usage.Sampled() || list.back().renderPass == subpass.renderPass)) {
+                    list.back().lastLayout = usage.layout;
+                    continue;
+                }
+                list.push_back(Segment{ subpass.renderPass, usage.Sampled(), usage.layout });
             }
+        }
 
-            std::queue< std::pair<size_t, size_t> > searchQueue;
-            std::vector<bool> visited(m_subpassDescs.size(), false);
-            { // init search
-                for (size_t target : dag.QueryNextArcs(startPassId)) {
-                    searchQueue.push({ startPassId, target });
+        std::pmr::vector<std::pmr::vector<VkSubpassDependency>> dependencies = computeDependencies(&m_scratch);
+        for (uint32_t pass = 0; pass < m_renderPasses.size(); ++pass) {
+            RenderPass& renderPass = m_renderPasses[pass];
+
+            std::pmr::vector<VkAttachmentDescription> attachments{ &m_scratch };
+            std::pmr::vector<uint32_t> local(m_attachments.size(), VK_ATTACHMENT_UNUSED, &m_scratch);
+            renderPass.attachments.clear();
+            for (uint32_t i = 0; i < m_attachments.size(); ++i) {
+                const std::pmr::vector<Segment>& list = segments[i];
+                auto found = std::find_if(list.begin(), list.end(), [pass](const Segment& segment) { return !segment.sampled && segment.renderPass == pass; });
+                if (found == list.end()) continue;
+
+                VkAttachmentDescription description = m_attachments[i];
+                const bool stencil = description.stencilLoadOp != VK_ATTACHMENT_LOAD_OP_DONT_CARE || description.stencilStoreOp != VK_ATTACHMENT_STORE_OP_DONT_CARE;
+                if (found != list.begin()) {
+                    description.initialLayout = std::prev(found)->lastLayout;
+                    description.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+                    description.stencilLoadOp = stencil ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+                }
+                if (std::next(found) != list.end()) {
+                    description.finalLayout = std::next(found)->sampled ? GetShaderReadLayout(m_attachmentTypes[i]) : found->lastLayout;
+                    description.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+                    description.stencilStoreOp = stencil ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
                 }
-                visited[startPassId] = true;
+                local[i] = static_cast<uint32_t>(attachments.size());
+                attachments.push_back(description);
+                renderPass.attachments.push_back(i);
+            }
+
+            // construct descriptions
+            struct SubpassDescriptionStorage {
+                std::pmr::vector<VkAttachmentReference> colorAttachments;
+                std::pmr::vector<VkAttachmentReference> inputAttachments;
+                std::pmr::vector<uint32_t> preserveAttachments;
+                std::optional<VkAttachmentReference> depthStencilAttachment;
+                std::optional<VkAttachmentReference> resolveAttachment;
+            };
+            std::pmr::vector<SubpassDescriptionStorage> subpassDescriptionsStorage{ &m_scratch };
+            for (uint32_t i = 0; i < renderPass.subpassCount; ++i) {
+                subpassDescriptionsStorage.push_back(SubpassDescriptionStorage{
+                    std::pmr::vector<VkAttachmentReference>{ &m_scratch }, std::pmr::vector<VkAttachmentReference>{ &m_scratch }, std::pmr::vector<uint32_t>{ &m_scratch }
+                });
             }
-            
-            while (!searchQueue.empty()) { // search
-                std::pair<size_t, size_t> edge = searchQueue.front();
-                searchQueue.pop();
-
-                SubpassDescription& fromSubpass = m_subpassDescs[edge.first];
-                SubpassDescription& toSubpass   = m_subpassDescs[edge.second];
 
-                VkSubpassDependency dependency{ 0 };
-                dependency.srcSubpass = fromSubpass.index;
-                dependency.dstSubpass = toSubpass.index;
-                dependency.srcStageMask = getDstStageMask(fromSubpass.outputResources);
-                dependency.dstStageMask = getSrcStageMask(toSubpass.inputResources);
-                dependency.srcAccessMask = getDstAccessMask(fromSubpass.outputResources);
-                dependency.dstAccessMask = getSrcAccessMask(toSubpass.inputResources);
-
-                vkDependencies.push_back(dependency);
-
-                if (visited[toSubpass.index] == false) {
-                    for (size_t target : dag.QueryNextArcs(edge.second)) {
-                        searchQueue.push({ edge.second, target });
+            // content needed later in the render pass is preserved by the subpasses in between not using it
+            for (uint32_t a = 0; a < attachments.size(); ++a) {
+                const uint32_t attachment = renderPass.attachments[a];
+                std::pmr::vector<bool> used(renderPass.subpassCount, false, &m_scratch);
+                for (uint32_t i = 0; i < renderPass.subpassCount; ++i) {
+                    const std::pmr::vector<AttachmentUsage>& subpassUsages = usages[renderPass.firstSubpass + i];
+                    used[i] = std::any_of(subpassUsages.begin(), subpassUsages.end(), [attachment](const AttachmentUsage& usage) { return usage.attachment == attachment; });
+                }
+                const VkAttachmentDescription& description = attachments[a];
+                const bool loaded = description.loadOp == VK_ATTACHMENT_LOAD_OP_LOAD || description.stencilLoadOp == VK_ATTACHMENT_LOAD_OP_LOAD;
+                const bool stored = description.storeOp == VK_ATTACHMENT_STORE_OP_STORE || description.stencilStoreOp == VK_ATTACHMENT_STORE_OP_STORE;
+                const uint32_t first = loaded ? 0 : static_cast<uint32_t>(std::find(used.begin(), used.end(), true) - used.begin());
+                const uint32_t last = stored ? renderPass.subpassCount - 1 : static_cast<uint32_t>(used.rend() - std::find(used.rbegin(), used.rend(), true)) - 1;
+                for (uint32_t i = first; i <= last && i < renderPass.subpassCount; ++i) {
+                    if (!used[i]) {
+                        subpassDescriptionsStorage[i].preserveAttachments.push_back(a);
                     }
-                    visited[toSubpass.index] = true;
                 }
             }
-        }
 
-        // construct descriptions
-        struct SubpassDescriptionStorage {
-            std::vector<VkAttachmentReference> colorAttachments;
-            std::vector<VkAttachmentReference> inputAttachments;
-            std::vector<uint32_t> preserveAttachments;
-            std::optional<VkAttachmentReference> depthStencilAttachment;
-            std::optional<VkAttachmentReference> resolveAttachment;
-        };
-        std::vector<SubpassDescriptionStorage> subpassDescriptionsStorage(m_subpassDescs.size());
-        std::vector<VkSubpassDescription> subpassDescription(m_subpassDescs.size());
-        for (size_t i = 0; i < m_subpassDescs.size(); ++i) {
-            SubpassDescription& subpass = m_subpassDescs[i];
-            SubpassDescriptionStorage& storage = subpassDescriptionsStorage[i];
-
-            for (const ResourceId& resource : subpass.inputResources) {
-                switch (resource.type) {
-                    case ResourceType::Color: {
-                        VkAttachmentReference reference{ 0 };
-                        reference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-                        reference.attachment = resource.index;
-
-                        storage.colorAttachments.push_back(reference);
-                        break;
-                    }
-                    case ResourceType::Resolve: {
-                        VkAttachmentReference reference{ 0 };
-                        reference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-                        reference.attachment = resource.index;
+            std::pmr::vector<VkSubpassDescription> subpassDescription(renderPass.subpassCount, &m_scratch);
+            for (uint32_t i = 0; i < renderPass.subpassCount; ++i) {
+                SubpassDescription& subpass = m_subpasses[renderPass.firstSubpass + i];
+                SubpassDescriptionStorage& storage = subpassDescriptionsStorage[i];
 
-                        if (storage.resolveAttachment.has_value()) {
-                            throw std::runtime_error("Multiple resolve targets");
-                        }
-                        storage.resolveAttachment = reference;
-                        break;
-                    }
-                    case ResourceType::Depth: {
-                        VkAttachmentReference reference{ 0 };
-                        reference.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
-                        reference.attachment = resource.index;
+                for (const ResourceId& resource : subpass.inputAttachments) {
+                    VkAttachmentReference reference{ 0 };
+                    reference.layout = GetShaderReadLayout(resource.type);
+                    reference.attachment = local[resource.index];
 
-                        if (storage.depthStencilAttachment.has_value()) {
-                            throw std::runtime_error("Multiple depth targets");
+                    storage.inputAttachments.push_back(reference);
+                }
+                for (const ResourceId& resource : subpass.inputResources) {
+                    switch (resource.type) {
+                        case ResourceType::Color: {
+                            VkAttachmentReference reference{ 0 };
+                            reference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+                            reference.attachment = local[resource.index];
+
+                            storage.colorAttachments.push_back(reference);
+                            break;
+                        }
+                        case ResourceType::Resolve: {
+                            VkAttachmentReference reference{ 0 };
+                            reference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+                            reference.attachment = local[resource.index];
+
+                            if (storage.resolveAttachment.has_value()) {
+                                throw std::runtime_error("Multiple resolve targets");
+                            }
+                            storage.resolveAttachment = reference;
+                            break;
                         }
-                        storage.depthStencilAttachment = reference;
+                        case ResourceType::Depth: {
+                            VkAttachmentReference reference{ 0 };
+                            reference.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+                            reference.attachment = local[resource.index];
+
+                            if (storage.depthStencilAttachment.has_value()) {
+                                throw std::runtime_error("Multiple depth targets");
+                            }
+                            storage.depthStencilAttachment = reference;
+                            break;
+                        }
+                        default:
+                            throw std::runtime_error("Invalid resource type in subpass");
                     }
-                    default:
-                        throw std::runtime_error("Invalid resource type in subpass");
                 }
-            }
-            for (const ResourceId& resource : subpass.outputResources) {
-                switch (resource.type) {
-                    case ResourceType::Color: {
-                        VkAttachmentReference reference{ 0 };
-                        reference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-                        reference.attachment = resource.index;
-
-                        storage.colorAttachments.push_back(reference);
-                        break;
-                    }
-                    case ResourceType::Depth: {
-                        VkAttachmentReference reference{ 0 };
-                        reference.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
-                        reference.attachment = resource.index;
-
-                        if (storage.depthStencilAttachment.has_value()) {
-                            throw std::runtime_error("Multiple depth targets");
+                for (const ResourceId& resource : subpass.outputResources) {
+                    switch (resource.type) {
+                        case ResourceType::Color: {
+                            VkAttachmentReference reference{ 0 };
+                            reference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+                            reference.attachment = local[resource.index];
+
+                            storage.colorAttachments.push_back(reference);
+                            break;
+                        }
+                        case ResourceType::Depth: {
+                            VkAttachmentReference reference{ 0 };
+                            reference.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+                            reference.attachment = local[resource.index];
+
+                            if (storage.depthStencilAttachment.has_value()) {
+                                throw std::runtime_error("Multiple depth targets");
+                            }
+                            storage.depthStencilAttachment = reference;
+                            break;
                         }
-                        storage.depthStencilAttachment = reference;
-                        break;
+                        default:
+                            throw std::runtime_error("Invalid resource type in subpass");
                     }
-                    default:
-                        throw std::runtime_error("Invalid resource type in subpass");
                 }
+
+                VkSubpassDescription description{ 0 };
+                description.colorAttachmentCount = static_cast<uint32_t>(storage.colorAttachments.size());
+                description.pColorAttachments = (storage.colorAttachments.empty() ? nullptr : storage.colorAttachments.data());
+                description.inputAttachmentCount = static_cast<uint32_t>(storage.inputAttachments.size());
+                description.pInputAttachments   = (storage.inputAttachments.empty() ? nullptr : storage.inputAttachments.data());
+                description.preserveAttachmentCount = static_cast<uint32_t>(storage.preserveAttachments.size());
+                description.pPreserveAttachments    = (storage.preserveAttachments.empty()  ? nullptr : storage.preserveAttachments.data());
+                description.pipelineBindPoint      = static_cast<VkPipelineBindPoint>(subpass.type);
+                description.pDepthStencilAttachment = (storage.depthStencilAttachment.has_value() ? &storage.depthStencilAttachment.value() : nullptr);
+                description.pResolveAttachments      = (storage.resolveAttachment.has_value() ? &storage.resolveAttachment.value() : nullptr);
+
+                subpassDescription[i] = description;
             }
 
-            VkSubpassDescription description{ 0 };
-            description.colorAttachmentCount = static_cast<uint32_t>(storage.colorAttachments.size());
-            description.pColorAttachments = (storage.colorAttachments.empty() ? nullptr : storage.colorAttachments.data());
-            description.inputAttachmentCount = static_cast<uint32_t>(storage.inputAttachments.size());
-            description.pInputAttachments   = (storage.inputAttachments.empty() ? nullptr : storage.inputAttachments.data());
-            description.preserveAttachmentCount = static_cast<uint32_t>(storage.preserveAttachments.size());
-            description.pPreserveAttachments    = (storage.preserveAttachments.empty()  ? nullptr : storage.preserveAttachments.data());
-            description.pipelineBindPoint      = static_cast<VkPipelineBindPoint>(subpass.type);
-            description.pDepthStencilAttachment = (storage.depthStencilAttachment.has_value() ? &storage.depthStencilAttachment.value() : nullptr);
-            description.pResolveAttachments      = (storage.resolveAttachment.has_value() ? &storage.resolveAttachment.value() : nullptr);
+            VkRenderPassCreateInfo renderPassInfo{ VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO, nullptr, 0 };
+            renderPassInfo.attachmentCount   = static_cast<uint32_t>(attachments.size());
+            renderPassInfo.pAttachments      = attachments.data();
+            renderPassInfo.subpassCount        = static_cast<uint32_t>(subpassDescription.size());
+            renderPassInfo.pSubpasses         = subpassDescription.data();
+            renderPassInfo.dependencyCount    = static_cast<uint32_t>(dependencies[pass].size());
+            renderPassInfo.pDependencies      = dependencies[pass].data();
 
-            subpassDescription[i] = description;
+            if (VkResult result = vkCreateRenderPass(m_swapChain.GetDevice().Get(), &renderPassInfo, nullptr, &renderPass.renderPass); result!= VK_SUCCESS) {
+                throw std::runtime_error("failed to create render pass");
+            }
         }
-
-        // create render pass
-        VkRenderPassCreateInfo renderPassInfo{ VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO, nullptr, 0 };
-        renderPassInfo.attachmentCount   = static_cast<uint32_t>(m_attachments.size());
-        renderPassInfo.pAttachments      = m_attachments.data();
-        renderPassInfo.subpassCount        = static_cast<uint32_t>(subpassDescription.size());
-        renderPassInfo.pSubpasses         = subpassDescription.data();
-        renderPassInfo.dependencyCount    = static_cast<uint32_t>(vkDependencies.size());
-        renderPassInfo.pDependencies      = vkDependencies.data();
-
-        if (VkResult result = vkCreateRenderPass(m_swapChain.GetDevice().Get(), &renderPassInfo, nullptr, &m_renderPass); result!= VK_SUCCESS) {
-            throw std::runtime_error("failed to create render pass");
+    }
+    void destroyRenderPasses() {
+        for (RenderPass& renderPass : m_renderPasses) {
+            if (renderPass.renderPass != VK_NULL_HANDLE) {
+                vkDestroyRenderPass(m_swapChain.GetDevice().Get(), renderPass.renderPass, nullptr);
+            }
         }
+        m_renderPasses.clear();
     }
     
-    // assumes m_renderPass is created and is not null
+    // assumes the render passes are created
+    // Pipelines are independent, they are compiled on `m_workerPool`. Either all of them are created or none.
     void createPipelines() {
-        m_pipelines.resize(m_pipelineDescs.size());
+        const auto start = std::chrono::steady_clock::now();
+        const VkDevice device = m_swapChain.GetDevice().Get();
+        VulkanPipelineCache& pipelineCache = m_swapChain.GetDevice().GetPipelineCache();
+        if (m_workerPool == nullptr) {
+            m_workerPool = m_pipelineBuildThreads == 0 ? std::make_unique<WorkerPool>() : std::make_unique<WorkerPool>(m_pipelineBuildThreads);
+        }
+        stopPipelineWork();
+
+        // with merging every worker compiles into its own cache, drivers don't serialize on the shared one
+        std::vector<VkPipelineCache> workerCaches;
+        if (m_mergePipelineCaches) {
+            workerCaches = pipelineCache.CreateWorkerCaches(m_workerPool->GetWorkerCount());
+        }
+
+        std::vector<Pipeline> pipelines(m_pipelineDescs.size());
+        try {
+            m_workerPool->ParallelFor(m_pipelineDescs.size(), [&](size_t i, size_t worker) {
+                if (IsPipelineCulled(i)) return;
+                pipelines[i] = createPipeline(m_pipelineDescs[i], i, workerCaches.empty() ? pipelineCache.Get() : workerCaches[worker]);
+            });
+        } catch (...) {
+            for (Pipeline& pipeline : pipelines) {
+                destroyPipeline(device, pipeline);
+            }
+            pipelineCache.Merge(workerCaches);
+            discardOptimizations();
+            throw;
+        }
+        pipelineCache.Merge(workerCaches);
+        for (Pipeline& pipeline : m_pipelines) {
+            destroyPipeline(device, pipeline);
+        }
+        m_pipelines = std::move(pipelines);
+
+        size_t pipelineCount = 0;
+        for (const Pipeline& pipeline : m_pipelines) {
+            pipelineCount += pipeline.permutations.size();
+        }
+        const double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "[FrameGraph] Built " << m_pipelines.size() << " configs into " << pipelineCount << " pipelines on " << m_workerPool->GetWorkerCount() << " threads in " << elapsed << " ms (" << (pipelineCache.GetStatistics().warm ? "warm" : "cold") << " pipeline cache)." << std::endl;
+        if (isLinkingPipelines()) {
+            std::lock_guard<std::mutex> lock{ m_libraryMutex };
+            std::cout << "[FrameGraph] Pipelines were linked from " << m_libraries.size() << " pipeline libraries, " << m_pendingOptimizations.size() << " are optimized in the background." << std::endl;
+        }
+        launchOptimizations();
+        requestWarmup();
+    }
+    // Only the layouts are created, pipelines are compiled on `m_compileQueue`. The declared render states go first,
+    // the ones from the warmup manifest follow at idle priority.
+    void createPipelinesLazily() {
+        stopPipelineWork();
+        std::vector<Pipeline> pipelines(m_pipelineDescs.size());
         for (size_t i = 0; i < m_pipelineDescs.size(); ++i) {
-            m_pipelines[i] = createPipeline(m_pipelineDescs[i], i);
+            if (IsPipelineCulled(i)) continue;
+            createPipelineLayout(m_pipelineDescs[i], pipelines[i]);
+        }
+        for (Pipeline& pipeline : m_pipelines) {
+            destroyPipeline(m_swapChain.GetDevice().Get(), pipeline);
+        }
+        m_pipelines = std::move(pipelines);
+
+        for (PipelineId id = 0; id < m_pipelineDescs.size(); ++id) {
+            if (IsPipelineCulled(id)) continue;
+            requestPermutation(id, m_pipelineDescs[id].renderState, BackgroundQueue::Priority::Urgent, false);
+            for (const GraphicsPipelineConfig::RenderState& state : m_pipelineDescs[id].statePermutations) {
+                requestPermutation(id, state, BackgroundQueue::Priority::Urgent, false);
+            }
+        }
+        requestWarmup();
+        if (m_compileQueue != nullptr) {
+            std::cout << "[FrameGraph] Compiling " << m_compileQueue->GetPendingCount(BackgroundQueue::Priority::Urgent) << " pipelines in the background, " << m_compileQueue->GetPendingCount(BackgroundQueue::Priority::Idle) << " more from the warmup manifest when idle." << std::endl;
+        }
+    }
+    // Everything referring to the current pipelines is dropped, they are about to be replaced. Like the pipelines
+    // themselves, the gpu mustn't use them anymore.
+    void stopPipelineWork() {
+        if (m_compileQueue != nullptr) {
+            m_compileQueue->Clear();
+        }
+        discardReloadedPipelines();
+        discardOptimizations();
+        destroyRetiredPipelines(true);
+        destroyLibraries();
+    }
+
+    // Render states used at runtime, matched to configs by `GraphicsPipelineConfig::GetIdentity()`.
+    struct WarmupEntry {
+        uint64_t configIdentity;
+        GraphicsPipelineConfig::RenderState state;
+    };
+    static_assert(sizeof(WarmupEntry) == sizeof(uint64_t) + sizeof(GraphicsPipelineConfig::RenderState), "warmup entries are written without padding");
+    static constexpr uint32_t WarmupMagic = 0x4d575056; // "VPWM"
+    static constexpr uint32_t WarmupVersion = 1;
+    struct WarmupHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t entrySize;
+        uint32_t entryCount;
+    };
+    // assumes `m_permutationMutex` is locked
+    void recordWarmupState(PipelineId id, const GraphicsPipelineConfig::RenderState& state) {
+        if (m_warmupManifestPath.empty()) return;
+        addWarmupEntry(WarmupEntry{ m_pipelineIdentities.at(id), state });
+    }
+    bool addWarmupEntry(const WarmupEntry& entry) {
+        if (!m_warmupKeys.insert(HashBytes(&entry, sizeof(entry))).second) return false;
+        m_warmupEntries.push_back(entry);
+        m_warmupChanged = true;
+        return true;
+    }
+    // The manifest is read by the first build, later builds reuse the entries in memory.
+    void requestWarmup() {
+        if (m_warmupManifestPath.empty()) return;
+        if (!m_warmupLoaded) {
+            m_warmupLoaded = true;
+            loadWarmupManifest();
+        }
+        std::unordered_multimap<uint64_t, PipelineId> ids;
+        for (PipelineId id = 0; id < m_pipelineIdentities.size(); ++id) {
+            if (IsPipelineCulled(id)) continue;
+            ids.emplace(m_pipelineIdentities[id], id);
+        }
+        std::vector<WarmupEntry> entries;
+        {
+            std::lock_guard<std::mutex> lock{ m_permutationMutex };
+            entries = m_warmupEntries;
+        }
+        for (const WarmupEntry& entry : entries) {
+            auto [begin, end] = ids.equal_range(entry.configIdentity);
+            for (auto it = begin; it != end; ++it) {
+                requestPermutation(it->second, entry.state, BackgroundQueue::Priority::Idle, false);
+            }
+        }
+    }
+    // A missing or mismatching manifest is ignored, it only costs the warmup.
+    void loadWarmupManifest() {
+        std::ifstream file{ m_warmupManifestPath, std::ios::binary };
+        WarmupHeader header;
+        if (!file || !file.read(reinterpret_cast<char*>(&header), sizeof(header))) return;
+        if (header.magic != WarmupMagic || header.version != WarmupVersion || header.entrySize != sizeof(WarmupEntry)) {
+            std::cout << "[FrameGraph] Ignoring incompatible warmup manifest " << m_warmupManifestPath.string() << std::endl;
+            return;
+        }
+        // the count is checked against the file before trusting it with an allocation
+        std::error_code error;
+        const uintmax_t fileSize = std::filesystem::file_size(m_warmupManifestPath, error);
+        if (error || fileSize < sizeof(header) || header.entryCount > (fileSize - sizeof(header)) / sizeof(WarmupEntry)) {
+            std::cout << "[FrameGraph] Ignoring truncated warmup manifest " << m_warmupManifestPath.string() << std::endl;
+            return;
+        }
+        std::vector<WarmupEntry> entries(header.entryCount);
+        if (!file.read(reinterpret_cast<char*>(entries.data()), entries.size() * sizeof(WarmupEntry))) {
+            std::cout << "[FrameGraph] Ignoring truncated warmup manifest " << m_warmupManifestPath.string() << std::endl;
+            return;
+        }
+        std::lock_guard<std::mutex> lock{ m_permutationMutex };
+        for (const WarmupEntry& entry : entries) {
+            addWarmupEntry(entry);
+        }
+        m_warmupChanged = false;
+        std::cout << "[FrameGraph] Loaded " << entries.size() << " render states from warmup manifest " << m_warmupManifestPath.string() << std::endl;
+    }
+    // Written to a temporary file and renamed over the old one, like the pipeline cache.
+    void saveWarmupManifest() {
+        if (m_warmupManifestPath.empty() || !m_warmupChanged) return;
+        const WarmupHeader header{ WarmupMagic, WarmupVersion, sizeof(WarmupEntry), static_cast<uint32_t>(m_warmupEntries.size()) };
+        std::filesystem::path temporary = m_warmupManifestPath;
+        temporary += ".tmp";
+        {
+            std::ofstream file{ temporary, std::ios::binary | std::ios::trunc };
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            file.write(reinterpret_cast<const char*>(m_warmupEntries.data()), m_warmupEntries.size() * sizeof(WarmupEntry));
+            if (!file) {
+                throw std::runtime_error("failed to write " + temporary.string());
+            }
         }
+        std::filesystem::rename(temporary, m_warmupManifestPath);
+        m_warmupChanged = false;
+        std::cout << "[FrameGraph] Saved " << m_warmupEntries.size() << " render states to warmup manifest " << m_warmupManifestPath.string() << std::endl;
     }
-    // assumes m_renderPass is created and is not null
-    Pipeline createPipeline(const GraphicsPipelineConfig& config, const PipelineId id) {
+    // assumes the render passes are created, called from worker threads
+    // With extended dynamic state the declared render states mostly collapse into the same baked state.
+    Pipeline createPipeline(const GraphicsPipelineConfig& config, const PipelineId id, VkPipelineCache cache) {
+        ScratchArena& arena = ScratchArena::ThreadLocal();
+        const VulkanDevice::DynamicStateSupport& support = m_swapChain.GetDevice().GetDynamicStateSupport();
+
+        // the layout reference in `ret` is released if building fails
         Pipeline ret;
+        const PipelineTarget target = findPipelineTarget(id);
+        try {
+            for (size_t i = 0; i <= config.statePermutations.size(); ++i) {
+                const GraphicsPipelineConfig::RenderState baked = (i == 0 ? config.renderState : config.statePermutations[i - 1]).Baked(support);
+                const uint64_t key = baked.GetHash();
+                if (ret.permutations.count(key) != 0) continue;
+
+                ScratchArena::Scope scope{ arena };
+                if (isLinkingPipelines()) {
+                    ret.permutations.emplace(key, linkPipeline(config, target, baked, cache, &arena, ret));
+                    std::lock_guard<std::mutex> lock{ m_permutationMutex };
+                    queueOptimization(config, id, target, key, baked, ret);
+                } else {
+                    ret.permutations.emplace(key, buildPipeline(config, target, baked, cache, &arena, ret));
+                }
+                ret.states.emplace(key, baked);
+            }
+        } catch (...) {
+            destroyPipeline(m_swapChain.GetDevice().Get(), ret);
+            throw;
+        }
+        ret.pipeline = ret.permutations.at(config.renderState.Baked(support).GetHash());
+        return ret;
+    }
 
+    // assumes the render passes are created
+    PipelineTarget findPipelineTarget(PipelineId id) const {
+        auto found = std::find_if(m_subpasses.begin(), m_subpasses.end(), [id](const SubpassDescription& desc) {
+            return desc.pipeline == id;
+        });
+        if (found == m_subpasses.end()) {
+            throw std::runtime_error("failed to find pipeline!");
+        }
+        return PipelineTarget{ found->renderPass, m_renderPasses[found->renderPass].renderPass, getLocalSubpass(found->index) };
+    }
+    // Fixed function state of one pipeline. The create infos point into each other and into the config, so it's
+    // neither copyable nor movable. Filled by `describePipeline()`.
+    struct PipelineStates {
+        explicit PipelineStates(std::pmr::memory_resource* arena) : vertexBindings{ arena }, vertexAttributes{ arena }, shaderStages{ arena }, dynamicStates{ arena } { }
+        PipelineStates(const PipelineStates&) = delete;
+        PipelineStates& operator=(const PipelineStates&) = delete;
+
+        std::pmr::vector<VkVertexInputBindingDescription> vertexBindings;
+        std::pmr::vector<VkVertexInputAttributeDescription> vertexAttributes;
+        VkPipelineVertexInputStateCreateInfo vertexInput;
+        VkPipelineInputAssemblyStateCreateInfo inputAssembly;
+        std::pmr::vector<VkPipelineShaderStageCreateInfo> shaderStages;
+        uint32_t preRasterizationStageCount; // leading stages of `shaderStages`, the fragment stage follows them
+        std::array<VkSpecializationInfo, 2> specializations;
+        std::pmr::vector<VkDynamicState> dynamicStates;
+        VkPipelineDynamicStateCreateInfo dynamicState;
+        VkViewport viewport;
+        VkRect2D scissor;
+        VkPipelineViewportStateCreateInfo viewportState;
+        VkPipelineRasterizationStateCreateInfo rasterizer;
+        VkPipelineDepthStencilStateCreateInfo depthStencil;
+        VkPipelineMultisampleStateCreateInfo multisampling;
+        VkPipelineColorBlendAttachmentState colorBlendAttachment;
+        VkPipelineColorBlendStateCreateInfo colorBlending;
+        PipelineTarget target;
+    };
+    // `state` is baked
+    void describePipeline(const GraphicsPipelineConfig& config, const PipelineTarget& target, const GraphicsPipelineConfig::RenderState& state, PipelineStates& states) {
         #pragma region Vertex Input State
-        std::vector<VkVertexInputBindingDescription> vertexBindings;
-        std::vector<VkVertexInputAttributeDescription> vertexAttributes;
         for (const GraphicsPipelineConfig::VertexInput::BindingDescription& binding : config.vertexInput.m_bindings) {
-            vertexBindings.push_back(binding.vkDescription);
+            states.vertexBindings.push_back(binding.vkDescription);
 
             for (const VkVertexInputAttributeDescription& attribute : binding.attributes) {
-                vertexAttributes.push_back(attribute);
+                states.vertexAttributes.push_back(attribute);
             }
         }
 
-        VkPipelineVertexInputStateCreateInfo vertexInput{ VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO, nullptr, 0 };
-        vertexInput.vertexAttributeDescriptionCount = vertexAttributes.size();
-        vertexInput.pVertexAttributeDescriptions = vertexAttributes.data();
-        vertexInput.vertexBindingDescriptionCount = vertexBindings.size();
-        vertexInput.pVertexBindingDescriptions = vertexBindings.data();
+        states.vertexInput = VkPipelineVertexInputStateCreateInfo{ VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO, nullptr, 0 };
+        states.vertexInput.vertexAttributeDescriptionCount = states.vertexAttributes.size();
+        states.vertexInput.pVertexAttributeDescriptions = states.vertexAttributes.data();
+        states.vertexInput.vertexBindingDescriptionCount = states.vertexBindings.size();
+        states.vertexInput.pVertexBindingDescriptions = states.vertexBindings.data();
         #pragma endregion
 
         #pragma region Input Assembly State
-        VkPipelineInputAssemblyStateCreateInfo inputAssembly{ VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO, nullptr, 0 };
-        inputAssembly.primitiveRestartEnable = VK_FALSE;
-        inputAssembly.topology = config.vertexInput.m_topology;
+        states.inputAssembly = VkPipelineInputAssemblyStateCreateInfo{ VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO, nullptr, 0 };
+        states.inputAssembly.primitiveRestartEnable = state.primitiveRestartEnable;
+        states.inputAssembly.topology = state.topology;
         #pragma endregion
         
         #pragma region Shaders
-        std::vector<VkShaderModule> shaderModules;
-        std::vector<VkPipelineShaderStageCreateInfo> shaderStages;
         constexpr VkPipelineShaderStageCreateInfo shaderStageDefaultTemplate{VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO, nullptr, 0};
         if (!config.vertexShader.Empty()) {
-            shaderModules.emplace_back(VK_NULL_HANDLE);
-            shaderStages.push_back(shaderStageDefaultTemplate);
-            createShaderModule(config.vertexShader, shaderModules.back(), shaderStages.back());
+            states.shaderStages.push_back(shaderStageDefaultTemplate);
+            createShaderStage(config.vertexShader, states.shaderStages.back(), states.specializations[0]);
         }
+        states.preRasterizationStageCount = static_cast<uint32_t>(states.shaderStages.size());
         if (!config.fragmentShader.Empty()) {
-            shaderModules.emplace_back(VK_NULL_HANDLE);
-            shaderStages.push_back(shaderStageDefaultTemplate);
-            createShaderModule(config.fragmentShader, shaderModules.back(), shaderStages.back());
+            states.shaderStages.push_back(shaderStageDefaultTemplate);
+            createShaderStage(config.fragmentShader, states.shaderStages.back(), states.specializations[1]);
         }
         #pragma endregion
 
         #pragma region Viewport State
-        const static std::array<VkDynamicState, 2> dynamicStates = {
-            VK_DYNAMIC_STATE_VIEWPORT,
-            VK_DYNAMIC_STATE_SCISSOR
-        };
-        VkPipelineDynamicStateCreateInfo dynamicState{ VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO, nullptr, 0 };
-        dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
-        dynamicState.pDynamicStates = dynamicStates.data();
+        const VulkanDevice::DynamicStateSupport& support = m_swapChain.GetDevice().GetDynamicStateSupport();
+        states.dynamicStates.insert(states.dynamicStates.end(), { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR });
+        if (support.extendedDynamicState) {
+            states.dynamicStates.insert(states.dynamicStates.end(), {
+                VK_DYNAMIC_STATE_CULL_MODE_EXT,
+                VK_DYNAMIC_STATE_FRONT_FACE_EXT,
+                VK_DYNAMIC_STATE_PRIMITIVE_TOPOLOGY_EXT,
+                VK_DYNAMIC_STATE_DEPTH_TEST_ENABLE_EXT,
+                VK_DYNAMIC_STATE_DEPTH_WRITE_ENABLE_EXT,
+                VK_DYNAMIC_STATE_DEPTH_COMPARE_OP_EXT
+            });
+        }
+        if (support.extendedDynamicState2) {
+            states.dynamicStates.insert(states.dynamicStates.end(), { VK_DYNAMIC_STATE_DEPTH_BIAS_ENABLE_EXT, VK_DYNAMIC_STATE_PRIMITIVE_RESTART_ENABLE_EXT });
+        }
+        states.dynamicState = VkPipelineDynamicStateCreateInfo{ VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO, nullptr, 0 };
+        states.dynamicState.dynamicStateCount = static_cast<uint32_t>(states.dynamicStates.size());
+        states.dynamicState.pDynamicStates = states.dynamicStates.data();
 
         const VkExtent2D swapChainExtent{ m_swapChain.GetWidth(), m_swapChain.GetHeight() };
-        VkViewport viewport{ 0.0f, 0.0f, (float)swapChainExtent.width, (float)swapChainExtent.height, 0.0f, 1.0f }; /* 视窗 */
-        VkRect2D scissor{ {0, 0}, swapChainExtent }; /* 裁剪 */
-        VkPipelineViewportStateCreateInfo viewportState{ VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO, nullptr, 0 };
-        viewportState.scissorCount = 1;
-        viewportState.pScissors = &scissor;
-        viewportState.viewportCount = 1;
-        viewportState.pViewports = &viewport;
+        states.viewport = VkViewport{ 0.0f, 0.0f, (float)swapChainExtent.width, (float)swapChainExtent.height, 0.0f, 1.0f }; /* 视窗 */
+        states.scissor = VkRect2D{ {0, 0}, swapChainExtent }; /* 裁剪 */
+        states.viewportState = VkPipelineViewportStateCreateInfo{ VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO, nullptr, 0 };
+        states.viewportState.scissorCount = 1;
+        states.viewportState.pScissors = &states.scissor;
+        states.viewportState.viewportCount = 1;
+        states.viewportState.pViewports = &states.viewport;
         #pragma endregion
 
         #pragma region Rasterizer State
-        VkPipelineRasterizationStateCreateInfo rasterizer{ VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO, nullptr, 0 };
-		rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
+        VkPipelineRasterizationStateCreateInfo& rasterizer = states.rasterizer;
+        rasterizer = VkPipelineRasterizationStateCreateInfo{ VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO, nullptr, 0 };
+		rasterizer.cullMode = state.cullMode;
 		rasterizer.depthBiasClamp = 0.0f;
 		rasterizer.depthBiasConstantFactor = 0.0f;
-		rasterizer.depthBiasEnable = VK_FALSE;
+		rasterizer.depthBiasEnable = state.depthBiasEnable;
 		rasterizer.depthBiasSlopeFactor = 0.0f;
 		rasterizer.depthClampEnable = VK_FALSE;
-		rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+		rasterizer.frontFace = state.frontFace;
 		rasterizer.lineWidth = 1.0f;
 		rasterizer.polygonMode = VkPolygonMode::VK_POLYGON_MODE_FILL;
 		rasterizer.rasterizerDiscardEnable = VK_FALSE;
         #pragma endregion
 
         #pragma region Depth Stencil State
-        VkPipelineDepthStencilStateCreateInfo depthStencil{ VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO, nullptr, 0 };
-		depthStencil.depthTestEnable = VK_TRUE;
-		depthStencil.depthWriteEnable = VK_TRUE;
-		depthStencil.depthCompareOp = VK_COMPARE_OP_LESS;
+        VkPipelineDepthStencilStateCreateInfo& depthStencil = states.depthStencil;
+        depthStencil = VkPipelineDepthStencilStateCreateInfo{ VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO, nullptr, 0 };
+		depthStencil.depthTestEnable = state.depthTestEnable;
+		depthStencil.depthWriteEnable = state.depthWriteEnable;
+		depthStencil.depthCompareOp = state.depthCompareOp;
 		depthStencil.depthBoundsTestEnable = VK_FALSE;
 		depthStencil.minDepthBounds = 0.0f;
 		depthStencil.maxDepthBounds = 1.0f;
@@ -2319,7 +6793,8 @@ private:
         #pragma endregion
 
         #pragma region Multisample State
-        VkPipelineMultisampleStateCreateInfo multisampling{ VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO, nullptr, 0 };
+        VkPipelineMultisampleStateCreateInfo& multisampling = states.multisampling;
+        multisampling = VkPipelineMultisampleStateCreateInfo{ VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO, nullptr, 0 };
 		multisampling.alphaToCoverageEnable = VK_FALSE;
 		multisampling.alphaToOneEnable = VK_FALSE;
 		multisampling.pSampleMask = nullptr;
@@ -2329,7 +6804,7 @@ private:
         #pragma endregion
 
         #pragma region Color Blend
-        VkPipelineColorBlendAttachmentState colorBlendAttachment;
+        VkPipelineColorBlendAttachmentState& colorBlendAttachment = states.colorBlendAttachment;
 		colorBlendAttachment.blendEnable = VK_FALSE;
 		colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
 		colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
@@ -2339,7 +6814,8 @@ private:
 		colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
 		colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ZERO;
 
-        VkPipelineColorBlendStateCreateInfo colorBlending{ VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO, nullptr, 0 };
+        VkPipelineColorBlendStateCreateInfo& colorBlending = states.colorBlending;
+        colorBlending = VkPipelineColorBlendStateCreateInfo{ VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO, nullptr, 0 };
 		colorBlending.attachmentCount = 1;
 		colorBlending.pAttachments = &colorBlendAttachment;
 		colorBlending.blendConstants[0] = 0.0f;
@@ -2350,72 +6826,418 @@ private:
 		colorBlending.logicOp = VK_LOGIC_OP_COPY;
         #pragma endregion
 
-        #pragma region Pipeline Layout
-        std::vector<VkDescriptorSetLayout> descriptorSetLayout{ config.pipelineLayout.used.size() };
+        states.target = target;
+    }
+    // The layout is created into `ret` by the first build of the config.
+    void createPipelineLayout(const GraphicsPipelineConfig& config, Pipeline& ret) {
+        if (ret.layoutRef != nullptr) return;
+        std::vector<VulkanLayoutCache::DescriptorSetLayout> descriptorSetLayouts(config.pipelineLayout.used.size());
         for (size_t i = 0; i < config.pipelineLayout.used.size(); ++i) {
-            descriptorSetLayout[i] = config.pipelineLayout.descriptorSets->GetLayout(i);
-        }
-
-		VkPipelineLayoutCreateInfo pipelineLayoutInfo{ VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO, nullptr, 0 };
-		pipelineLayoutInfo.pushConstantRangeCount = 0;
-		pipelineLayoutInfo.pPushConstantRanges = nullptr;
-		pipelineLayoutInfo.setLayoutCount = descriptorSetLayout.size();
-		pipelineLayoutInfo.pSetLayouts = descriptorSetLayout.data();
-
-		if (vkCreatePipelineLayout(m_swapChain.GetDevice().Get(), &pipelineLayoutInfo, nullptr, &ret.layout) != VK_SUCCESS) {
-			throw std::runtime_error("failed to create pipeline layout!");
-		}
-        #pragma endregion
-
-        int subpassId = -1;
-        if (auto found = std::find_if(m_subpassDescs.begin(), m_subpassDescs.end(), [id](const SubpassDescription& desc) {
-            return desc.pipeline == id;
-        }); found != m_subpassDescs.end()) {
-            subpassId = found->index;
-        } else {
-            throw std::runtime_error("failed to find pipeline!");
+            descriptorSetLayouts[i] = config.pipelineLayout.descriptorSets->GetLayoutRef(config.pipelineLayout.used[i]);
         }
+        ret.layoutRef = m_swapChain.GetDevice().GetLayoutCache().GetPipelineLayout(descriptorSetLayouts, config.pipelineLayout.pushConstants);
+        ret.layout = ret.layoutRef->handle;
+    }
+    // Monolithic compile, `state` is baked.
+    VkPipeline buildPipeline(const GraphicsPipelineConfig& config, const PipelineTarget& target, const GraphicsPipelineConfig::RenderState& state, VkPipelineCache cache, std::pmr::memory_resource* arena, Pipeline& ret) {
+        createPipelineLayout(config, ret);
+        PipelineStates states{ arena };
+        describePipeline(config, target, state, states);
 
         VkGraphicsPipelineCreateInfo pipelineInfo{ VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO, nullptr, 0 };
 		pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
 		pipelineInfo.basePipelineIndex = -1;
 		pipelineInfo.layout = ret.layout;
-		pipelineInfo.pColorBlendState = &colorBlending;
-		pipelineInfo.pDepthStencilState = &depthStencil;
-		pipelineInfo.pDynamicState = &dynamicState;
-		pipelineInfo.pInputAssemblyState = &inputAssembly;
-		pipelineInfo.pMultisampleState = &multisampling;
-		pipelineInfo.pRasterizationState = &rasterizer;
-		pipelineInfo.stageCount = shaderStages.size();
-		pipelineInfo.pStages = shaderStages.data();
+		pipelineInfo.pColorBlendState = &states.colorBlending;
+		pipelineInfo.pDepthStencilState = &states.depthStencil;
+		pipelineInfo.pDynamicState = &states.dynamicState;
+		pipelineInfo.pInputAssemblyState = &states.inputAssembly;
+		pipelineInfo.pMultisampleState = &states.multisampling;
+		pipelineInfo.pRasterizationState = &states.rasterizer;
+		pipelineInfo.stageCount = states.shaderStages.size();
+		pipelineInfo.pStages = states.shaderStages.data();
 		pipelineInfo.pTessellationState = nullptr;
-		pipelineInfo.pVertexInputState = &vertexInput;
-		pipelineInfo.pViewportState = &viewportState;
-		pipelineInfo.renderPass = m_renderPass;
-		pipelineInfo.subpass = subpassId;
-
-        if (VkResult result = vkCreateGraphicsPipelines(m_swapChain.GetDevice().Get(), VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &ret.pipeline); result != VK_SUCCESS) {
+		pipelineInfo.pVertexInputState = &states.vertexInput;
+		pipelineInfo.pViewportState = &states.viewportState;
+		pipelineInfo.renderPass = target.handle;
+		pipelineInfo.subpass = target.subpass;
+
+        const auto start = std::chrono::steady_clock::now();
+        VkPipeline pipeline;
+        if (VkResult result = vkCreateGraphicsPipelines(m_swapChain.GetDevice().Get(), cache, 1, &pipelineInfo, nullptr, &pipeline); result != VK_SUCCESS) {
 			throw std::runtime_error("failed to create graphics pipeline!");
 		}
+        m_swapChain.GetDevice().GetPipelineCache().RecordBuild(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+        return pipeline;
+    }
+
+    // Parts of a pipeline compiled separately with VK_EXT_graphics_pipeline_library.
+    enum class LibraryPart : VkGraphicsPipelineLibraryFlagsEXT {
+        VertexInput = VK_GRAPHICS_PIPELINE_LIBRARY_VERTEX_INPUT_INTERFACE_BIT_EXT,
+        PreRasterization = VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT,
+        FragmentShader = VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT,
+        FragmentOutput = VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_OUTPUT_INTERFACE_BIT_EXT
+    };
+    struct Library {
+        VkPipeline pipeline; // own
+        VulkanLayoutCache::PipelineLayout layoutRef; // keeps the layout in the key alive
+    };
+    inline bool isLinkingPipelines() const {
+        return m_usePipelineLibraries && m_swapChain.GetDevice().IsGraphicsPipelineLibrarySupported();
+    }
+    // Fast link from the four library parts, each shared by the configs and states agreeing on its part of the state.
+    // `state` is baked.
+    VkPipeline linkPipeline(const GraphicsPipelineConfig& config, const PipelineTarget& target, const GraphicsPipelineConfig::RenderState& state, VkPipelineCache cache, std::pmr::memory_resource* arena, Pipeline& ret) {
+        createPipelineLayout(config, ret);
+        PipelineStates states{ arena };
+        describePipeline(config, target, state, states);
+
+        // keys cover exactly the state each part is created from in `createLibrary()`, fixed state isn't hashed
+        const auto hashShader = [](const GraphicsPipelineConfig::ShaderModule& shader, uint64_t seed) {
+            const uint64_t identity = shader.Empty() ? 0 : shader.GetIdentity();
+            return HashBytes(&identity, sizeof(identity), seed);
+        };
+        const auto hashPart = [&states, layout = ret.layout](LibraryPart part) {
+            uint64_t key = HashBytes(&part, sizeof(part));
+            if (part != LibraryPart::VertexInput) {
+                key = HashBytes(&states.target.renderPass, sizeof(states.target.renderPass), key);
+                key = HashBytes(&states.target.subpass, sizeof(states.target.subpass), key);
+            }
+            if (part == LibraryPart::PreRasterization || part == LibraryPart::FragmentShader) {
+                key = HashBytes(&layout, sizeof(layout), key);
+            }
+            return key;
+        };
+        std::array<uint64_t, 4> keys;
+        keys[0] = hashPart(LibraryPart::VertexInput);
+        keys[0] = HashBytes(states.vertexBindings.data(), states.vertexBindings.size() * sizeof(VkVertexInputBindingDescription), keys[0]);
+        keys[0] = HashBytes(states.vertexAttributes.data(), states.vertexAttributes.size() * sizeof(VkVertexInputAttributeDescription), keys[0]);
+        keys[0] = HashBytes(&state.topology, sizeof(state.topology), keys[0]);
+        keys[0] = HashBytes(&state.primitiveRestartEnable, sizeof(state.primitiveRestartEnable), keys[0]);
+        keys[1] = hashShader(config.vertexShader, hashPart(LibraryPart::PreRasterization));
+        keys[1] = HashBytes(&state.cullMode, sizeof(state.cullMode), keys[1]);
+        keys[1] = HashBytes(&state.frontFace, sizeof(state.frontFace), keys[1]);
+        keys[1] = HashBytes(&state.depthBiasEnable, sizeof(state.depthBiasEnable), keys[1]);
+        keys[2] = hashShader(config.fragmentShader, hashPart(LibraryPart::FragmentShader));
+        keys[2] = HashBytes(&state.depthTestEnable, sizeof(state.depthTestEnable), keys[2]);
+        keys[2] = HashBytes(&state.depthWriteEnable, sizeof(state.depthWriteEnable), keys[2]);
+        keys[2] = HashBytes(&state.depthCompareOp, sizeof(state.depthCompareOp), keys[2]);
+        keys[3] = hashPart(LibraryPart::FragmentOutput);
+
+        std::array<VkPipeline, 4> libraries;
+        constexpr std::array<LibraryPart, 4> parts = { LibraryPart::VertexInput, LibraryPart::PreRasterization, LibraryPart::FragmentShader, LibraryPart::FragmentOutput };
+        for (size_t i = 0; i < parts.size(); ++i) {
+            libraries[i] = getLibrary(parts[i], keys[i], states, cache, ret);
+        }
 
-		for (VkShaderModule shaderModule : shaderModules) {
-            vkDestroyShaderModule(m_swapChain.GetDevice().Get(), shaderModule, nullptr);
+        VkPipelineLibraryCreateInfoKHR libraryInfo{ VK_STRUCTURE_TYPE_PIPELINE_LIBRARY_CREATE_INFO_KHR, nullptr, static_cast<uint32_t>(libraries.size()), libraries.data() };
+        VkGraphicsPipelineCreateInfo pipelineInfo{ VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO, &libraryInfo, 0 };
+        pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+        pipelineInfo.basePipelineIndex = -1;
+        pipelineInfo.layout = ret.layout;
+
+        VkPipeline pipeline;
+        if (VkResult result = vkCreateGraphicsPipelines(m_swapChain.GetDevice().Get(), cache, 1, &pipelineInfo, nullptr, &pipeline); result != VK_SUCCESS) {
+            throw std::runtime_error("failed to link graphics pipeline!");
+        }
+        return pipeline;
+    }
+    // Libraries are compiled outside of the lock, a racing thread's duplicate is thrown away.
+    VkPipeline getLibrary(LibraryPart part, uint64_t key, const PipelineStates& states, VkPipelineCache cache, const Pipeline& pipeline) {
+        {
+            std::lock_guard<std::mutex> lock{ m_libraryMutex };
+            if (auto found = m_libraries.find(key); found != m_libraries.end()) {
+                return found->second.pipeline;
+            }
+        }
+        const VkPipeline library = createLibrary(part, states, cache, pipeline.layout);
+        std::lock_guard<std::mutex> lock{ m_libraryMutex };
+        auto [found, inserted] = m_libraries.emplace(key, Library{ library, pipeline.layoutRef });
+        if (!inserted) {
+            vkDestroyPipeline(m_swapChain.GetDevice().Get(), library, nullptr);
+        }
+        return found->second.pipeline;
+    }
+    VkPipeline createLibrary(LibraryPart part, const PipelineStates& states, VkPipelineCache cache, VkPipelineLayout layout) {
+        VkGraphicsPipelineLibraryCreateInfoEXT libraryInfo{ VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_LIBRARY_CREATE_INFO_EXT, nullptr, static_cast<VkGraphicsPipelineLibraryFlagsEXT>(part) };
+        VkGraphicsPipelineCreateInfo pipelineInfo{ VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO, &libraryInfo, VK_PIPELINE_CREATE_LIBRARY_BIT_KHR };
+        pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+        pipelineInfo.basePipelineIndex = -1;
+        // dynamic states of other parts are ignored
+        pipelineInfo.pDynamicState = &states.dynamicState;
+        switch (part) {
+            case LibraryPart::VertexInput:
+                pipelineInfo.pVertexInputState = &states.vertexInput;
+                pipelineInfo.pInputAssemblyState = &states.inputAssembly;
+                break;
+            case LibraryPart::PreRasterization:
+                pipelineInfo.stageCount = states.preRasterizationStageCount;
+                pipelineInfo.pStages = states.shaderStages.data();
+                pipelineInfo.pViewportState = &states.viewportState;
+                pipelineInfo.pRasterizationState = &states.rasterizer;
+                pipelineInfo.layout = layout;
+                break;
+            case LibraryPart::FragmentShader:
+                pipelineInfo.stageCount = static_cast<uint32_t>(states.shaderStages.size()) - states.preRasterizationStageCount;
+                pipelineInfo.pStages = states.shaderStages.data() + states.preRasterizationStageCount;
+                pipelineInfo.pDepthStencilState = &states.depthStencil;
+                pipelineInfo.pMultisampleState = &states.multisampling;
+                pipelineInfo.layout = layout;
+                break;
+            case LibraryPart::FragmentOutput:
+                pipelineInfo.pColorBlendState = &states.colorBlending;
+                pipelineInfo.pMultisampleState = &states.multisampling;
+                break;
+        }
+        if (part != LibraryPart::VertexInput) {
+            pipelineInfo.renderPass = states.target.handle;
+            pipelineInfo.subpass = states.target.subpass;
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        VkPipeline library;
+        if (VkResult result = vkCreateGraphicsPipelines(m_swapChain.GetDevice().Get(), cache, 1, &pipelineInfo, nullptr, &library); result != VK_SUCCESS) {
+            throw std::runtime_error("failed to create graphics pipeline library!");
+        }
+        m_swapChain.GetDevice().GetPipelineCache().RecordBuild(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+        return library;
+    }
+    void destroyLibraries() {
+        std::lock_guard<std::mutex> lock{ m_libraryMutex };
+        for (const auto& [key, library] : m_libraries) {
+            vkDestroyPipeline(m_swapChain.GetDevice().Get(), library.pipeline, nullptr);
+        }
+        m_libraries.clear();
+    }
+
+    // A linked pipeline waiting for its monolithic replacement.
+    struct Optimization {
+        PipelineId id;
+        PipelineTarget target; // copied, the worker doesn't read the render passes
+        uint64_t key; // of the permutation
+        GraphicsPipelineConfig config; // copied, the descriptions may grow while compiling
+        GraphicsPipelineConfig::RenderState state; // baked
+        Pipeline layout; // only holds the layout
+        VkPipeline optimized = VK_NULL_HANDLE;
+        uint32_t generation = 0; // of the pipeline, a shader reload drops the optimization
+    };
+    // assumes `m_permutationMutex` is locked
+    void queueOptimization(const GraphicsPipelineConfig& config, PipelineId id, const PipelineTarget& target, uint64_t key, const GraphicsPipelineConfig::RenderState& state, const Pipeline& pipeline) {
+        if (!m_optimizeLinkedPipelines) return;
+        Optimization& optimization = m_pendingOptimizations.emplace_back(Optimization{ id, target, key, config, state });
+        optimization.layout.layoutRef = pipeline.layoutRef;
+        optimization.layout.layout = pipeline.layout;
+        optimization.generation = pipeline.generation;
+    }
+    // Compile the pending pipelines on a background thread, one batch at a time.
+    void launchOptimizations() {
+        std::lock_guard<std::mutex> lock{ m_permutationMutex };
+        if (m_optimizer.valid() || m_pendingOptimizations.empty()) return;
+        m_optimizer = std::async(std::launch::async, [this, optimizations = std::move(m_pendingOptimizations)]() mutable {
+            ScratchArena& arena = ScratchArena::ThreadLocal();
+            const VkPipelineCache cache = m_swapChain.GetDevice().GetPipelineCache().Get();
+            for (Optimization& optimization : optimizations) {
+                ScratchArena::Scope scope{ arena };
+                try {
+                    optimization.optimized = buildPipeline(optimization.config, optimization.target, optimization.state, cache, &arena, optimization.layout);
+                } catch (const std::exception& e) {
+                    // the linked pipeline stays in use
+                    std::cout << "[FrameGraph][Warning] Failed to optimize pipeline " << optimization.id << ": " << e.what() << std::endl;
+                }
+            }
+            return std::move(optimizations);
+        });
+        m_pendingOptimizations.clear();
+    }
+    // The replaced linked pipelines may still be used by frames in flight, they are retired.
+    void applyOptimizations(std::vector<Optimization> optimizations) {
+        std::lock_guard<std::mutex> lock{ m_permutationMutex };
+        for (Optimization& optimization : optimizations) {
+            if (optimization.optimized == VK_NULL_HANDLE) continue;
+            Pipeline& pipeline = m_pipelines.at(optimization.id);
+            if (pipeline.generation != optimization.generation) {
+                // never used, the linked pipeline was already replaced by a reload
+                vkDestroyPipeline(m_swapChain.GetDevice().Get(), optimization.optimized, nullptr);
+                continue;
+            }
+            VkPipeline& permutation = pipeline.permutations.at(optimization.key);
+            m_retiredPipelines.push_back(RetiredPipeline{ permutation, m_frameIndex });
+            if (pipeline.pipeline == permutation) {
+                pipeline.pipeline = optimization.optimized;
+            }
+            permutation = optimization.optimized;
+        }
+    }
+    // Waits for the running batch, its pipelines and the queued ones are dropped.
+    void discardOptimizations() {
+        if (m_optimizer.valid()) {
+            for (Optimization& optimization : m_optimizer.get()) {
+                if (optimization.optimized != VK_NULL_HANDLE) {
+                    vkDestroyPipeline(m_swapChain.GetDevice().Get(), optimization.optimized, nullptr);
+                }
+            }
+        }
+        std::lock_guard<std::mutex> lock{ m_permutationMutex };
+        m_pendingOptimizations.clear();
+    }
+    struct RetiredPipeline {
+        VkPipeline pipeline; // own
+        uint64_t frame; // `m_frameIndex` when it was replaced, the last frame that may use it
+    };
+    // A submitted frame, see `EndFrame()`.
+    struct Submission {
+        VkFence fence; // borrow
+        uint64_t frame;
+    };
+    // Without `all` only pipelines whose last frame has completed on the gpu are destroyed. A signaled fence proves its
+    // frame and all earlier ones complete: fences signal after everything submitted before them, and a reused fence was
+    // waited on before it was reset.
+    void destroyRetiredPipelines(bool all) {
+        for (size_t i = m_submissions.size(); i > 0; --i) {
+            if (vkGetFenceStatus(m_swapChain.GetDevice().Get(), m_submissions[i - 1].fence) == VK_SUCCESS) {
+                m_completedFrames = std::max(m_completedFrames, m_submissions[i - 1].frame + 1);
+                m_submissions.erase(m_submissions.begin(), m_submissions.begin() + i);
+                break;
+            }
+        }
+        auto end = std::remove_if(m_retiredPipelines.begin(), m_retiredPipelines.end(), [&](const RetiredPipeline& retired) {
+            if (!all && retired.frame >= m_completedFrames) return false;
+            vkDestroyPipeline(m_swapChain.GetDevice().Get(), retired.pipeline, nullptr);
+            return true;
+        });
+        m_retiredPipelines.erase(end, m_retiredPipelines.end());
+    }
+
+    // A pipeline compiled with reloaded shaders, waiting for the frame boundary.
+    struct ReloadedPipeline {
+        PipelineId id;
+        GraphicsPipelineConfig config; // with the reloaded shaders
+        Pipeline pipeline; // the layout is borrowed from the current pipeline
+    };
+    void watchShaders(const GraphicsPipelineConfig& config) {
+        if (m_shaderWatcher == nullptr) return;
+        for (const GraphicsPipelineConfig::ShaderModule* shader : config.GetShaderModules()) {
+            if (!shader->GetFilename().empty()) {
+                m_shaderWatcher->Watch(shader->GetFilename());
+            }
+        }
+    }
+    // Configs using a changed shader are copied and compiled on `m_compileQueue` with every render state they have
+    // permutations for.
+    void queueShaderReloads() {
+        std::set<std::filesystem::path> changed;
+        {
+            std::lock_guard<std::mutex> lock{ m_reloadMutex };
+            changed.swap(m_changedShaders);
+        }
+        if (changed.empty() || m_pipelines.size() != m_pipelineDescs.size()) return;
+
+        const VulkanDevice::DynamicStateSupport& support = m_swapChain.GetDevice().GetDynamicStateSupport();
+        for (PipelineId id = 0; id < m_pipelineDescs.size(); ++id) {
+            if (IsPipelineCulled(id)) continue;
+            const GraphicsPipelineConfig& config = m_pipelineDescs[id];
+            const std::array<const GraphicsPipelineConfig::ShaderModule*, 4> shaders = config.GetShaderModules();
+            if (std::none_of(shaders.begin(), shaders.end(), [&](const GraphicsPipelineConfig::ShaderModule* shader) {
+                return !shader->GetFilename().empty() && changed.count(std::filesystem::absolute(shader->GetFilename()).lexically_normal()) != 0;
+            })) continue;
+
+            // the config's state first, it becomes `Pipeline::pipeline`
+            std::vector<GraphicsPipelineConfig::RenderState> states{ config.renderState.Baked(support) };
+            for (const GraphicsPipelineConfig::RenderState& state : config.statePermutations) {
+                states.push_back(state.Baked(support));
+            }
+            {
+                std::lock_guard<std::mutex> lock{ m_permutationMutex };
+                for (const auto& [key, state] : m_pipelines[id].states) {
+                    states.push_back(state);
+                }
+            }
+            if (m_compileQueue == nullptr) {
+                m_compileQueue = std::make_unique<BackgroundQueue>();
+            }
+            m_compileQueue->Push(BackgroundQueue::Priority::Urgent, [this, id, target = findPipelineTarget(id), config, states = std::move(states)]() {
+                reloadPipeline(id, target, config, states);
+            });
         }
-        return ret;
     }
+    // Runs on `m_compileQueue`. Reloads are compiled monolithic, they aren't in a hurry. A shader that fails to load or
+    // compile keeps the current pipeline.
+    void reloadPipeline(PipelineId id, const PipelineTarget& target, const GraphicsPipelineConfig& config, const std::vector<GraphicsPipelineConfig::RenderState>& states) {
+        ScratchArena& arena = ScratchArena::ThreadLocal();
+        const VkPipelineCache cache = m_swapChain.GetDevice().GetPipelineCache().Get();
+        ReloadedPipeline reloaded{ id, config };
+        // the layout isn't replaced by swaps, it's safe to read here
+        reloaded.pipeline.layoutRef = m_pipelines.at(id).layoutRef;
+        reloaded.pipeline.layout = m_pipelines.at(id).layout;
+        try {
+            for (GraphicsPipelineConfig::ShaderModule* shader : reloaded.config.GetShaderModules()) {
+                shader->Reload();
+            }
+            for (const GraphicsPipelineConfig::RenderState& state : states) {
+                const uint64_t key = state.GetHash();
+                if (reloaded.pipeline.permutations.count(key) != 0) continue;
+                ScratchArena::Scope scope{ arena };
+                reloaded.pipeline.permutations.emplace(key, buildPipeline(reloaded.config, target, state, cache, &arena, reloaded.pipeline));
+                reloaded.pipeline.states.emplace(key, state);
+            }
+        } catch (const std::exception& e) {
+            destroyPipeline(m_swapChain.GetDevice().Get(), reloaded.pipeline);
+            std::cout << "[FrameGraph][Error] Failed to reload pipeline " << id << ", keeping the current one: " << e.what() << std::endl;
+            return;
+        }
+        reloaded.pipeline.pipeline = reloaded.pipeline.permutations.at(states.front().GetHash());
 
-    void createShaderModule(const GraphicsPipelineConfig::ShaderModule& sm, VkShaderModule &module, VkPipelineShaderStageCreateInfo &createInfo) {
-        VkShaderModuleCreateInfo shaderCreateInfo{ VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO, nullptr, 0 };
-        shaderCreateInfo.codeSize = sm.m_binaryCode.size();
-        shaderCreateInfo.pCode = reinterpret_cast<const uint32_t*>(sm.m_binaryCode.data());
+        std::lock_guard<std::mutex> lock{ m_reloadMutex };
+        m_reloadedPipelines.push_back(std::move(reloaded));
+    }
+    // Every permutation of a reloaded config is replaced and retired. Queued compiles of the previous shaders are dropped
+    // by the generation check in `compilePermutation()`.
+    void swapReloadedPipelines() {
+        std::vector<ReloadedPipeline> reloadedPipelines;
+        {
+            std::lock_guard<std::mutex> lock{ m_reloadMutex };
+            reloadedPipelines.swap(m_reloadedPipelines);
+        }
+        if (reloadedPipelines.empty()) return;
 
-        if (vkCreateShaderModule(m_swapChain.GetDevice().Get(), &shaderCreateInfo, nullptr, &module) != VK_SUCCESS) {
-            throw std::runtime_error("failed to create shader module!");
+        std::lock_guard<std::mutex> lock{ m_permutationMutex };
+        for (ReloadedPipeline& reloaded : reloadedPipelines) {
+            Pipeline& pipeline = m_pipelines.at(reloaded.id);
+            for (const auto& [key, permutation] : pipeline.permutations) {
+                m_retiredPipelines.push_back(RetiredPipeline{ permutation, m_frameIndex });
+            }
+            pipeline.pipeline = reloaded.pipeline.pipeline;
+            pipeline.permutations = std::move(reloaded.pipeline.permutations);
+            pipeline.states = std::move(reloaded.pipeline.states);
+            pipeline.pending.clear();
+            pipeline.failures.clear();
+            ++pipeline.generation;
+            m_pipelineDescs[reloaded.id] = std::move(reloaded.config);
+            std::cout << "[FrameGraph] Reloaded pipeline " << reloaded.id << " with " << pipeline.permutations.size() << " render states." << std::endl;
+        }
+    }
+    // assumes `m_compileQueue` is idle
+    void discardReloadedPipelines() {
+        std::lock_guard<std::mutex> lock{ m_reloadMutex };
+        for (ReloadedPipeline& reloaded : m_reloadedPipelines) {
+            destroyPipeline(m_swapChain.GetDevice().Get(), reloaded.pipeline);
         }
+        m_reloadedPipelines.clear();
+    }
 
-        createInfo.module = module;
+    // the module is owned by the shared `ShaderBinary`, don't destroy it
+    // `specialization` is storage for the stage's constants, it must live until the pipeline is created
+    void createShaderStage(const GraphicsPipelineConfig::ShaderModule& sm, VkPipelineShaderStageCreateInfo &createInfo, VkSpecializationInfo& specialization) {
+        createInfo.module = sm.m_binary->GetModule(m_swapChain.GetDevice().Get());
         createInfo.pName = sm.m_entryName.c_str();
         createInfo.pSpecializationInfo = nullptr;
+        if (!sm.m_specializationEntries.empty()) {
+            specialization.mapEntryCount = static_cast<uint32_t>(sm.m_specializationEntries.size());
+            specialization.pMapEntries = sm.m_specializationEntries.data();
+            specialization.dataSize = sm.m_specializationData.size();
+            specialization.pData = sm.m_specializationData.data();
+            createInfo.pSpecializationInfo = &specialization;
+        }
         switch (sm.m_type) {
             case GraphicsPipelineConfig::ShaderModule::Type::Vertex:
                 createInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
@@ -2435,22 +7257,70 @@ private:
 
 protected:
     VulkanSwapChain& m_swapChain;
+    // scratch memory of `Build()`, rewound after every build. Pipelines are built on other threads with their own arenas
+    ScratchArena m_scratch;
+    std::unique_ptr<WorkerPool> m_workerPool; // created by the first `Build()`
+    size_t m_pipelineBuildThreads = 0; // 0 for one per core
+    bool m_mergePipelineCaches = false;
+    std::mutex m_permutationMutex; // guards `Pipeline::permutations`, `Pipeline::pending`, `m_pendingOptimizations` and the warmup entries
+
+    // ===================   Lazy Pipelines  ======================
+    bool m_lazyPipelines = false;
+    std::unique_ptr<BackgroundQueue> m_compileQueue; // created by the first background request
+    std::vector<uint64_t> m_pipelineIdentities; // of `m_pipelineDescs` at the last `Build()`
+    std::filesystem::path m_warmupManifestPath;
+    std::vector<WarmupEntry> m_warmupEntries; // loaded and recorded
+    std::unordered_set<uint64_t> m_warmupKeys; // hashes of `m_warmupEntries`
+    bool m_warmupLoaded = false;
+    bool m_warmupChanged = false;
+
+    // ===================   Pipeline Libraries  ======================
+    bool m_usePipelineLibraries = true;
+    bool m_optimizeLinkedPipelines = true;
+    std::mutex m_libraryMutex;
+    std::unordered_map<uint64_t, Library> m_libraries; // keyed by the part and its state, see `linkPipeline()`
+    std::vector<Optimization> m_pendingOptimizations;
+    std::future< std::vector<Optimization> > m_optimizer; // running batch of `m_pendingOptimizations`
+    std::vector<RetiredPipeline> m_retiredPipelines;
+    std::vector<Submission> m_submissions; // not known to be complete, oldest first
+    uint64_t m_frameIndex = 0; // frames ended by `EndFrame()`
+    uint64_t m_completedFrames = 0; // frames known to be complete on the gpu
+
+    // ===================   Shader Reload  ======================
+    std::unique_ptr<ShaderWatcher> m_shaderWatcher; // null unless enabled
+    std::mutex m_reloadMutex; // guards `m_changedShaders` and `m_reloadedPipelines`
+    std::set<std::filesystem::path> m_changedShaders; // reported by `m_shaderWatcher`
+    std::vector<ReloadedPipeline> m_reloadedPipelines; // swapped in by `EndFrame()`
 
     // ===================   Descriptions  ======================
     std::vector< SubpassDescription > m_subpassDescs;
     std::vector< GraphicsPipelineConfig > m_pipelineDescs;
     std::vector< VkAttachmentDescription > m_attachments;
+    std::vector< ResourceType > m_attachmentTypes;
+
+    // A render pass of the schedule, its subpasses are a range of `m_subpasses`.
+    struct RenderPass {
+        VkRenderPass renderPass = VK_NULL_HANDLE; // own
+        uint32_t firstSubpass = 0, subpassCount = 0;
+        std::vector<uint32_t> attachments; // frame graph attachment of every attachment of the render pass
+    };
 
     // =====================   Storages   ======================
-    VkRenderPass m_renderPass = VK_NULL_HANDLE;
+    std::vector< SubpassDescription > m_subpasses; // `m_subpassDescs` left by `cullPasses()`, renumbered
+    std::vector< bool > m_culledSubpasses; // by `SubpassId`, set by `cullPasses()`
+    std::vector< bool > m_culledPipelines; // by `PipelineId`, set by `cullPasses()`
+    std::vector< RenderPass > m_renderPasses; // in execution order, set by `schedulePasses()`
     // raw vk handles inside. remember to destroy!
     std::vector< Pipeline > m_pipelines;
 
     // Notice: own, remember to destroy!
-    // The very first resource is the swapchain image but here doesn't include it actually.
+    // Indexed by attachment. The very first resource is the swapchain image, it's owned by the swapchain so it's always nullptr here.
     // The swapchain image is implicitly included in the outputs.
     std::vector< IVulkanImage* > m_resources;
 
+    std::vector< VkSubpassDependency > m_aliasingDependencies;
+    VkDeviceSize m_aliasingSavedBytes = 0;
+
 private:
     VkFormat findDepthFormat(VkImageTiling tiling, VkFormatFeatureFlags features) {
         std::array<VkFormat, 3> candidates = { 
@@ -2471,110 +7341,263 @@ private:
         throw std::runtime_error("failed to find suitable depth format!");
     }
 
-    VkPipelineStageFlags getSrcStageMask(const std::vector<ResourceId> &inputsOfPass) {
-        if (inputsOfPass.empty()) {
-            return VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
-        }
+    static VkPipelineStageFlags getAttachmentStageMask(ResourceType type) {
+        return type == ResourceType::Depth ? (VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT) : VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    }
+    static VkAccessFlags getAttachmentWriteAccessMask(ResourceType type) {
+        return type == ResourceType::Depth ? VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT : VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    }
+
+    // How a subpass accesses an attachment, matching the references made by `createRenderPasses()`.
+    struct AttachmentUsage {
+        uint32_t attachment;
+        VkPipelineStageFlags firstStages; // where the accesses begin, a dependency into the subpass waits before them
+        VkPipelineStageFlags lastStages; // where they end, a dependency out of the subpass waits for them
+        VkAccessFlags access;
+        VkImageLayout layout;
 
-        VkPipelineStageFlags ret = 0;
-        for (const ResourceId& resource : inputsOfPass) {
-            switch(resource.type) {
+        inline bool Writes() const noexcept {
+            return (access & (VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT)) != 0;
+        }
+        inline bool Reads() const noexcept {
+            return (access & (VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_INPUT_ATTACHMENT_READ_BIT | VK_ACCESS_SHADER_READ_BIT)) != 0;
+        }
+        // through a sampler, not as an attachment of the render pass
+        inline bool Sampled() const noexcept {
+            return (access & VK_ACCESS_SHADER_READ_BIT) != 0;
+        }
+    };
+    // Color attachments are write only, pipelines don't blend. Depth is tested early and written up to the late tests.
+    // Input attachments and sampled resources are read by the fragment shader.
+    std::pmr::vector<AttachmentUsage> getAttachmentUsages(const SubpassDescription& subpass, std::pmr::memory_resource* arena) const {
+        std::pmr::vector<AttachmentUsage> usages{ arena };
+        auto use = [&usages, &subpass](const AttachmentUsage& usage) {
+            auto found = std::find_if(usages.begin(), usages.end(), [&usage](const AttachmentUsage& other) { return other.attachment == usage.attachment; });
+            if (found == usages.end()) {
+                usages.push_back(usage);
+                return;
+            }
+            if (found->layout != usage.layout || found->Sampled() != usage.Sampled()) {
+                throw std::runtime_error("attachment " + std::to_string(usage.attachment) + " is used in conflicting ways by subpass " + std::to_string(subpass.index) + ", it can't read what it writes or sample its attachments");
+            }
+            found->firstStages |= usage.firstStages;
+            found->lastStages |= usage.lastStages;
+            found->access |= usage.access;
+        };
+        for (const ResourceId& resource : subpass.inputResources) {
+            switch (resource.type) {
+                case ResourceType::Color:
                 case ResourceType::Resolve:
-                case ResourceType::Color: {
-                    ret |= VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+                    use(AttachmentUsage{ resource.index, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL });
                     break;
-                }
-                case ResourceType::Depth: {
-                    ret |= VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT; // FIXME: ?
+                case ResourceType::Depth:
+                    use(AttachmentUsage{ resource.index, VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT, VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL });
                     break;
-                }
                 default:
                     throw std::runtime_error("invalid resource type!");
             }
         }
-        return ret;
-    }
-    VkPipelineStageFlags getDstStageMask(const std::vector<ResourceId> outputsOfPass) {
-        if (outputsOfPass.empty()) {
-            return VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-        }
-
-        VkPipelineStageFlags ret = 0;
-        for (const ResourceId& resource : outputsOfPass) {
+        for (const ResourceId& resource : subpass.outputResources) {
             switch (resource.type) {
-                case ResourceType::Color: {
-                    ret |= VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+                case ResourceType::Color:
+                    use(AttachmentUsage{ resource.index, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL });
                     break;
-                }
-                case ResourceType::Depth: {
-                    ret |= VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT; // FIXME:  ?
+                case ResourceType::Depth:
+                    // read only, tests may run early or late
+                    use(AttachmentUsage{ resource.index, VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT, VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL });
                     break;
-                }
                 default:
                     throw std::runtime_error("invalid resource type");
             }
         }
-        return ret;
+        for (const ResourceId& resource : subpass.inputAttachments) {
+            use(AttachmentUsage{ resource.index, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_INPUT_ATTACHMENT_READ_BIT, GetShaderReadLayout(resource.type) });
+        }
+        for (const ResourceId& resource : subpass.sampledResources) {
+            use(AttachmentUsage{ resource.index, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, GetShaderReadLayout(resource.type) });
+        }
+        return usages;
     }
-    VkAccessFlags getSrcAccessMask(const std::vector<ResourceId> &inputsOfPass) {
-        if (inputsOfPass.empty()) {
-            return VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+
+    // Walks the subpasses in schedule order and tracks the last writer and the readers since of every attachment. A
+    // subpass only depends on the ones it has a hazard with: read after write and write after write get a memory
+    // dependency, write after read an execution dependency. Layout transitions count as writes. Attachments are only
+    // accessed at the same pixel, so dependencies inside a render pass are by region. Across render passes the
+    // dependency is an external one of the later render pass, which transitions the layout at its start. Only before
+    // a sampled read the earlier render pass waits for its users itself, it transitions the layout at its end.
+    // Returns the dependencies of every render pass.
+    std::pmr::vector<std::pmr::vector<VkSubpassDependency>> computeDependencies(std::pmr::memory_resource* arena) const {
+        struct User {
+            uint32_t subpass;
+            AttachmentUsage usage;
+        };
+        struct AttachmentState {
+            std::optional<User> writer;
+            std::pmr::vector<User> readers; // since `writer`
+            VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+            bool sampled = false; // the last use is a sampled read
+        };
+        std::pmr::vector<AttachmentState> states{ arena };
+        states.reserve(m_attachments.size());
+        for (size_t i = 0; i < m_attachments.size(); ++i) {
+            states.push_back(AttachmentState{ std::nullopt, std::pmr::vector<User>{ arena } });
+        }
+        std::pmr::vector<std::pmr::vector<AttachmentUsage>> usages{ arena };
+        usages.reserve(m_subpasses.size());
+        std::pmr::vector<bool> sampled(m_attachments.size(), false, arena);
+        for (const SubpassDescription& subpass : m_subpasses) {
+            for (const AttachmentUsage& usage : usages.emplace_back(getAttachmentUsages(subpass, arena))) {
+                sampled[usage.attachment] = sampled[usage.attachment] || usage.Sampled();
+            }
         }
 
-        VkAccessFlags ret = 0;
-        for (const ResourceId& resource : inputsOfPass) {
-            switch (resource.type) {
-                case ResourceType::Resolve:
-                case ResourceType::Color: {
-                    ret |= VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT; // FIXME: ?
-                    break;
+        // the render pass and its subpasses a dependency between two subpasses of the schedule belongs to
+        auto place = [this](uint32_t src, uint32_t dst, bool beforeSampled) {
+            const uint32_t srcPass = src == VK_SUBPASS_EXTERNAL ? 0 : m_subpasses[src].renderPass;
+            const uint32_t dstPass = dst == VK_SUBPASS_EXTERNAL ? 0 : m_subpasses[dst].renderPass;
+            if (src == VK_SUBPASS_EXTERNAL || (dst != VK_SUBPASS_EXTERNAL && srcPass != dstPass && !beforeSampled)) {
+                return std::make_tuple(dstPass, uint32_t{ VK_SUBPASS_EXTERNAL }, getLocalSubpass(dst));
+            }
+            if (dst == VK_SUBPASS_EXTERNAL || srcPass != dstPass) {
+                return std::make_tuple(srcPass, getLocalSubpass(src), uint32_t{ VK_SUBPASS_EXTERNAL });
+            }
+            return std::make_tuple(srcPass, getLocalSubpass(src), getLocalSubpass(dst));
+        };
+        // one dependency per pair of subpasses, masks of all attachments merged
+        std::pmr::map<std::tuple<uint32_t, uint32_t, uint32_t>, VkSubpassDependency> dependencies{ arena };
+        auto depend = [&](uint32_t src, VkPipelineStageFlags srcStages, VkAccessFlags srcAccess, uint32_t dst, VkPipelineStageFlags dstStages, VkAccessFlags dstAccess, bool beforeSampled = false) {
+            const std::tuple<uint32_t, uint32_t, uint32_t> key = place(src, dst, beforeSampled);
+            auto [found, inserted] = dependencies.try_emplace(key, VkSubpassDependency{ std::get<1>(key), std::get<2>(key) });
+            VkSubpassDependency& dependency = found->second;
+            dependency.srcStageMask |= srcStages;
+            dependency.dstStageMask |= dstStages;
+            dependency.srcAccessMask |= srcAccess;
+            dependency.dstAccessMask |= dstAccess;
+            if (dependency.srcSubpass != VK_SUBPASS_EXTERNAL && dependency.dstSubpass != VK_SUBPASS_EXTERNAL) {
+                dependency.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+            }
+        };
+        auto writeAccess = [](const AttachmentUsage& usage) {
+            return usage.access & (VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT);
+        };
+        // store ops run at the attachment stages, even after input attachment reads
+        auto storeStages = [this](uint32_t attachment) {
+            return m_attachmentTypes[attachment] == ResourceType::Depth ? VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT : VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+        };
+
+        for (const SubpassDescription& subpass : m_subpasses) {
+            for (AttachmentUsage usage : usages[subpass.index]) {
+                AttachmentState& state = states[usage.attachment];
+                const VkAttachmentDescription& attachment = m_attachments[usage.attachment];
+                if (!state.writer.has_value() && state.readers.empty()) {
+                    if (usage.Sampled()) {
+                        throw std::runtime_error("attachment " + std::to_string(usage.attachment) + " is sampled by subpass " + std::to_string(subpass.index) + " before it is written");
+                    }
+                    // first use, waits for the previous frame. The swapchain image is ordered by the acquire semaphore
+                    // waiting at the color output stage, everything else by the last accesses of the previous frame.
+                    const bool isDepth = m_attachmentTypes[usage.attachment] == ResourceType::Depth;
+                    if (attachment.loadOp == VK_ATTACHMENT_LOAD_OP_LOAD) {
+                        usage.access |= isDepth ? VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT : VK_ACCESS_COLOR_ATTACHMENT_READ_BIT;
+                    } else {
+                        usage.access |= isDepth ? VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT : VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+                    }
+                    const VkPipelineStageFlags srcStages = storeStages(usage.attachment) | (sampled[usage.attachment] ? VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT : 0);
+                    const VkAccessFlags srcAccess = usage.attachment == 0 ? 0 : getAttachmentWriteAccessMask(m_attachmentTypes[usage.attachment]);
+                    // the load op runs at the attachment stages even when the first use is an input attachment read
+                    usage.firstStages |= isDepth ? VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT : VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+                    depend(VK_SUBPASS_EXTERNAL, srcStages, srcAccess, subpass.index, usage.firstStages, usage.access);
+                    state.writer = User{ subpass.index, usage };
+                    state.layout = usage.layout;
+                    continue;
                 }
-                case ResourceType::Depth: {
-                    ret |= VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT; // FIXME:  ?
-                    break;
+
+                if (usage.Sampled()) {
+                    // the render pass using it last stores it and transitions it at its end, after all of its users.
+                    // Later sampled reads are covered by the same dependencies
+                    if (!state.sampled) {
+                        const VkAccessFlags storeAccess = getAttachmentWriteAccessMask(m_attachmentTypes[usage.attachment]);
+                        depend(state.writer->subpass, state.writer->usage.lastStages | storeStages(usage.attachment), storeAccess, subpass.index, usage.firstStages, usage.access, true);
+                        for (const User& reader : state.readers) {
+                            depend(reader.subpass, reader.usage.lastStages | storeStages(usage.attachment), storeAccess, subpass.index, usage.firstStages, usage.access, true);
+                        }
+                        state.readers.clear();
+                    }
+                    state.readers.push_back(User{ subpass.index, usage });
+                    state.layout = usage.layout;
+                    state.sampled = true;
+                    continue;
                 }
-                default:
-                    throw std::runtime_error("invalid resource type");
-            }
-        }
-        return ret;
-    }
-    VkAccessFlags getDstAccessMask(const std::vector<ResourceId> &outputsOfPass) {
-        if (outputsOfPass.empty()) {
-            return VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-        }
 
-        VkAccessFlags ret  = 0;
-        for (const ResourceId& resource : outputsOfPass) {
-            switch (resource.type) {
-                case ResourceType::Color: {
-                    ret |= VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT; // FIXME: ?
-                    break;
+                const bool transition = usage.layout != state.layout;
+                if (state.writer.has_value()) {
+                    const User& writer = *state.writer;
+                    depend(writer.subpass, writer.usage.lastStages, writeAccess(writer.usage), subpass.index, usage.firstStages, usage.access);
                 }
-                case ResourceType::Depth: {
-                    ret |= VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT; // FIXME: ?
-                    break;
+                if (usage.Writes() || transition) {
+                    for (const User& reader : state.readers) {
+                        depend(reader.subpass, reader.usage.lastStages, 0, subpass.index, usage.firstStages, transition ? usage.access : 0);
+                    }
+                    state.readers.clear();
+                    state.writer = User{ subpass.index, usage };
+                } else {
+                    state.readers.push_back(User{ subpass.index, usage });
                 }
-                default:
-                    throw std::runtime_error("invalid resource type");
+                state.layout = usage.layout;
+                state.sampled = false;
+            }
+        }
+
+        // the content is stored or transitioned to the final layout after the last users, later accesses are ordered
+        // by semaphores and the next frame's external dependencies. After sampled reads no render pass touches it anymore
+        for (uint32_t i = 0; i < states.size(); ++i) {
+            const AttachmentState& state = states[i];
+            const VkAttachmentDescription& attachment = m_attachments[i];
+            // the next frame would load it in `initialLayout`, but it is left in the shader read layout
+            if (state.sampled && (attachment.loadOp == VK_ATTACHMENT_LOAD_OP_LOAD || attachment.stencilLoadOp == VK_ATTACHMENT_LOAD_OP_LOAD)) {
+                throw std::runtime_error("attachment " + std::to_string(i) + " is loaded by the next frame, its last use can't be a sampled read");
             }
+            if (!state.writer.has_value() || state.sampled) continue;
+            if (attachment.storeOp != VK_ATTACHMENT_STORE_OP_STORE && attachment.finalLayout == state.layout) continue;
+            const User& writer = *state.writer;
+            depend(writer.subpass, writer.usage.lastStages | storeStages(i), writeAccess(writer.usage), VK_SUBPASS_EXTERNAL, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0);
+            for (const User& reader : state.readers) {
+                depend(reader.subpass, reader.usage.lastStages | storeStages(i), 0, VK_SUBPASS_EXTERNAL, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0);
+            }
+        }
+
+        std::pmr::vector<std::pmr::vector<VkSubpassDependency>> ret(m_renderPasses.size(), arena);
+        for (const auto& [key, dependency] : dependencies) {
+            ret[std::get<0>(key)].push_back(dependency);
+        }
+        // aliased memory is reused by another image, the accesses aren't related by region
+        for (const VkSubpassDependency& aliasing : m_aliasingDependencies) {
+            const auto [pass, src, dst] = place(aliasing.srcSubpass, aliasing.dstSubpass, false);
+            VkSubpassDependency& dependency = ret[pass].emplace_back(aliasing);
+            dependency.srcSubpass = src;
+            dependency.dstSubpass = dst;
         }
         return ret;
     }
 };
 
-
 class Application {
 public:
     Application() : 
         m_window{"Hello", 800, 600}, 
         m_instance{"Vulkan", m_window.GetRequiredExtensions()},
         m_surface{m_window.CreateSurface(m_instance.Get())},
-        m_device{ m_instance, "discrete gpu:graphics,compute,present,swapchain,anisotropy,rate shading", &m_surface },
+        m_device{ m_instance, "discrete gpu:graphics,compute,transfer,present,swapchain,anisotropy,rate shading", &m_surface },
         m_swapChain{m_device},
         m_frameGraph{m_swapChain},
+        m_defragmenter{m_device},
+        m_uploader{m_device},
         m_descriptorLayout{m_device}
     {
+        // opt-in, it loads the shaders from files relative to the working directory. Before the shaders are loaded,
+        // reloading needs them from files
+        if (const char* reload = std::getenv("SHADER_RELOAD"); reload != nullptr && std::string{ reload } != "0") {
+            m_frameGraph.SetShaderReload(true);
+        }
         FrameGraph::ResourceId swapchain = m_frameGraph.AddColorResource(VkAttachmentLoadOp::VK_ATTACHMENT_LOAD_OP_CLEAR);
 
         DescriptorSet::DescriptorSetId setId = m_descriptorLayout.AddDescriptorSet({
@@ -2582,9 +7605,15 @@ public:
         }, m_swapChain.Count());
         std::unique_ptr<DescriptorSet::CompiledDescriptorSet> descriptorSet = m_descriptorLayout.Compile();
 
+        uploadVertices();
+
         GraphicsPipelineConfig config;
         config.vertexShader.LoadFromFile("shaders/shader.vert.spv");
         config.fragmentShader.LoadFromFile("shaders/shader.frag.spv");
+        config.vertexInput.AddVertexAttributes({
+            GraphicsPipelineConfig::VertexInput::Vec2Attribute(0, offsetof(Vertex, position)),
+            GraphicsPipelineConfig::VertexInput::Vec3Attribute(1, offsetof(Vertex, color)),
+        }, sizeof(Vertex));
         config.pipelineLayout.descriptorSets = std::move(descriptorSet);
         config.pipelineLayout.used = {setId};
         
@@ -2592,6 +7621,7 @@ public:
 
         FrameGraph::SubpassId subpass = m_frameGraph.AddGraphicsSubpass({}, {swapchain}, pipeline);
 
+        m_frameGraph.SetLazyPipelines(true, "pipeline_warmup.bin");
         m_frameGraph.Build();
 
         VulkanCommand::Builder builder;
@@ -2605,10 +7635,73 @@ public:
     }
 
     void run() {
+        m_device.GetAllocator().SetDumpInterval(MemoryDumpInterval);
         while (!m_window.ShouldClose()) {
             glfwPollEvents();
+            m_defragmenter.Step();
+            m_frameGraph.EndFrame(VK_NULL_HANDLE); // nothing is submitted yet
+            m_swapChain.GetImagePool().EndFrame();
+            m_device.GetAllocator().EndFrame();
+        }
+        m_swapChain.GetImagePool().PrintStatistics();
+        m_defragmenter.PrintStatistics();
+        m_uploader.PrintStatistics();
+        ShaderLibrary::Get().PrintStatistics();
+        m_device.GetAllocator().PrintStatistics();
+    }
+private:
+    struct Vertex {
+        float position[2];
+        float color[3];
+    };
+    static constexpr std::array<Vertex, 3> TriangleVertices{ {
+        { { 0.0f, -0.5f }, { 1.0f, 0.0f, 0.0f } },
+        { { 0.5f, 0.5f }, { 0.0f, 1.0f, 0.0f } },
+        { { -0.5f, 0.5f }, { 0.0f, 0.0f, 1.0f } },
+    } };
+
+    // Copies the vertices on the transfer queue. A one-time graphics submission acquires the buffer, so frames can use
+    // it without waiting on the upload.
+    void uploadVertices() {
+        m_vertexBuffer = std::make_unique<VulkanBuffer>(m_device, sizeof(TriangleVertices), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VulkanMemory::StoreLocation::Device, "vertex buffer");
+        m_uploader.UploadBuffer(m_vertexBuffer->Get(), 0, TriangleVertices.data(), sizeof(TriangleVertices), VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT);
+        m_uploader.Flush();
+
+        const VulkanDevice::Queue queue = m_device.GetGraphicsQueue();
+        VkCommandPoolCreateInfo poolInfo{ VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO, nullptr, VK_COMMAND_POOL_CREATE_TRANSIENT_BIT };
+        poolInfo.queueFamilyIndex = queue.index;
+        VkCommandPool commandPool;
+        if (vkCreateCommandPool(m_device.Get(), &poolInfo, nullptr, &commandPool) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create acquire command pool!");
+        }
+        VkCommandBufferAllocateInfo allocInfo{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, nullptr, commandPool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, 1 };
+        VkCommandBuffer commandBuffer;
+        VkResult result = vkAllocateCommandBuffers(m_device.Get(), &allocInfo, &commandBuffer);
+        if (result == VK_SUCCESS) {
+            VkCommandBufferBeginInfo beginInfo{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, nullptr, VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT };
+            vkBeginCommandBuffer(commandBuffer, &beginInfo);
+            std::vector<VkSemaphore> waitSemaphores;
+            std::vector<VkPipelineStageFlags> waitStages;
+            m_uploader.RecordAcquire(commandBuffer, waitSemaphores, waitStages);
+            vkEndCommandBuffer(commandBuffer);
+
+            VkSubmitInfo submitInfo{ VK_STRUCTURE_TYPE_SUBMIT_INFO, nullptr };
+            submitInfo.waitSemaphoreCount = static_cast<uint32_t>(waitSemaphores.size());
+            submitInfo.pWaitSemaphores = waitSemaphores.data();
+            submitInfo.pWaitDstStageMask = waitStages.data();
+            submitInfo.commandBufferCount = 1;
+            submitInfo.pCommandBuffers = &commandBuffer;
+            result = vkQueueSubmit(queue.raw, 1, &submitInfo, VK_NULL_HANDLE);
+            if (result == VK_SUCCESS) {
+                result = vkQueueWaitIdle(queue.raw);
+            }
+        }
+        vkDestroyCommandPool(m_device.Get(), commandPool, nullptr);
+        if (result != VK_SUCCESS) {
+            throw std::runtime_error("failed to acquire the uploaded vertices!");
         }
     }
+
 private: /* GLFW window */
     GLFWWindow m_window;
 
@@ -2616,10 +7709,23 @@ private: /* Vulkan */
     VulkanInstance m_instance;
     VulkanSurface m_surface;
     VulkanDevice m_device;
+    // destroyed after everything using shaders and before the device
+    struct ShaderLibraryScope {
+        ~ShaderLibraryScope() {
+            ShaderLibrary::Get().Clear();
+        }
+    } m_shaderLibraryScope;
     VulkanSwapChain m_swapChain;
     FrameGraph m_frameGraph;
+    VulkanDefragmenter m_defragmenter;
+    VulkanUploader m_uploader;
+    std::unique_ptr<VulkanBuffer> m_vertexBuffer;
 
     DescriptorSet m_descriptorLayout;
+
+    // frames between memory snapshots in memory_stats.jsonl, 0 disables them. `run()` doesn't present frames yet, it
+    // would dump many times a second
+    static constexpr uint32_t MemoryDumpInterval = 0;
 };
 
 int main() {